@@ -0,0 +1,1741 @@
+#include "asmgen.h"
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Symbol naming of the object format the assembler targets
+#ifdef __APPLE__
+#define SYMBOL_PREFIX "_"
+#define LOCAL_PREFIX "L"
+#define EXTERNAL_SUFFIX ""
+#define RODATA_SECTION ".const"
+#else
+#define SYMBOL_PREFIX ""
+#define LOCAL_PREFIX ".L"
+#define EXTERNAL_SUFFIX "@PLT"
+#define RODATA_SECTION ".section .rodata"
+#endif
+
+typedef enum {
+    OPERAND_NONE,
+    OPERAND_VREG,
+    OPERAND_IMM
+} OperandKind;
+
+typedef struct {
+    OperandKind kind;
+    int value; // virtual register or immediate
+} Operand;
+
+typedef enum {
+    IR_MOV,       // dst = a
+    IR_ADD,       // dst = a op b
+    IR_SUB,
+    IR_MUL,
+    IR_DIV,
+    IR_AND,
+    IR_MAX,
+    IR_MIN,
+    IR_NEG,       // dst = -a
+    IR_SET,       // dst = a cond b, 0 or 1
+    IR_LOAD,      // dst = global symbol
+    IR_STORE,     // global symbol = a
+    IR_PARAM,     // dst = incoming argument number `index`
+    IR_CALL,      // dst = symbol(args), dst -1 to drop the result
+    IR_TAIL_CALL, // return symbol(args), at most 6 arguments
+    IR_LABEL,
+    IR_JUMP,
+    IR_BRANCH,    // if (a cond b) goto label
+    IR_RET,       // return a, if any
+    IR_LOC        // source line and column, with -g
+} IrOp;
+
+typedef enum {
+    COND_LT,
+    COND_GT,
+    COND_EQ,
+    COND_NE,
+    COND_LE,
+    COND_GE
+} Cond;
+
+typedef struct {
+    IrOp op;
+    Cond cond;
+    int dst;
+    Operand a;
+    Operand b;
+    int label;
+    int index;          // IR_PARAM; source line of IR_LOC
+    int column;         // IR_LOC
+    const char* symbol; // global, or callee
+    int external;       // callee is in the runtime, called through the PLT
+    Operand* args;
+    int arg_count;
+} Instr;
+
+// Function being lowered: its linear code and virtual registers
+typedef struct {
+    Instr* code;
+    int count;
+    int capacity;
+    int vreg_count;
+    char* wide; // per virtual register: holds a pointer rather than an i32
+    int wide_capacity;
+} Function;
+
+// Stencils as declared, for inlining into their applies: the globals and
+// functions visible at the declaration are the ones the body refers to
+typedef struct DeclaredStencil {
+    StencilEntry* entry;
+    ASTNode* node;
+    VarEntry* vars;
+    FuncEntry* funcs;
+    struct DeclaredStencil* next;
+} DeclaredStencil;
+
+typedef struct {
+    FILE* out;
+    CodeGenContext* ctx;
+    Function fn;
+    int label_counter; // labels are numbered across the whole file
+    DeclaredStencil* stencils;
+    
+    // Stencil being inlined: the canvas, the pixel's local coordinates and
+    // the apply's position. A paint either paints the pixel or, when
+    // paint_value isn't -1, stores the value there (see fill_apply); then
+    // it jumps to pixel_done.
+    int in_stencil;
+    int canvas;
+    int pixel_x;
+    int pixel_y;
+    int offset_x;
+    int offset_y;
+    int paint_value;
+    int pixel_done;
+    
+    // Function being lowered
+    FuncEntry* function;
+    int tail_header;
+    int* params;
+} AsmContext;
+
+// ---------------------------------------------------------------------------
+// Lowering
+
+static Operand imm(int value) {
+    Operand operand = { OPERAND_IMM, value };
+    return operand;
+}
+
+static Operand vreg(int value) {
+    Operand operand = { OPERAND_VREG, value };
+    return operand;
+}
+
+static int new_vreg(AsmContext* as, int wide) {
+    Function* fn = &as->fn;
+    if (fn->vreg_count == fn->wide_capacity) {
+        fn->wide_capacity = fn->wide_capacity ? fn->wide_capacity * 2 : 64;
+        fn->wide = (char*)realloc(fn->wide, fn->wide_capacity);
+    }
+    fn->wide[fn->vreg_count] = wide;
+    return fn->vreg_count++;
+}
+
+static int new_asm_label(AsmContext* as) {
+    return as->label_counter++;
+}
+
+// Appends an instruction; the pointer is only valid until the next one
+static Instr* emit(AsmContext* as, IrOp op) {
+    Function* fn = &as->fn;
+    if (fn->count == fn->capacity) {
+        fn->capacity = fn->capacity ? fn->capacity * 2 : 256;
+        fn->code = (Instr*)realloc(fn->code, sizeof(Instr) * fn->capacity);
+    }
+    Instr* in = &fn->code[fn->count++];
+    memset(in, 0, sizeof(Instr));
+    in->op = op;
+    in->dst = -1;
+    return in;
+}
+
+static void emit_to(AsmContext* as, IrOp op, int dst, Operand a, Operand b) {
+    Instr* in = emit(as, op);
+    in->dst = dst;
+    in->a = a;
+    in->b = b;
+}
+
+static int emit_op(AsmContext* as, IrOp op, Operand a, Operand b) {
+    int dst = new_vreg(as, 0);
+    emit_to(as, op, dst, a, b);
+    return dst;
+}
+
+static int emit_set(AsmContext* as, Cond cond, Operand a, Operand b) {
+    int dst = emit_op(as, IR_SET, a, b);
+    as->fn.code[as->fn.count - 1].cond = cond;
+    return dst;
+}
+
+static void emit_move(AsmContext* as, int dst, Operand value) {
+    Instr* in = emit(as, IR_MOV);
+    in->dst = dst;
+    in->a = value;
+}
+
+static void emit_label_at(AsmContext* as, int label) {
+    emit(as, IR_LABEL)->label = label;
+}
+
+static void emit_jump(AsmContext* as, int label) {
+    emit(as, IR_JUMP)->label = label;
+}
+
+static void emit_branch(AsmContext* as, Cond cond, Operand a, Operand b, int label) {
+    Instr* in = emit(as, IR_BRANCH);
+    in->cond = cond;
+    in->a = a;
+    in->b = b;
+    in->label = label;
+}
+
+// Returns the virtual register holding the result, -1 without `result`
+static int emit_call(AsmContext* as, const char* symbol, int external, Operand* args, int arg_count,
+                     int result) {
+    int dst = result ? new_vreg(as, 0) : -1;
+    Instr* in = emit(as, IR_CALL);
+    in->dst = dst;
+    in->symbol = symbol;
+    in->external = external;
+    in->args = (Operand*)malloc(sizeof(Operand) * (arg_count + 1));
+    memcpy(in->args, args, sizeof(Operand) * arg_count);
+    in->arg_count = arg_count;
+    return dst;
+}
+
+static Operand add_operands(AsmContext* as, Operand a, Operand b) {
+    if (a.kind == OPERAND_IMM && b.kind == OPERAND_IMM) return imm(a.value + b.value);
+    if (b.kind == OPERAND_IMM && b.value == 0) return a;
+    return vreg(emit_op(as, IR_ADD, a, b));
+}
+
+// A variable's value lives in a virtual register ("v12"), is a constant,
+// or for mutable globals is loaded from memory ("@name")
+static void vreg_name(int v, char* name, size_t size) {
+    snprintf(name, size, "v%d", v);
+}
+
+static Cond invert(Cond cond) {
+    switch (cond) {
+        case COND_LT: return COND_GE;
+        case COND_GT: return COND_LE;
+        case COND_EQ: return COND_NE;
+        case COND_NE: return COND_EQ;
+        case COND_LE: return COND_GT;
+        default: return COND_LT;
+    }
+}
+
+static Cond comparison(OpType op) {
+    return op == OP_LESS ? COND_LT : op == OP_GREATER ? COND_GT : COND_EQ;
+}
+
+// Whether the program declares function `name` anywhere; calls to other
+// functions go to the C library, through the PLT
+static int declares_function(ASTNode* node, const char* name) {
+    if (!node) return 0;
+    if (node->type == AST_STATEMENT_LIST) {
+        return declares_function(node->data.list.head, name) ||
+               declares_function(node->data.list.tail, name);
+    }
+    return node->type == AST_FUNC_DEC && strcmp(node->data.func_dec.name, name) == 0;
+}
+
+static Operand lower_expression(ASTNode* node, AsmContext* as, SymbolTable* table);
+static void lower_condition(ASTNode* node, AsmContext* as, SymbolTable* table, int label, int when);
+
+// Canvas coordinate of the current pixel's local coordinate `local`, moved
+// by `delta`
+static Operand canvas_coordinate(AsmContext* as, int local, int offset, Operand delta) {
+    return add_operands(as, vreg(local), add_operands(as, delta, imm(offset)));
+}
+
+static Operand lower_call(ASTNode* node, AsmContext* as, SymbolTable* table, int result) {
+    ASTNode* arg_nodes[100];
+    int arg_count = flatten_list(node->data.func_call.args, arg_nodes, 100);
+    
+    if (is_peek(node, table)) {
+        if (!as->in_stencil || arg_count != 2) {
+            fprintf(stderr, "Error: peek(dx, dy) can only be used in a stencil\n");
+            return imm(0);
+        }
+        Operand dx = lower_expression(arg_nodes[0], as, table);
+        Operand dy = lower_expression(arg_nodes[1], as, table);
+        Operand args[3] = { vreg(as->canvas),
+                            canvas_coordinate(as, as->pixel_x, as->offset_x, dx),
+                            canvas_coordinate(as, as->pixel_y, as->offset_y, dy) };
+        return vreg(emit_call(as, "peek_pixel", 1, args, 3, 1));
+    }
+    
+    Operand args[100];
+    for (int i = 0; i < arg_count; i++) {
+        args[i] = lower_expression(arg_nodes[i], as, table);
+    }
+    int external = !declares_function(as->ctx->program, node->data.func_call.name);
+    return vreg(emit_call(as, node->data.func_call.name, external, args, arg_count, result));
+}
+
+static Operand lower_expression(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    if (!node) return imm(0);
+    
+    int constant;
+    if (fold_constant(node, table, &constant)) {
+        return imm(constant);
+    }
+    
+    switch (node->type) {
+        case AST_IDENTIFIER: {
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            if (!var) {
+                fprintf(stderr, "Error: unknown variable '%s'\n", node->data.identifier.name);
+                return imm(0);
+            }
+            if (var->by_value) {
+                if (var->llvm_name[0] == 'v') return vreg(atoi(var->llvm_name + 1));
+                return imm(atoi(var->llvm_name));
+            }
+            int dst = new_vreg(as, 0);
+            Instr* in = emit(as, IR_LOAD);
+            in->dst = dst;
+            in->symbol = var->llvm_name + 1;
+            return vreg(dst);
+        }
+        
+        case AST_BINARY_OP: {
+            OpType op = node->data.binary_op.op;
+            ASTNode* right_node = node->data.binary_op.right;
+            
+            if (op == OP_AND || op == OP_OR) {
+                if (!(global_effects(right_node, table) & WRITES_GLOBALS)) {
+                    // Short circuit, through the branches of lower_condition
+                    int result = new_vreg(as, 0);
+                    int false_label = new_asm_label(as);
+                    int end_label = new_asm_label(as);
+                    lower_condition(node, as, table, false_label, 0);
+                    emit_move(as, result, imm(1));
+                    emit_jump(as, end_label);
+                    emit_label_at(as, false_label);
+                    emit_move(as, result, imm(0));
+                    emit_label_at(as, end_label);
+                    return vreg(result);
+                }
+                
+                // Both sides run, since the right one writes globals
+                Operand left = lower_expression(node->data.binary_op.left, as, table);
+                Operand right = lower_expression(right_node, as, table);
+                Operand left_bool = vreg(emit_set(as, COND_NE, left, imm(0)));
+                Operand right_bool = vreg(emit_set(as, COND_NE, right, imm(0)));
+                Operand sum = vreg(emit_op(as, IR_ADD, left_bool, right_bool));
+                return vreg(emit_set(as, op == OP_AND ? COND_EQ : COND_NE, sum, imm(op == OP_AND ? 2 : 0)));
+            }
+            
+            Operand left = lower_expression(node->data.binary_op.left, as, table);
+            Operand right = lower_expression(right_node, as, table);
+            switch (op) {
+                case OP_PLUS: return vreg(emit_op(as, IR_ADD, left, right));
+                case OP_MINUS: return vreg(emit_op(as, IR_SUB, left, right));
+                case OP_TIMES: return vreg(emit_op(as, IR_MUL, left, right));
+                case OP_DIVIDE: return vreg(emit_op(as, IR_DIV, left, right));
+                case OP_LESS:
+                case OP_GREATER:
+                case OP_EQUALS:
+                    return vreg(emit_set(as, comparison(op), left, right));
+                default:
+                    return imm(0);
+            }
+        }
+        
+        case AST_UNARY_OP: {
+            Operand operand = lower_expression(node->data.unary_op.operand, as, table);
+            switch (node->data.unary_op.op) {
+                case OP_MINUS:
+                    return vreg(emit_op(as, IR_NEG, operand, imm(0)));
+                case OP_NOT:
+                    return vreg(emit_set(as, COND_EQ, operand, imm(0)));
+                default:
+                    return operand;
+            }
+        }
+        
+        case AST_FUNC_CALL:
+            return lower_call(node, as, table, 1);
+        
+        default:
+            return imm(0);
+    }
+}
+
+// Jumps to `label` when `node` is true (`when` 1) or false (`when` 0), and
+// falls through otherwise. && and || skip their right operand when the
+// left one decides, unless it writes globals.
+static void lower_condition(ASTNode* node, AsmContext* as, SymbolTable* table, int label, int when) {
+    int constant;
+    if (fold_constant(node, table, &constant)) {
+        if ((constant != 0) == when) emit_jump(as, label);
+        return;
+    }
+    
+    if (node->type == AST_UNARY_OP && node->data.unary_op.op == OP_NOT) {
+        lower_condition(node->data.unary_op.operand, as, table, label, !when);
+        return;
+    }
+    
+    if (node->type == AST_BINARY_OP) {
+        OpType op = node->data.binary_op.op;
+        ASTNode* left = node->data.binary_op.left;
+        ASTNode* right = node->data.binary_op.right;
+        
+        if (op == OP_LESS || op == OP_GREATER || op == OP_EQUALS) {
+            Operand a = lower_expression(left, as, table);
+            Operand b = lower_expression(right, as, table);
+            Cond cond = comparison(op);
+            emit_branch(as, when ? cond : invert(cond), a, b, label);
+            return;
+        }
+        
+        if ((op == OP_AND || op == OP_OR) && !(global_effects(right, table) & WRITES_GLOBALS)) {
+            // a && b is false as soon as a is, a || b true as soon as a is
+            int decides = op == OP_OR;
+            if (when == decides) {
+                lower_condition(left, as, table, label, when);
+                lower_condition(right, as, table, label, when);
+            } else {
+                int skip = new_asm_label(as);
+                lower_condition(left, as, table, skip, decides);
+                lower_condition(right, as, table, label, when);
+                emit_label_at(as, skip);
+            }
+            return;
+        }
+    }
+    
+    Operand value = lower_expression(node, as, table);
+    emit_branch(as, when ? COND_NE : COND_EQ, value, imm(0), label);
+}
+
+// A call to the function being lowered, with the right arity
+static int is_self_call(ASTNode* value, AsmContext* as) {
+    if (!value || value->type != AST_FUNC_CALL || !as->function) return 0;
+    if (strcmp(value->data.func_call.name, as->function->name) != 0) return 0;
+    
+    ASTNode* args[100];
+    return flatten_list(value->data.func_call.args, args, 100) == as->function->param_count;
+}
+
+static void lower_return(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    ASTNode* value = node->data.return_stmt.value;
+    ASTNode* arg_nodes[100];
+    
+    if (is_self_call(value, as)) {
+        // Self tail call: new values for the parameters, then back to the
+        // top. The arguments are all evaluated before any parameter changes.
+        int arg_count = flatten_list(value->data.func_call.args, arg_nodes, 100);
+        int temps[100];
+        for (int i = 0; i < arg_count; i++) {
+            temps[i] = new_vreg(as, 0);
+            emit_move(as, temps[i], lower_expression(arg_nodes[i], as, table));
+        }
+        for (int i = 0; i < arg_count; i++) {
+            emit_move(as, as->params[i], vreg(temps[i]));
+        }
+        emit_jump(as, as->tail_header);
+        return;
+    }
+    
+    if (value && value->type == AST_FUNC_CALL && !is_peek(value, table) &&
+        flatten_list(value->data.func_call.args, arg_nodes, 100) <= 6) {
+        // Other calls in tail position reuse the frame when the arguments
+        // all go in registers
+        int arg_count = flatten_list(value->data.func_call.args, arg_nodes, 100);
+        Operand args[6];
+        for (int i = 0; i < arg_count; i++) {
+            args[i] = lower_expression(arg_nodes[i], as, table);
+        }
+        emit_call(as, value->data.func_call.name, !declares_function(as->ctx->program, value->data.func_call.name),
+                  args, arg_count, 0);
+        as->fn.code[as->fn.count - 1].op = IR_TAIL_CALL;
+        return;
+    }
+    
+    Operand result = lower_expression(value, as, table);
+    emit(as, IR_RET)->a = result;
+}
+
+static void lower_paint(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    ASTNode* value = node->data.paint.value;
+    
+    if (as->paint_value >= 0) {
+        // 0-255 for a value, 256 for transparent (see fill_rect)
+        Operand color = imm(256);
+        if (value) {
+            color = lower_expression(value, as, table);
+            color = color.kind == OPERAND_IMM ? imm(color.value & 255)
+                                              : vreg(emit_op(as, IR_AND, color, imm(255)));
+        }
+        emit_move(as, as->paint_value, color);
+    } else {
+        Operand args[4];
+        args[0] = vreg(as->canvas);
+        if (value) {
+            args[3] = lower_expression(value, as, table);
+        }
+        args[1] = canvas_coordinate(as, as->pixel_x, as->offset_x, imm(0));
+        args[2] = canvas_coordinate(as, as->pixel_y, as->offset_y, imm(0));
+        emit_call(as, value ? "paint_pixel" : "clear_pixel", 1, args, value ? 4 : 3, 0);
+    }
+    emit_jump(as, as->pixel_done);
+}
+
+static void lower_statement(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    if (!node) return;
+    
+    if (as->ctx->debug && node->line > 0 && node->type != AST_STATEMENT_LIST && node->type != AST_BLOCK) {
+        Instr* loc = emit(as, IR_LOC);
+        loc->index = node->line;
+        loc->column = node->column;
+    }
+    
+    switch (node->type) {
+        case AST_STATEMENT_LIST:
+            lower_statement(node->data.list.head, as, table);
+            lower_statement(node->data.list.tail, as, table);
+            break;
+        
+        case AST_VAR_DEC: {
+            Operand value = lower_expression(node->data.var_dec.value, as, table);
+            int var = new_vreg(as, 0);
+            char name[16];
+            emit_move(as, var, value);
+            vreg_name(var, name, sizeof(name));
+            add_value(table, node->data.var_dec.name, name);
+            break;
+        }
+        
+        case AST_ASSIGNMENT: {
+            VarEntry* var = lookup_var_entry(table, node->data.assignment.name);
+            if (var && var->readonly) {
+                fprintf(stderr, "Error: cannot assign to '%s'\n", node->data.assignment.name);
+            } else if (var) {
+                Operand value = lower_expression(node->data.assignment.value, as, table);
+                if (var->by_value) {
+                    emit_move(as, atoi(var->llvm_name + 1), value);
+                } else {
+                    Instr* store = emit(as, IR_STORE);
+                    store->a = value;
+                    store->symbol = var->llvm_name + 1;
+                }
+            }
+            break;
+        }
+        
+        case AST_BLOCK:
+            lower_statement(node->data.block.statements, as, table);
+            break;
+        
+        case AST_IF: {
+            // Variables declared inside an arm go out of scope at its end
+            VarEntry* scope = table->vars;
+            int else_label = new_asm_label(as);
+            lower_condition(node->data.if_stmt.condition, as, table, else_label, 0);
+            lower_statement(node->data.if_stmt.then_stmt, as, table);
+            pop_vars(table, scope);
+            
+            if (node->data.if_stmt.else_stmt) {
+                int end_label = new_asm_label(as);
+                emit_jump(as, end_label);
+                emit_label_at(as, else_label);
+                lower_statement(node->data.if_stmt.else_stmt, as, table);
+                pop_vars(table, scope);
+                emit_label_at(as, end_label);
+            } else {
+                emit_label_at(as, else_label);
+            }
+            break;
+        }
+        
+        case AST_FOR: {
+            // for (i in start..end): the bounds are evaluated once and i is
+            // read-only. The test is at the bottom, with one on entry.
+            Operand start = lower_expression(node->data.for_stmt.start, as, table);
+            Operand end = lower_expression(node->data.for_stmt.end, as, table);
+            if (end.kind == OPERAND_VREG) {
+                int bound = new_vreg(as, 0);
+                emit_move(as, bound, end);
+                end = vreg(bound);
+            }
+            int counter = new_vreg(as, 0);
+            int body_label = new_asm_label(as);
+            int exit_label = new_asm_label(as);
+            emit_move(as, counter, start);
+            emit_branch(as, COND_GE, vreg(counter), end, exit_label);
+            emit_label_at(as, body_label);
+            
+            VarEntry* saved = table->vars;
+            char name[16];
+            vreg_name(counter, name, sizeof(name));
+            add_readonly_value(table, node->data.for_stmt.name, name);
+            lower_statement(node->data.for_stmt.body, as, table);
+            pop_vars(table, saved);
+            
+            emit_to(as, IR_ADD, counter, vreg(counter), imm(1));
+            emit_branch(as, COND_LT, vreg(counter), end, body_label);
+            emit_label_at(as, exit_label);
+            break;
+        }
+        
+        case AST_RETURN:
+            if (as->function) {
+                lower_return(node, as, table);
+            } else if (as->in_stencil) {
+                emit_jump(as, as->pixel_done);
+            }
+            break;
+        
+        case AST_PAINT:
+            if (as->in_stencil) {
+                lower_paint(node, as, table);
+            }
+            break;
+        
+        case AST_FUNC_CALL:
+            lower_call(node, as, table, 0);
+            break;
+        
+        default:
+            break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Register allocation: linear scan over live intervals
+//
+// Values live in rbx, r12-r15 (callee-saved, so they survive calls) and
+// r10, r11 (only for values that aren't live across a call). rax, rcx and
+// rdx are scratch registers of the instruction patterns; the argument
+// registers only ever carry arguments, so setting them up for a call
+// never overwrites a value.
+
+#define REGISTER_COUNT 7
+#define CALLEE_SAVED 5
+
+static const char* const reg32[REGISTER_COUNT] = { "%ebx", "%r12d", "%r13d", "%r14d", "%r15d", "%r10d", "%r11d" };
+static const char* const reg64[REGISTER_COUNT] = { "%rbx", "%r12", "%r13", "%r14", "%r15", "%r10", "%r11" };
+static const char* const arg32[6] = { "%edi", "%esi", "%edx", "%ecx", "%r8d", "%r9d" };
+static const char* const arg64[6] = { "%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9" };
+
+typedef struct {
+    int start; // first and last instruction the value is live at, -1 if unused
+    int end;
+    int crosses_call;
+    int reg;   // -1 when spilled
+    int slot;  // stack slot when spilled
+} Interval;
+
+typedef struct {
+    Interval* intervals;
+    int saved;      // callee-saved registers pushed by the prologue
+    int slot_count;
+    int frame_size; // below the pushed registers
+} Allocation;
+
+static int instr_uses(Instr* in, int* uses) {
+    int count = 0;
+    if (in->a.kind == OPERAND_VREG) uses[count++] = in->a.value;
+    if (in->b.kind == OPERAND_VREG) uses[count++] = in->b.value;
+    for (int i = 0; i < in->arg_count; i++) {
+        if (in->args[i].kind == OPERAND_VREG) uses[count++] = in->args[i].value;
+    }
+    return count;
+}
+
+static int ends_block(Instr* in) {
+    return in->op == IR_JUMP || in->op == IR_BRANCH || in->op == IR_RET || in->op == IR_TAIL_CALL;
+}
+
+static void extend(Interval* interval, int position) {
+    if (interval->start < 0 || position < interval->start) interval->start = position;
+    if (position > interval->end) interval->end = position;
+}
+
+// Live intervals from liveness over the basic blocks: each value's
+// interval spans every instruction it is live at
+static void build_intervals(Function* fn, int label_count, Interval* intervals) {
+    int n = fn->count;
+    int words = (fn->vreg_count + 63) / 64;
+    
+    // Basic blocks start at labels and after jumps
+    int* block_of_label = (int*)malloc(sizeof(int) * (label_count + 1));
+    int* starts = (int*)malloc(sizeof(int) * (n + 1));
+    int block_count = 0;
+    for (int i = 0; i < n; i++) {
+        if (i == 0 || fn->code[i].op == IR_LABEL || ends_block(&fn->code[i - 1])) {
+            starts[block_count++] = i;
+        }
+        if (fn->code[i].op == IR_LABEL) {
+            block_of_label[fn->code[i].label] = block_count - 1;
+        }
+    }
+    starts[block_count] = n;
+    
+    uint64_t* bits = (uint64_t*)calloc((size_t)block_count * 4 * words + words + 1, sizeof(uint64_t));
+    uint64_t* use = bits;
+    uint64_t* def = use + (size_t)block_count * words;
+    uint64_t* live_in = def + (size_t)block_count * words;
+    uint64_t* live_out = live_in + (size_t)block_count * words;
+    uint64_t* live = live_out + (size_t)block_count * words;
+    int uses[104];
+    
+    for (int b = 0; b < block_count; b++) {
+        uint64_t* block_use = use + (size_t)b * words;
+        uint64_t* block_def = def + (size_t)b * words;
+        for (int i = starts[b]; i < starts[b + 1]; i++) {
+            int count = instr_uses(&fn->code[i], uses);
+            for (int k = 0; k < count; k++) {
+                int v = uses[k];
+                if (!(block_def[v / 64] >> (v % 64) & 1)) block_use[v / 64] |= 1ULL << (v % 64);
+            }
+            int d = fn->code[i].dst;
+            if (d >= 0) block_def[d / 64] |= 1ULL << (d % 64);
+        }
+    }
+    
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int b = block_count - 1; b >= 0; b--) {
+            Instr* last = &fn->code[starts[b + 1] - 1];
+            int successors[2];
+            int successor_count = 0;
+            if (last->op == IR_JUMP || last->op == IR_BRANCH) {
+                successors[successor_count++] = block_of_label[last->label];
+            }
+            if (last->op != IR_JUMP && last->op != IR_RET && last->op != IR_TAIL_CALL && b + 1 < block_count) {
+                successors[successor_count++] = b + 1;
+            }
+            
+            uint64_t* out = live_out + (size_t)b * words;
+            uint64_t* in = live_in + (size_t)b * words;
+            for (int w = 0; w < words; w++) {
+                uint64_t value = 0;
+                for (int s = 0; s < successor_count; s++) {
+                    value |= live_in[(size_t)successors[s] * words + w];
+                }
+                out[w] = value;
+                uint64_t next = use[(size_t)b * words + w] | (value & ~def[(size_t)b * words + w]);
+                if (next != in[w]) {
+                    in[w] = next;
+                    changed = 1;
+                }
+            }
+        }
+    }
+    
+    for (int v = 0; v < fn->vreg_count; v++) {
+        intervals[v].start = intervals[v].end = -1;
+        intervals[v].reg = -1;
+    }
+    for (int b = 0; b < block_count; b++) {
+        int first = starts[b], last = starts[b + 1] - 1;
+        memcpy(live, live_out + (size_t)b * words, sizeof(uint64_t) * words);
+        for (int v = 0; v < fn->vreg_count; v++) {
+            if (live[v / 64] >> (v % 64) & 1) extend(&intervals[v], last);
+        }
+        for (int i = last; i >= first; i--) {
+            int d = fn->code[i].dst;
+            if (d >= 0) {
+                extend(&intervals[d], i);
+                live[d / 64] &= ~(1ULL << (d % 64));
+            }
+            int count = instr_uses(&fn->code[i], uses);
+            for (int k = 0; k < count; k++) {
+                extend(&intervals[uses[k]], i);
+                live[uses[k] / 64] |= 1ULL << (uses[k] % 64);
+            }
+        }
+        for (int v = 0; v < fn->vreg_count; v++) {
+            if (live[v / 64] >> (v % 64) & 1) extend(&intervals[v], first);
+        }
+    }
+    
+    // A value is live across a call when it is live both before and after
+    int* calls_before = (int*)malloc(sizeof(int) * (n + 1));
+    calls_before[0] = 0;
+    for (int i = 0; i < n; i++) {
+        calls_before[i + 1] = calls_before[i] + (fn->code[i].op == IR_CALL);
+    }
+    for (int v = 0; v < fn->vreg_count; v++) {
+        Interval* interval = &intervals[v];
+        interval->crosses_call = interval->start >= 0 &&
+                                 calls_before[interval->end] - calls_before[interval->start + 1] > 0;
+    }
+    
+    free(calls_before);
+    free(bits);
+    free(starts);
+    free(block_of_label);
+}
+
+static int compare_starts(const void* a, const void* b) {
+    const Interval* x = *(const Interval* const*)a;
+    const Interval* y = *(const Interval* const*)b;
+    return x->start != y->start ? x->start - y->start : (x < y ? -1 : x > y);
+}
+
+static void spill(Allocation* allocation, Interval* interval) {
+    interval->reg = -1;
+    interval->slot = allocation->slot_count++;
+}
+
+// Linear scan (Poletto and Sarkar): intervals in order of their start
+// take a free register; when there is none, the interval that ends last
+// goes to the stack
+static void allocate_registers(Function* fn, int label_count, Allocation* allocation) {
+    Interval* intervals = (Interval*)calloc(fn->vreg_count + 1, sizeof(Interval));
+    build_intervals(fn, label_count, intervals);
+    allocation->intervals = intervals;
+    allocation->slot_count = 0;
+    
+    Interval** order = (Interval**)malloc(sizeof(Interval*) * (fn->vreg_count + 1));
+    int count = 0;
+    for (int v = 0; v < fn->vreg_count; v++) {
+        if (intervals[v].start >= 0) order[count++] = &intervals[v];
+    }
+    qsort(order, count, sizeof(Interval*), compare_starts);
+    
+    Interval* active[REGISTER_COUNT] = { NULL };
+    int used[REGISTER_COUNT] = { 0 };
+    for (int i = 0; i < count; i++) {
+        Interval* current = order[i];
+        
+        // A value that dies where this one is defined can share its
+        // register: instructions read their operands first
+        for (int r = 0; r < REGISTER_COUNT; r++) {
+            if (active[r] && active[r]->end <= current->start) active[r] = NULL;
+        }
+        
+        // r10 and r11 first, unless the value has to survive a call
+        int chosen = -1;
+        for (int k = 0; k < REGISTER_COUNT && chosen < 0; k++) {
+            int r = (k + CALLEE_SAVED) % REGISTER_COUNT;
+            if (current->crosses_call && r >= CALLEE_SAVED) continue;
+            if (!active[r]) chosen = r;
+        }
+        
+        if (chosen < 0) {
+            int victim = -1;
+            int limit = current->crosses_call ? CALLEE_SAVED : REGISTER_COUNT;
+            for (int r = 0; r < limit; r++) {
+                if (victim < 0 || active[r]->end > active[victim]->end) victim = r;
+            }
+            if (active[victim]->end > current->end) {
+                spill(allocation, active[victim]);
+                chosen = victim;
+            } else {
+                spill(allocation, current);
+                continue;
+            }
+        }
+        
+        current->reg = chosen;
+        active[chosen] = current;
+        used[chosen] = 1;
+    }
+    
+    allocation->saved = 0;
+    for (int r = 0; r < CALLEE_SAVED; r++) {
+        allocation->saved += used[r];
+    }
+    
+    // Keeps rsp 16-byte aligned at calls
+    allocation->frame_size = allocation->slot_count * 8;
+    if ((allocation->saved * 8 + allocation->frame_size) % 16 != 0) {
+        allocation->frame_size += 8;
+    }
+    
+    free(order);
+}
+
+// ---------------------------------------------------------------------------
+// Instruction selection
+
+typedef struct {
+    FILE* out;
+    Function* fn;
+    Allocation* allocation;
+    int saved_regs[CALLEE_SAVED];
+} Emitter;
+
+// Operand text; the result stays valid for the next few calls
+static const char* operand_text(Emitter* e, Operand operand, int wide) {
+    static char buffers[8][32];
+    static int next = 0;
+    char* text = buffers[next++ % 8];
+    
+    if (operand.kind == OPERAND_IMM) {
+        snprintf(text, 32, "$%d", operand.value);
+        return text;
+    }
+    Interval* interval = &e->allocation->intervals[operand.value];
+    if (interval->reg >= 0) {
+        return wide ? reg64[interval->reg] : reg32[interval->reg];
+    }
+    snprintf(text, 32, "-%d(%%rbp)", e->allocation->saved * 8 + 8 * (interval->slot + 1));
+    return text;
+}
+
+static const char* dst_text(Emitter* e, Instr* in) {
+    return operand_text(e, vreg(in->dst), e->fn->wide[in->dst]);
+}
+
+static int is_memory(const char* text) {
+    return strchr(text, '(') != NULL;
+}
+
+static int is_immediate(const char* text) {
+    return text[0] == '$';
+}
+
+static void move32(Emitter* e, const char* from, const char* to) {
+    if (strcmp(from, to) == 0) return;
+    if (is_memory(from) && is_memory(to)) {
+        fprintf(e->out, "    movl %s, %%eax\n", from);
+        from = "%eax";
+    }
+    if (strcmp(from, "$0") == 0 && !is_memory(to)) {
+        fprintf(e->out, "    xorl %s, %s\n", to, to);
+    } else {
+        fprintf(e->out, "    movl %s, %s\n", from, to);
+    }
+}
+
+static const char* condition_suffix(Cond cond) {
+    switch (cond) {
+        case COND_LT: return "l";
+        case COND_GT: return "g";
+        case COND_EQ: return "e";
+        case COND_NE: return "ne";
+        case COND_LE: return "le";
+        default: return "ge";
+    }
+}
+
+// a < b is b > a and so on
+static Cond swapped(Cond cond) {
+    switch (cond) {
+        case COND_LT: return COND_GT;
+        case COND_GT: return COND_LT;
+        case COND_LE: return COND_GE;
+        case COND_GE: return COND_LE;
+        default: return cond;
+    }
+}
+
+static int evaluate(Cond cond, int a, int b) {
+    switch (cond) {
+        case COND_LT: return a < b;
+        case COND_GT: return a > b;
+        case COND_EQ: return a == b;
+        case COND_NE: return a != b;
+        case COND_LE: return a <= b;
+        default: return a >= b;
+    }
+}
+
+// cmp for `a cond b`; returns the condition to test afterwards, which is
+// swapped when the operands had to be
+static Cond emit_compare(Emitter* e, Instr* in) {
+    Cond cond = in->cond;
+    Operand a = in->a, b = in->b;
+    if (a.kind == OPERAND_IMM) {
+        Operand swap = a;
+        a = b;
+        b = swap;
+        cond = swapped(cond);
+    }
+    
+    const char* left = operand_text(e, a, 0);
+    const char* right = operand_text(e, b, 0);
+    if (is_memory(left) && is_memory(right)) {
+        fprintf(e->out, "    movl %s, %%eax\n", left);
+        left = "%eax";
+    }
+    if (strcmp(right, "$0") == 0 && (cond == COND_EQ || cond == COND_NE) && !is_memory(left)) {
+        fprintf(e->out, "    testl %s, %s\n", left, left);
+    } else {
+        fprintf(e->out, "    cmpl %s, %s\n", right, left);
+    }
+    return cond;
+}
+
+static void emit_arithmetic(Emitter* e, Instr* in) {
+    const char* mnemonic = in->op == IR_ADD ? "addl" : in->op == IR_SUB ? "subl" :
+                           in->op == IR_MUL ? "imull" : "andl";
+    const char* dst = dst_text(e, in);
+    const char* a = operand_text(e, in->a, 0);
+    const char* b = operand_text(e, in->b, 0);
+    
+    if (in->op != IR_SUB && (strcmp(dst, b) == 0 || is_immediate(a))) {
+        const char* swap = a;
+        a = b;
+        b = swap;
+    }
+    
+    if (in->op == IR_MUL && is_immediate(b)) {
+        // Three operand imul: register destination, any source
+        const char* target = is_memory(dst) ? "%eax" : dst;
+        if (is_immediate(a)) {
+            move32(e, a, target);
+            a = target;
+        }
+        fprintf(e->out, "    imull %s, %s, %s\n", b, a, target);
+        move32(e, target, dst);
+    } else if (!is_memory(dst) && strcmp(dst, b) != 0) {
+        move32(e, a, dst);
+        fprintf(e->out, "    %s %s, %s\n", mnemonic, b, dst);
+    } else if (is_memory(dst) && strcmp(dst, a) == 0 && !is_memory(b) && in->op != IR_MUL) {
+        fprintf(e->out, "    %s %s, %s\n", mnemonic, b, dst);
+    } else {
+        move32(e, a, "%eax");
+        fprintf(e->out, "    %s %s, %%eax\n", mnemonic, b);
+        move32(e, "%eax", dst);
+    }
+}
+
+static void emit_symbol_operand(Emitter* e, const char* symbol) {
+    fprintf(e->out, SYMBOL_PREFIX "%s(%%rip)", symbol);
+}
+
+static void emit_arguments(Emitter* e, Instr* in) {
+    for (int i = 0; i < in->arg_count && i < 6; i++) {
+        Operand arg = in->args[i];
+        int wide = arg.kind == OPERAND_VREG && e->fn->wide[arg.value];
+        const char* text = operand_text(e, arg, wide);
+        if (wide) {
+            fprintf(e->out, "    movq %s, %s\n", text, arg64[i]);
+        } else {
+            move32(e, text, arg32[i]);
+        }
+    }
+}
+
+static void emit_epilogue(Emitter* e) {
+    FILE* out = e->out;
+    int saved = e->allocation->saved;
+    
+    fprintf(out, "    .cfi_remember_state\n");
+    if (saved == 0) {
+        fprintf(out, "    leave\n");
+    } else {
+        fprintf(out, "    leaq -%d(%%rbp), %%rsp\n", saved * 8);
+        for (int k = saved - 1; k >= 0; k--) {
+            fprintf(out, "    popq %s\n", reg64[e->saved_regs[k]]);
+        }
+        fprintf(out, "    popq %%rbp\n");
+    }
+    fprintf(out, "    .cfi_def_cfa %%rsp, 8\n");
+}
+
+static void emit_instruction(Emitter* e, Instr* in, Instr* next) {
+    FILE* out = e->out;
+    
+    switch (in->op) {
+        case IR_MOV:
+            if (e->fn->wide[in->dst]) {
+                fprintf(out, "    movq %s, %s\n", operand_text(e, in->a, 1), dst_text(e, in));
+            } else {
+                move32(e, operand_text(e, in->a, 0), dst_text(e, in));
+            }
+            break;
+        
+        case IR_ADD:
+        case IR_SUB:
+        case IR_MUL:
+        case IR_AND:
+            emit_arithmetic(e, in);
+            break;
+        
+        case IR_DIV: {
+            const char* divisor = operand_text(e, in->b, 0);
+            move32(e, operand_text(e, in->a, 0), "%eax");
+            fprintf(out, "    cltd\n");
+            if (is_immediate(divisor)) {
+                fprintf(out, "    movl %s, %%ecx\n", divisor);
+                divisor = "%ecx";
+            }
+            fprintf(out, "    idivl %s\n", divisor);
+            move32(e, "%eax", dst_text(e, in));
+            break;
+        }
+        
+        case IR_MAX:
+        case IR_MIN: {
+            const char* other = operand_text(e, in->b, 0);
+            move32(e, operand_text(e, in->a, 0), "%eax");
+            if (is_immediate(other)) {
+                fprintf(out, "    movl %s, %%ecx\n", other);
+                other = "%ecx";
+            }
+            fprintf(out, "    cmpl %s, %%eax\n", other);
+            fprintf(out, "    cmov%s %s, %%eax\n", in->op == IR_MAX ? "l" : "g", other);
+            move32(e, "%eax", dst_text(e, in));
+            break;
+        }
+        
+        case IR_NEG: {
+            const char* dst = dst_text(e, in);
+            const char* target = is_memory(dst) ? "%eax" : dst;
+            move32(e, operand_text(e, in->a, 0), target);
+            fprintf(out, "    negl %s\n", target);
+            move32(e, target, dst);
+            break;
+        }
+        
+        case IR_SET: {
+            const char* dst = dst_text(e, in);
+            if (in->a.kind == OPERAND_IMM && in->b.kind == OPERAND_IMM) {
+                move32(e, evaluate(in->cond, in->a.value, in->b.value) ? "$1" : "$0", dst);
+                break;
+            }
+            Cond cond = emit_compare(e, in);
+            fprintf(out, "    set%s %%al\n", condition_suffix(cond));
+            fprintf(out, "    movzbl %%al, %%eax\n");
+            move32(e, "%eax", dst);
+            break;
+        }
+        
+        case IR_LOAD: {
+            const char* dst = dst_text(e, in);
+            fprintf(out, "    movl ");
+            emit_symbol_operand(e, in->symbol);
+            fprintf(out, ", %s\n", is_memory(dst) ? "%eax" : dst);
+            if (is_memory(dst)) move32(e, "%eax", dst);
+            break;
+        }
+        
+        case IR_STORE: {
+            const char* value = operand_text(e, in->a, 0);
+            if (is_memory(value)) {
+                move32(e, value, "%eax");
+                value = "%eax";
+            }
+            fprintf(out, "    movl %s, ", value);
+            emit_symbol_operand(e, in->symbol);
+            fprintf(out, "\n");
+            break;
+        }
+        
+        case IR_PARAM: {
+            const char* dst = dst_text(e, in);
+            int wide = e->fn->wide[in->dst];
+            if (in->index < 6) {
+                fprintf(out, "    mov%c %s, %s\n", wide ? 'q' : 'l', wide ? arg64[in->index] : arg32[in->index], dst);
+            } else {
+                // Past the return address and the saved rbp
+                char from[32];
+                snprintf(from, sizeof(from), "%d(%%rbp)", 16 + 8 * (in->index - 6));
+                move32(e, from, dst);
+            }
+            break;
+        }
+        
+        case IR_CALL: {
+            // Arguments past the sixth go on the stack, right to left
+            int stack_args = in->arg_count > 6 ? in->arg_count - 6 : 0;
+            int padding = stack_args % 2;
+            if (padding) {
+                fprintf(out, "    subq $8, %%rsp\n");
+            }
+            for (int i = in->arg_count - 1; i >= 6; i--) {
+                fprintf(out, "    pushq %s\n", operand_text(e, in->args[i], 1));
+            }
+            emit_arguments(e, in);
+            fprintf(out, "    call " SYMBOL_PREFIX "%s%s\n", in->symbol, in->external ? EXTERNAL_SUFFIX : "");
+            if (stack_args) {
+                fprintf(out, "    addq $%d, %%rsp\n", 8 * (stack_args + padding));
+            }
+            if (in->dst >= 0) {
+                move32(e, "%eax", dst_text(e, in));
+            }
+            break;
+        }
+        
+        case IR_TAIL_CALL:
+            emit_arguments(e, in);
+            emit_epilogue(e);
+            fprintf(out, "    jmp " SYMBOL_PREFIX "%s%s\n", in->symbol, in->external ? EXTERNAL_SUFFIX : "");
+            fprintf(out, "    .cfi_restore_state\n");
+            break;
+        
+        case IR_LABEL:
+            fprintf(out, LOCAL_PREFIX "%d:\n", in->label);
+            break;
+        
+        case IR_JUMP:
+            if (next && next->op == IR_LABEL && next->label == in->label) break;
+            fprintf(out, "    jmp " LOCAL_PREFIX "%d\n", in->label);
+            break;
+        
+        case IR_BRANCH: {
+            if (in->a.kind == OPERAND_IMM && in->b.kind == OPERAND_IMM) {
+                if (evaluate(in->cond, in->a.value, in->b.value)) {
+                    fprintf(out, "    jmp " LOCAL_PREFIX "%d\n", in->label);
+                }
+                break;
+            }
+            Cond cond = emit_compare(e, in);
+            fprintf(out, "    j%s " LOCAL_PREFIX "%d\n", condition_suffix(cond), in->label);
+            break;
+        }
+        
+        case IR_RET:
+            if (in->a.kind != OPERAND_NONE) {
+                move32(e, operand_text(e, in->a, 0), "%eax");
+            }
+            emit_epilogue(e);
+            fprintf(out, "    ret\n");
+            fprintf(out, "    .cfi_restore_state\n");
+            break;
+        
+        case IR_LOC:
+            fprintf(out, "    .loc 1 %d %d\n", in->index, in->column);
+            break;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Functions
+
+static void begin_asm_function(AsmContext* as) {
+    as->fn.count = 0;
+    as->fn.vreg_count = 0;
+}
+
+// Allocates registers for the lowered code and writes it out as
+// `name`, global when `exported`; `line` is where it starts in the source
+static void finish_asm_function(AsmContext* as, const char* name, int exported, int line) {
+    FILE* out = as->out;
+    Function* fn = &as->fn;
+    
+    Allocation allocation;
+    allocate_registers(fn, as->label_counter, &allocation);
+    
+    Emitter e = { out, fn, &allocation, { 0 } };
+    int saved = 0;
+    for (int r = 0; r < CALLEE_SAVED; r++) {
+        for (int v = 0; v < fn->vreg_count; v++) {
+            if (allocation.intervals[v].reg == r) {
+                e.saved_regs[saved++] = r;
+                break;
+            }
+        }
+    }
+    
+    fprintf(out, "    .text\n");
+    fprintf(out, "    .p2align 4\n");
+    if (exported) {
+        fprintf(out, "    .globl " SYMBOL_PREFIX "%s\n", name);
+    }
+#ifndef __APPLE__
+    fprintf(out, "    .type %s, @function\n", name);
+#endif
+    fprintf(out, SYMBOL_PREFIX "%s:\n", name);
+    fprintf(out, "    .cfi_startproc\n");
+    if (as->ctx->debug && line > 0) {
+        fprintf(out, "    .loc 1 %d 0\n", line);
+    }
+    fprintf(out, "    pushq %%rbp\n");
+    fprintf(out, "    .cfi_def_cfa_offset 16\n");
+    fprintf(out, "    .cfi_offset %%rbp, -16\n");
+    fprintf(out, "    movq %%rsp, %%rbp\n");
+    fprintf(out, "    .cfi_def_cfa_register %%rbp\n");
+    for (int k = 0; k < saved; k++) {
+        fprintf(out, "    pushq %s\n", reg64[e.saved_regs[k]]);
+        fprintf(out, "    .cfi_offset %s, -%d\n", reg64[e.saved_regs[k]], 24 + 8 * k);
+    }
+    if (allocation.frame_size > 0) {
+        fprintf(out, "    subq $%d, %%rsp\n", allocation.frame_size);
+    }
+    
+    for (int i = 0; i < fn->count; i++) {
+        emit_instruction(&e, &fn->code[i], i + 1 < fn->count ? &fn->code[i + 1] : NULL);
+    }
+    
+    fprintf(out, "    .cfi_endproc\n");
+#ifndef __APPLE__
+    fprintf(out, "    .size %s, .-%s\n", name, name);
+#endif
+    fprintf(out, "\n");
+    
+    for (int i = 0; i < fn->count; i++) {
+        free(fn->code[i].args);
+    }
+    free(allocation.intervals);
+}
+
+static void assemble_function(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    ASTNode* params[100];
+    int param_count = flatten_list(node->data.func_dec.params, params, 100);
+    
+    add_func(table, node->data.func_dec.name, param_count);
+    table->funcs->body = node->data.func_dec.body;
+    
+    SymbolTable* local_table = create_symbol_table();
+    local_table->vars = table->vars; // Inherit global vars
+    local_table->funcs = table->funcs;
+    
+    begin_asm_function(as);
+    int param_vregs[100];
+    for (int i = 0; i < param_count; i++) {
+        param_vregs[i] = new_vreg(as, 0);
+        Instr* param = emit(as, IR_PARAM);
+        param->dst = param_vregs[i];
+        param->index = i;
+        if (params[i]->type != AST_VAR_DEC) continue;
+        
+        char name[16];
+        vreg_name(param_vregs[i], name, sizeof(name));
+        add_value(local_table, params[i]->data.var_dec.name, name);
+    }
+    
+    // Self tail calls jump back here
+    as->function = table->funcs;
+    as->params = param_vregs;
+    as->tail_header = new_asm_label(as);
+    emit_label_at(as, as->tail_header);
+    
+    lower_statement(node->data.func_dec.body, as, local_table);
+    emit(as, IR_RET)->a = imm(0);
+    finish_asm_function(as, node->data.func_dec.name, 0, node->line);
+    as->function = NULL;
+    as->params = NULL;
+    
+    // Don't free the global vars and funcs local_table inherited
+    pop_vars(local_table, table->vars);
+    local_table->vars = NULL;
+    local_table->funcs = NULL;
+    free_symbol_table(local_table);
+}
+
+static DeclaredStencil* find_declared(AsmContext* as, const char* name) {
+    for (DeclaredStencil* stencil = as->stencils; stencil; stencil = stencil->next) {
+        if (strcmp(stencil->entry->name, name) == 0) return stencil;
+    }
+    return NULL;
+}
+
+// Lowers the stencil body for the pixel at local (x, y), both virtual
+// registers. A paint, or the end of the body, continues at pixel_done.
+static void inline_stencil(AsmContext* as, DeclaredStencil* stencil, int x, int y) {
+    SymbolTable* stencil_table = create_symbol_table();
+    stencil_table->vars = stencil->vars;
+    stencil_table->funcs = stencil->funcs;
+    char name[16];
+    vreg_name(x, name, sizeof(name));
+    add_readonly_value(stencil_table, "x", name);
+    vreg_name(y, name, sizeof(name));
+    add_readonly_value(stencil_table, "y", name);
+    
+    as->in_stencil = 1;
+    as->pixel_x = x;
+    as->pixel_y = y;
+    lower_statement(stencil->node->data.stencil.body, as, stencil_table);
+    as->in_stencil = 0;
+    
+    pop_vars(stencil_table, stencil->vars);
+    stencil_table->vars = NULL;
+    stencil_table->funcs = NULL;
+    free_symbol_table(stencil_table);
+}
+
+static void begin_apply_function(AsmContext* as, int* bounds) {
+    begin_asm_function(as);
+    as->canvas = new_vreg(as, 1);
+    Instr* param = emit(as, IR_PARAM);
+    param->dst = as->canvas;
+    for (int i = 0; i < 5; i++) {
+        bounds[i] = new_vreg(as, 0);
+        param = emit(as, IR_PARAM);
+        param->dst = bounds[i];
+        param->index = i + 1;
+    }
+}
+
+// Runs the stencil over every step-th pixel of [x0, x1) x [y0, y1) with
+// the apply's top left corner at (offset_x, offset_y), the body inlined
+// into the loop
+static void apply_loop(AsmContext* as, DeclaredStencil* stencil, const char* name, int offset_x, int offset_y,
+                       int line) {
+    int bounds[5]; // x0, y0, x1, y1, step
+    begin_apply_function(as, bounds);
+    as->offset_x = offset_x;
+    as->offset_y = offset_y;
+    as->paint_value = -1;
+    
+    int x = new_vreg(as, 0);
+    int y = new_vreg(as, 0);
+    int row_label = new_asm_label(as);
+    int pixel_label = new_asm_label(as);
+    int row_done = new_asm_label(as);
+    int exit_label = new_asm_label(as);
+    as->pixel_done = new_asm_label(as);
+    
+    emit_move(as, y, vreg(bounds[1]));
+    emit_branch(as, COND_GE, vreg(y), vreg(bounds[3]), exit_label);
+    emit_label_at(as, row_label);
+    emit_move(as, x, vreg(bounds[0]));
+    emit_branch(as, COND_GE, vreg(x), vreg(bounds[2]), row_done);
+    emit_label_at(as, pixel_label);
+    
+    inline_stencil(as, stencil, x, y);
+    
+    emit_label_at(as, as->pixel_done);
+    emit_to(as, IR_ADD, x, vreg(x), vreg(bounds[4]));
+    emit_branch(as, COND_LT, vreg(x), vreg(bounds[2]), pixel_label);
+    emit_label_at(as, row_done);
+    emit_to(as, IR_ADD, y, vreg(y), vreg(bounds[4]));
+    emit_branch(as, COND_LT, vreg(y), vreg(bounds[3]), row_label);
+    emit_label_at(as, exit_label);
+    emit(as, IR_RET);
+    
+    finish_asm_function(as, name, 0, line);
+}
+
+// Apply of a piecewise constant stencil: each constant rectangle, clipped
+// to the one the runtime asks for, is evaluated once at its top left
+// pixel and filled with fill_rect, whatever the step
+static void fill_apply(AsmContext* as, DeclaredStencil* stencil, ApplyEntry* apply, const char* name, int line) {
+    StencilEntry* entry = stencil->entry;
+    int xs[MAX_BREAKS + 2], ys[MAX_BREAKS + 2];
+    int x_ranges = break_ranges(entry->x_breaks, entry->x_break_count, apply->size, xs);
+    int y_ranges = break_ranges(entry->y_breaks, entry->y_break_count, apply->size, ys);
+    
+    int bounds[5];
+    begin_apply_function(as, bounds);
+    as->offset_x = apply->x;
+    as->offset_y = apply->y;
+    
+    for (int j = 0; j < y_ranges; j++) {
+        for (int i = 0; i < x_ranges; i++) {
+            int next_label = new_asm_label(as);
+            Operand lo_x = vreg(emit_op(as, IR_MAX, vreg(bounds[0]), imm(xs[i])));
+            Operand hi_x = vreg(emit_op(as, IR_MIN, vreg(bounds[2]), imm(xs[i + 1])));
+            emit_branch(as, COND_GE, lo_x, hi_x, next_label);
+            Operand lo_y = vreg(emit_op(as, IR_MAX, vreg(bounds[1]), imm(ys[j])));
+            Operand hi_y = vreg(emit_op(as, IR_MIN, vreg(bounds[3]), imm(ys[j + 1])));
+            emit_branch(as, COND_GE, lo_y, hi_y, next_label);
+            
+            // -1 when the stencil paints nothing
+            as->paint_value = new_vreg(as, 0);
+            as->pixel_done = new_asm_label(as);
+            emit_move(as, as->paint_value, imm(-1));
+            inline_stencil(as, stencil, lo_x.value, lo_y.value);
+            emit_label_at(as, as->pixel_done);
+            
+            Operand args[6] = { vreg(as->canvas),
+                                add_operands(as, lo_x, imm(apply->x)),
+                                add_operands(as, lo_y, imm(apply->y)),
+                                vreg(emit_op(as, IR_SUB, hi_x, lo_x)),
+                                vreg(emit_op(as, IR_SUB, hi_y, lo_y)),
+                                vreg(as->paint_value) };
+            emit_call(as, "fill_rect", 1, args, 6, 0);
+            emit_label_at(as, next_label);
+        }
+    }
+    emit(as, IR_RET);
+    as->paint_value = -1;
+    
+    finish_asm_function(as, name, 0, line);
+}
+
+// @stencil_<name>_key, see cache_key_globals
+static void cache_key_function(AsmContext* as, ASTNode* node, SymbolTable* table, StencilEntry* stencil) {
+    VarEntry* globals[MAX_KEY_GLOBALS];
+    uint64_t code;
+    int global_count = cache_key_globals(node, table, stencil, globals, &code);
+    if (global_count < 0) return;
+    
+    FILE* out = as->out;
+    fprintf(out, "    .text\n");
+    fprintf(out, "    .p2align 4\n");
+    fprintf(out, SYMBOL_PREFIX "stencil_%s_key:\n", stencil->name);
+    fprintf(out, "    movabsq $%llu, %%rax\n", (unsigned long long)code);
+    if (global_count > 0) {
+        fprintf(out, "    movabsq $%llu, %%rdx\n", CODE_HASH_PRIME);
+    }
+    for (int i = 0; i < global_count; i++) {
+        fprintf(out, "    movl " SYMBOL_PREFIX "%s(%%rip), %%ecx\n", globals[i]->llvm_name + 1);
+        fprintf(out, "    xorq %%rcx, %%rax\n");
+        fprintf(out, "    imulq %%rdx, %%rax\n");
+    }
+    fprintf(out, "    ret\n\n");
+    
+    stencil->cacheable = 1;
+}
+
+static void assemble_global_decls(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    if (!node) return;
+    
+    switch (node->type) {
+        case AST_STATEMENT_LIST:
+            assemble_global_decls(node->data.list.head, as, table);
+            assemble_global_decls(node->data.list.tail, as, table);
+            break;
+        
+        case AST_VAR_DEC: {
+            // As in generate_global_decls: constant initializers are folded,
+            // and globals that are never assigned are just that constant
+            int value = 0;
+            int folded = !node->data.var_dec.value || fold_constant(node->data.var_dec.value, table, &value);
+            if (folded && !assigns_name(as->ctx->program, node->data.var_dec.name)) {
+                char constant[16];
+                snprintf(constant, sizeof(constant), "%d", value);
+                add_readonly_value(table, node->data.var_dec.name, constant);
+                break;
+            }
+            
+            fprintf(as->out, "    .data\n");
+            fprintf(as->out, "    .p2align 2\n");
+            fprintf(as->out, SYMBOL_PREFIX "%s:\n", node->data.var_dec.name);
+            fprintf(as->out, "    .long %d\n\n", value);
+            char* global_name = (char*)malloc(strlen(node->data.var_dec.name) + 2);
+            sprintf(global_name, "@%s", node->data.var_dec.name);
+            add_var(table, node->data.var_dec.name, global_name);
+            free(global_name);
+            break;
+        }
+        
+        case AST_FUNC_DEC:
+            assemble_function(node, as, table);
+            break;
+        
+        case AST_STENCIL: {
+            DeclaredStencil* stencil = (DeclaredStencil*)malloc(sizeof(DeclaredStencil));
+            stencil->entry = declare_stencil(node, table);
+            stencil->node = node;
+            stencil->vars = table->vars;
+            stencil->funcs = table->funcs;
+            stencil->next = as->stencils;
+            as->stencils = stencil;
+            cache_key_function(as, node, table, stencil->entry);
+            break;
+        }
+        
+        default:
+            break;
+    }
+}
+
+// As generate_reset_globals: stores the initial value of every global
+// that isn't a constant, in program order
+static void lower_global_resets(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    if (!node) return;
+    if (node->type == AST_STATEMENT_LIST) {
+        lower_global_resets(node->data.list.head, as, table);
+        lower_global_resets(node->data.list.tail, as, table);
+        return;
+    }
+    if (node->type != AST_VAR_DEC) return;
+    
+    VarEntry* var = lookup_var_entry(table, node->data.var_dec.name);
+    if (!var || var->readonly) return;
+    
+    Operand value = node->data.var_dec.value ? lower_expression(node->data.var_dec.value, as, table) : imm(0);
+    Instr* store = emit(as, IR_STORE);
+    store->a = value;
+    store->symbol = var->llvm_name + 1;
+}
+
+static void assemble_apply_statements(ASTNode* node, AsmContext* as, SymbolTable* table) {
+    if (!node) return;
+    
+    if (node->type == AST_STATEMENT_LIST) {
+        assemble_apply_statements(node->data.list.head, as, table);
+        assemble_apply_statements(node->data.list.tail, as, table);
+    } else if (node->type == AST_APPLY) {
+        ApplyEntry* apply = declare_apply(node, table);
+        if (!apply) return;
+        
+        DeclaredStencil* stencil = find_declared(as, apply->stencil);
+        char function[32];
+        snprintf(function, sizeof(function), "apply_%d", apply->index);
+        if (stencil->entry->piecewise) {
+            fill_apply(as, stencil, apply, function, node->line);
+        } else {
+            apply_loop(as, stencil, function, apply->x, apply->y, node->line);
+        }
+    }
+}
+
+// The apply table, laid out as ApplyDesc in runtime.h, see emit_apply_table
+static void assemble_apply_table(AsmContext* as, SymbolTable* table) {
+    FILE* out = as->out;
+    
+    int count = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        count++;
+    }
+    ApplyEntry** applies = (ApplyEntry**)malloc(sizeof(ApplyEntry*) * (count + 1));
+    int index = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        applies[index++] = apply;
+    }
+    
+    fprintf(out, "    " RODATA_SECTION "\n");
+    fprintf(out, "    .p2align 2\n");
+    fprintf(out, "    .globl " SYMBOL_PREFIX "stencil_apply_count\n");
+    fprintf(out, SYMBOL_PREFIX "stencil_apply_count:\n");
+    fprintf(out, "    .long %d\n", count);
+    
+    int* deps = (int*)malloc(sizeof(int) * (count + 1));
+    int* dep_counts = (int*)calloc(count + 1, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        dep_counts[i] = apply_dependencies(applies, i, deps);
+        if (dep_counts[i] == 0) continue;
+        
+        fprintf(out, LOCAL_PREFIX "apply_deps_%d:\n", i);
+        fprintf(out, "    .long ");
+        for (int k = 0; k < dep_counts[i]; k++) {
+            fprintf(out, "%s%d", k > 0 ? ", " : "", deps[k]);
+        }
+        fprintf(out, "\n");
+    }
+    
+    int* visible_counts = (int*)malloc(sizeof(int) * (count + 1));
+    int rects[4 * MAX_VISIBLE_RECTS];
+    for (int i = 0; i < count; i++) {
+        visible_counts[i] = visible_rects(applies, count, i, rects);
+        if (visible_counts[i] < 0) continue;
+        
+        fprintf(out, LOCAL_PREFIX "apply_visible_%d:\n", i);
+        for (int k = 0; k < visible_counts[i]; k++) {
+            fprintf(out, "    .long %d, %d, %d, %d\n", rects[4 * k], rects[4 * k + 1], rects[4 * k + 2],
+                    rects[4 * k + 3]);
+        }
+    }
+    fprintf(out, "\n");
+    
+    // Function pointers need relocations, so the table is in .data
+    fprintf(out, "    .data\n");
+    fprintf(out, "    .p2align 3\n");
+    fprintf(out, "    .globl " SYMBOL_PREFIX "stencil_applies\n");
+    fprintf(out, SYMBOL_PREFIX "stencil_applies:\n");
+    fprintf(out, LOCAL_PREFIX "stencil_applies:\n");
+    for (int i = 0; i < count; i++) {
+        ApplyEntry* apply = applies[i];
+        StencilEntry* stencil = lookup_stencil(table, apply->stencil);
+        fprintf(out, "    .quad " SYMBOL_PREFIX "apply_%d\n", apply->index);
+        fprintf(out, "    .long %d, %d, %d, %d\n", apply->x, apply->y, apply->size, apply->layer);
+        if (dep_counts[i] > 0) {
+            fprintf(out, "    .quad " LOCAL_PREFIX "apply_deps_%d\n", i);
+        } else {
+            fprintf(out, "    .quad 0\n");
+        }
+        fprintf(out, "    .long %d, %d, %d, %d\n", dep_counts[i], apply->steps, apply->radius, apply->effects);
+        if (apply->sprite) {
+            fprintf(out, "    .quad " SYMBOL_PREFIX "sprite_%s\n", apply->stencil);
+        } else {
+            fprintf(out, "    .quad 0\n");
+        }
+        if (stencil && stencil->cacheable && apply->steps <= 1) {
+            fprintf(out, "    .quad " SYMBOL_PREFIX "stencil_%s_key\n", apply->stencil);
+        } else {
+            fprintf(out, "    .quad 0\n");
+        }
+        if (visible_counts[i] >= 0) {
+            fprintf(out, "    .quad " LOCAL_PREFIX "apply_visible_%d\n", i);
+        } else {
+            fprintf(out, "    .quad 0\n");
+        }
+        fprintf(out, "    .long %d, 0\n", visible_counts[i] > 0 ? visible_counts[i] : 0);
+    }
+    fprintf(out, "\n");
+    
+    free(deps);
+    free(dep_counts);
+    free(visible_counts);
+    free(applies);
+}
+
+void generate_assembly(ASTNode* ast, CodeGenContext* ctx, SymbolTable* table) {
+    AsmContext as;
+    memset(&as, 0, sizeof(as));
+    as.out = ctx->output;
+    as.ctx = ctx;
+    as.paint_value = -1;
+    ctx->program = ast;
+    
+    FILE* out = as.out;
+    fprintf(out, "# Stencil program, x86-64\n");
+    if (ctx->debug) {
+        fprintf(out, "    .file 1 \"%s\"\n", ctx->source_file);
+    }
+    fprintf(out, "\n");
+    
+    // First pass: globals, functions and stencils; second pass: one
+    // function per apply, the sprites and the table describing them
+    assemble_global_decls(ast, &as, table);
+    assemble_apply_statements(ast, &as, table);
+    
+    find_sprites(table);
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        StencilEntry* stencil = lookup_stencil(table, apply->stencil);
+        if (apply->sprite && !stencil->sprite) {
+            char function[256];
+            snprintf(function, sizeof(function), "sprite_%s", stencil->name);
+            apply_loop(&as, find_declared(&as, stencil->name), function, 0, 0, stencil->line);
+            stencil->sprite = 1;
+        }
+    }
+    
+    assemble_apply_table(&as, table);
+    
+    begin_asm_function(&as);
+    lower_global_resets(ast, &as, table);
+    emit(&as, IR_RET)->a = imm(0);
+    finish_asm_function(&as, "stencil_reset_globals", 1, 0);
+    
+    int count = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        count++;
+    }
+    
+    // llvm_main(canvas): stencil_reset_globals(), then run_applies(canvas,
+    // stencil_applies, count) as a tail call. The table is reached through
+    // a local label, which also works in shared objects.
+    fprintf(out, "    .text\n");
+    fprintf(out, "    .p2align 4\n");
+    fprintf(out, "    .globl " SYMBOL_PREFIX "llvm_main\n");
+    fprintf(out, SYMBOL_PREFIX "llvm_main:\n");
+    fprintf(out, "    pushq %%rdi\n");
+    fprintf(out, "    call " SYMBOL_PREFIX "stencil_reset_globals" EXTERNAL_SUFFIX "\n");
+    fprintf(out, "    popq %%rdi\n");
+    fprintf(out, "    leaq " LOCAL_PREFIX "stencil_applies(%%rip), %%rsi\n");
+    fprintf(out, "    movl $%d, %%edx\n", count);
+    fprintf(out, "    jmp " SYMBOL_PREFIX "run_applies" EXTERNAL_SUFFIX "\n");
+#ifndef __APPLE__
+    fprintf(out, "\n    .section .note.GNU-stack,\"\",@progbits\n");
+#endif
+    
+    while (as.stencils) {
+        DeclaredStencil* next = as.stencils->next;
+        free(as.stencils);
+        as.stencils = next;
+    }
+    free(as.fn.code);
+    free(as.fn.wide);
+}
@@ -0,0 +1,18 @@
+#ifndef ASMGEN_H
+#define ASMGEN_H
+
+#include "codegen.h"
+
+// Native backend (parser --asm): lowers the AST straight to x86-64
+// assembly for the GNU assembler, without going through LLVM. The object
+// `as` makes of it exports the same symbols as the LLVM module
+// (stencil_applies, stencil_apply_count and llvm_main) and links against
+// runtime.o the same way.
+//
+// Functions are lowered to a linear code of virtual registers, which a
+// linear scan allocator maps onto machine registers and stack slots.
+// Stencils are inlined into their apply loops. -g emits line tables; the
+// instrumentation and batch modes need the LLVM backend.
+void generate_assembly(ASTNode* ast, CodeGenContext* ctx, SymbolTable* table);
+
+#endif
@@ -1,9 +1,20 @@
 #include "ast.h"
 #include <stdio.h>
 
+static int source_line = 0;
+static int source_column = 0;
+
+void set_source_location(int line, int column) {
+    source_line = line;
+    source_column = column;
+}
+
 ASTNode* create_node(NodeType type) {
     ASTNode* node = (ASTNode*)malloc(sizeof(ASTNode));
     node->type = type;
+    node->counter = -1;
+    node->line = source_line;
+    node->column = source_column;
     return node;
 }
 
@@ -13,9 +24,9 @@ ASTNode* create_number(int value) {
     return node;
 }
 
-ASTNode* create_identifier(char* name) {
+ASTNode* create_identifier(const char* name) {
     ASTNode* node = create_node(AST_IDENTIFIER);
-    node->data.identifier.name = strdup(name);
+    node->data.identifier.name = name;
     return node;
 }
 
@@ -34,16 +45,16 @@ ASTNode* create_unary_op(OpType op, ASTNode* operand) {
     return node;
 }
 
-ASTNode* create_assignment(char* name, ASTNode* value) {
+ASTNode* create_assignment(const char* name, ASTNode* value) {
     ASTNode* node = create_node(AST_ASSIGNMENT);
-    node->data.assignment.name = strdup(name);
+    node->data.assignment.name = name;
     node->data.assignment.value = value;
     return node;
 }
 
-ASTNode* create_var_dec(char* name, ASTNode* value) {
+ASTNode* create_var_dec(const char* name, ASTNode* value) {
     ASTNode* node = create_node(AST_VAR_DEC);
-    node->data.var_dec.name = strdup(name);
+    node->data.var_dec.name = name;
     node->data.var_dec.value = value;
     return node;
 }
@@ -62,31 +73,40 @@ ASTNode* create_if(ASTNode* condition, ASTNode* then_stmt, ASTNode* else_stmt) {
     return node;
 }
 
-ASTNode* create_func_dec(char* name, ASTNode* params, ASTNode* body) {
+ASTNode* create_for(const char* name, ASTNode* start, ASTNode* end, ASTNode* body) {
+    ASTNode* node = create_node(AST_FOR);
+    node->data.for_stmt.name = name;
+    node->data.for_stmt.start = start;
+    node->data.for_stmt.end = end;
+    node->data.for_stmt.body = body;
+    return node;
+}
+
+ASTNode* create_func_dec(const char* name, ASTNode* params, ASTNode* body) {
     ASTNode* node = create_node(AST_FUNC_DEC);
-    node->data.func_dec.name = strdup(name);
+    node->data.func_dec.name = name;
     node->data.func_dec.params = params;
     node->data.func_dec.body = body;
     return node;
 }
 
-ASTNode* create_func_call(char* name, ASTNode* args) {
+ASTNode* create_func_call(const char* name, ASTNode* args) {
     ASTNode* node = create_node(AST_FUNC_CALL);
-    node->data.func_call.name = strdup(name);
+    node->data.func_call.name = name;
     node->data.func_call.args = args;
     return node;
 }
 
-ASTNode* create_stencil(char* name, ASTNode* body) {
+ASTNode* create_stencil(const char* name, ASTNode* body) {
     ASTNode* node = create_node(AST_STENCIL);
-    node->data.stencil.name = strdup(name);
+    node->data.stencil.name = name;
     node->data.stencil.body = body;
     return node;
 }
 
-ASTNode* create_apply(char* name, ASTNode* directives) {
+ASTNode* create_apply(const char* name, ASTNode* directives) {
     ASTNode* node = create_node(AST_APPLY);
-    node->data.apply.name = strdup(name);
+    node->data.apply.name = name;
     node->data.apply.directives = directives;
     return node;
 }
@@ -129,6 +149,18 @@ ASTNode* create_size_directive(ASTNode* size) {
     return node;
 }
 
+ASTNode* create_layer_directive(ASTNode* layer) {
+    ASTNode* node = create_node(AST_LAYER_DIRECTIVE);
+    node->data.layer_directive.layer = layer;
+    return node;
+}
+
+ASTNode* create_steps_directive(ASTNode* steps) {
+    ASTNode* node = create_node(AST_STEPS_DIRECTIVE);
+    node->data.steps_directive.steps = steps;
+    return node;
+}
+
 void print_indent(int indent) {
     for (int i = 0; i < indent; i++) {
         printf("  ");
@@ -213,6 +245,19 @@ void print_ast(ASTNode* node, int indent) {
             }
             break;
             
+        case AST_FOR:
+            printf("For: %s\n", node->data.for_stmt.name);
+            print_indent(indent + 1);
+            printf("From:\n");
+            print_ast(node->data.for_stmt.start, indent + 2);
+            print_indent(indent + 1);
+            printf("To:\n");
+            print_ast(node->data.for_stmt.end, indent + 2);
+            print_indent(indent + 1);
+            printf("Body:\n");
+            print_ast(node->data.for_stmt.body, indent + 2);
+            break;
+            
         case AST_FUNC_DEC:
             printf("FunctionDeclaration: %s\n", node->data.func_dec.name);
             if (node->data.func_dec.params) {
@@ -245,8 +290,12 @@ void print_ast(ASTNode* node, int indent) {
             break;
             
         case AST_PAINT:
-            printf("Paint\n");
-            print_ast(node->data.paint.value, indent + 1);
+            if (node->data.paint.value) {
+                printf("Paint\n");
+                print_ast(node->data.paint.value, indent + 1);
+            } else {
+                printf("Paint: transparent\n");
+            }
             break;
             
         case AST_RETURN:
@@ -281,6 +330,15 @@ void print_ast(ASTNode* node, int indent) {
             printf("SizeDirective\n");
             print_ast(node->data.size_directive.size, indent + 1);
             break;
+            
+        case AST_LAYER_DIRECTIVE:
+            printf("LayerDirective\n");
+            print_ast(node->data.layer_directive.layer, indent + 1);
+            break;
+        case AST_STEPS_DIRECTIVE:
+            printf("StepsDirective\n");
+            print_ast(node->data.steps_directive.steps, indent + 1);
+            break;
     }
 }
 
@@ -289,7 +347,6 @@ void free_ast(ASTNode* node) {
     
     switch (node->type) {
         case AST_IDENTIFIER:
-            free(node->data.identifier.name);
             break;
             
         case AST_BINARY_OP:
@@ -302,12 +359,10 @@ void free_ast(ASTNode* node) {
             break;
             
         case AST_ASSIGNMENT:
-            free(node->data.assignment.name);
             free_ast(node->data.assignment.value);
             break;
             
         case AST_VAR_DEC:
-            free(node->data.var_dec.name);
             free_ast(node->data.var_dec.value);
             break;
             
@@ -321,24 +376,26 @@ void free_ast(ASTNode* node) {
             free_ast(node->data.if_stmt.else_stmt);
             break;
             
+        case AST_FOR:
+            free_ast(node->data.for_stmt.start);
+            free_ast(node->data.for_stmt.end);
+            free_ast(node->data.for_stmt.body);
+            break;
+            
         case AST_FUNC_DEC:
-            free(node->data.func_dec.name);
             free_ast(node->data.func_dec.params);
             free_ast(node->data.func_dec.body);
             break;
             
         case AST_FUNC_CALL:
-            free(node->data.func_call.name);
             free_ast(node->data.func_call.args);
             break;
             
         case AST_STENCIL:
-            free(node->data.stencil.name);
             free_ast(node->data.stencil.body);
             break;
             
         case AST_APPLY:
-            free(node->data.apply.name);
             free_ast(node->data.apply.directives);
             break;
             
@@ -371,6 +428,14 @@ void free_ast(ASTNode* node) {
             free_ast(node->data.size_directive.size);
             break;
             
+        case AST_LAYER_DIRECTIVE:
+            free_ast(node->data.layer_directive.layer);
+            break;
+            
+        case AST_STEPS_DIRECTIVE:
+            free_ast(node->data.steps_directive.steps);
+            break;
+            
         default:
             break;
     }
@@ -14,6 +14,7 @@ typedef enum {
     AST_VAR_DEC,
     AST_BLOCK,
     AST_IF,
+    AST_FOR,
     AST_FUNC_DEC,
     AST_FUNC_CALL,
     AST_STENCIL,
@@ -26,7 +27,9 @@ typedef enum {
     AST_PARAMETER_LIST,
     AST_DIRECTIVE_LIST,
     AST_LOCATION_DIRECTIVE,
-    AST_SIZE_DIRECTIVE
+    AST_SIZE_DIRECTIVE,
+    AST_LAYER_DIRECTIVE,
+    AST_STEPS_DIRECTIVE
 } NodeType;
 
 typedef enum {
@@ -44,13 +47,16 @@ typedef enum {
 
 typedef struct ASTNode {
     NodeType type;
+    int counter; // first profile counter of an if, function or stencil, -1 otherwise
+    int line;    // where the construct starts in the source, 0 if unknown
+    int column;
     union {
         struct {
             int value;
         } number;
         
         struct {
-            char* name;
+            const char* name;
         } identifier;
         
         struct {
@@ -65,12 +71,12 @@ typedef struct ASTNode {
         } unary_op;
         
         struct {
-            char* name;
+            const char* name;
             struct ASTNode* value;
         } assignment;
         
         struct {
-            char* name;
+            const char* name;
             struct ASTNode* value;
         } var_dec;
         
@@ -85,28 +91,35 @@ typedef struct ASTNode {
         } if_stmt;
         
         struct {
-            char* name;
+            const char* name;
+            struct ASTNode* start;
+            struct ASTNode* end;
+            struct ASTNode* body;
+        } for_stmt;
+        
+        struct {
+            const char* name;
             struct ASTNode* params;
             struct ASTNode* body;
         } func_dec;
         
         struct {
-            char* name;
+            const char* name;
             struct ASTNode* args;
         } func_call;
         
         struct {
-            char* name;
+            const char* name;
             struct ASTNode* body;
         } stencil;
         
         struct {
-            char* name;
+            const char* name;
             struct ASTNode* directives;
         } apply;
         
         struct {
-            struct ASTNode* value;
+            struct ASTNode* value; // NULL paints the pixel transparent
         } paint;
         
         struct {
@@ -130,28 +143,43 @@ typedef struct ASTNode {
         struct {
             struct ASTNode* size;
         } size_directive;
+        
+        struct {
+            struct ASTNode* layer;
+        } layer_directive;
+        
+        struct {
+            struct ASTNode* steps;
+        } steps_directive;
     } data;
 } ASTNode;
 
+// Names are interned strings (see intern.h); nodes don't own them.
+// New nodes take the location last passed to set_source_location, which
+// the parser sets to the start of the rule being reduced.
+void set_source_location(int line, int column);
 ASTNode* create_node(NodeType type);
 ASTNode* create_number(int value);
-ASTNode* create_identifier(char* name);
+ASTNode* create_identifier(const char* name);
 ASTNode* create_binary_op(OpType op, ASTNode* left, ASTNode* right);
 ASTNode* create_unary_op(OpType op, ASTNode* operand);
-ASTNode* create_assignment(char* name, ASTNode* value);
-ASTNode* create_var_dec(char* name, ASTNode* value);
+ASTNode* create_assignment(const char* name, ASTNode* value);
+ASTNode* create_var_dec(const char* name, ASTNode* value);
 ASTNode* create_block(ASTNode* statements);
 ASTNode* create_if(ASTNode* condition, ASTNode* then_stmt, ASTNode* else_stmt);
-ASTNode* create_func_dec(char* name, ASTNode* params, ASTNode* body);
-ASTNode* create_func_call(char* name, ASTNode* args);
-ASTNode* create_stencil(char* name, ASTNode* body);
-ASTNode* create_apply(char* name, ASTNode* directives);
+ASTNode* create_for(const char* name, ASTNode* start, ASTNode* end, ASTNode* body);
+ASTNode* create_func_dec(const char* name, ASTNode* params, ASTNode* body);
+ASTNode* create_func_call(const char* name, ASTNode* args);
+ASTNode* create_stencil(const char* name, ASTNode* body);
+ASTNode* create_apply(const char* name, ASTNode* directives);
 ASTNode* create_paint(ASTNode* value);
 ASTNode* create_return(ASTNode* value);
 ASTNode* create_coordinate(ASTNode* x, ASTNode* y);
 ASTNode* create_list(ASTNode* head, ASTNode* tail);
 ASTNode* create_location_directive(ASTNode* coordinate);
 ASTNode* create_size_directive(ASTNode* size);
+ASTNode* create_layer_directive(ASTNode* layer);
+ASTNode* create_steps_directive(ASTNode* steps);
 
 void print_ast(ASTNode* node, int indent);
 void free_ast(ASTNode* node);
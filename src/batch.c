@@ -0,0 +1,298 @@
+#include "runtime.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Renders many instances of one program, each with its own values for
+// the program's globals, in a single process. The program must be
+// compiled with `parser --batch`, which makes its globals thread-local:
+// every worker thread renders whole instances on its own canvas, one
+// after the other, and instances on different threads can't see each
+// other's globals.
+//
+// Instances are read one per line, as `name=value` pairs for the globals
+// they override (empty lines and lines starting with '#' are skipped):
+//   size=3 color=2
+//   size=5
+// The output is either an atlas, one image with the instances in a grid
+// in input order, or with --archive a stream of `instance <n> <length>\n`
+// records each followed by <length> bytes of output, written in input
+// order as soon as every earlier instance is out.
+
+extern const ApplyDesc stencil_applies[];
+extern const int stencil_apply_count;
+
+// Globals table emitted by --batch
+extern const char* const stencil_global_names[];
+extern const int stencil_global_count;
+void stencil_init_globals(const int* values, const uint8_t* overridden);
+
+typedef struct {
+    int* values;
+    uint8_t* overridden;
+} Instance;
+
+typedef struct {
+    Instance* instances;
+    int count;
+    int width;
+    int height;
+    OutputFormat format;
+    const Palette* palette;
+
+    // Atlas mode: cell i is at column i % columns, row i / columns
+    Canvas* atlas;
+    int columns;
+
+    // Archive mode: rendered instances waiting for the ones before them
+    FILE* out;
+    char** outputs;
+    size_t* lengths;
+    int written;
+
+    int next; // next instance to render
+    pthread_mutex_t lock;
+} Batch;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static int find_global(const char* name) {
+    for (int i = 0; i < stencil_global_count; i++) {
+        if (strcmp(stencil_global_names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Parses the instance file; returns the number of instances, or -1 after
+// reporting an error
+static int read_instances(FILE* in, const char* path, Instance** instances) {
+    int count = 0;
+    int capacity = 16;
+    *instances = (Instance*)malloc(sizeof(Instance) * capacity);
+
+    char line[4096];
+    int line_number = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line_number++;
+        char* start = line + strspn(line, " \t\r\n");
+        if (*start == '\0' || *start == '#') continue;
+
+        if (count == capacity) {
+            capacity *= 2;
+            *instances = (Instance*)realloc(*instances, sizeof(Instance) * capacity);
+        }
+        Instance* instance = &(*instances)[count++];
+        instance->values = (int*)calloc(stencil_global_count + 1, sizeof(int));
+        instance->overridden = (uint8_t*)calloc(stencil_global_count + 1, 1);
+
+        char* saved;
+        for (char* pair = strtok_r(start, " \t\r\n", &saved); pair; pair = strtok_r(NULL, " \t\r\n", &saved)) {
+            char* equals = strchr(pair, '=');
+            char* end = NULL;
+            if (equals) {
+                *equals = '\0';
+                strtol(equals + 1, &end, 10);
+            }
+            if (!equals || equals == pair || end == equals + 1 || *end != '\0') {
+                fprintf(stderr, "%s:%d: expected name=value, got %s\n", path, line_number, pair);
+                return -1;
+            }
+
+            int global = find_global(pair);
+            if (global < 0) {
+                fprintf(stderr, "%s:%d: the program has no global %s\n", path, line_number, pair);
+                return -1;
+            }
+            instance->values[global] = atoi(equals + 1);
+            instance->overridden[global] = 1;
+        }
+    }
+    return count;
+}
+
+// Writes out the archive records that are ready, in order. Called with
+// the lock held.
+static void flush_archive(Batch* batch) {
+    while (batch->written < batch->count && batch->outputs[batch->written]) {
+        int i = batch->written++;
+        fprintf(batch->out, "instance %d %zu\n", i, batch->lengths[i]);
+        fwrite(batch->outputs[i], 1, batch->lengths[i], batch->out);
+        free(batch->outputs[i]);
+        batch->outputs[i] = NULL;
+    }
+    fflush(batch->out);
+}
+
+static void* batch_worker(void* arg) {
+    Batch* batch = (Batch*)arg;
+
+    // The globals this thread sets only reach applies it runs itself
+    runtime_set_thread_count(1);
+
+    Canvas canvas;
+    init_canvas(&canvas, batch->width, batch->height);
+    uint8_t* scratch = (uint8_t*)malloc(batch->width + 1);
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        int i = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+        if (i >= batch->count) break;
+
+        clear_canvas(&canvas);
+        stencil_init_globals(batch->instances[i].values, batch->instances[i].overridden);
+        run_applies(&canvas, stencil_applies, stencil_apply_count);
+
+        if (batch->atlas) {
+            // Cells don't overlap, so no lock is needed
+            Canvas* atlas = batch->atlas;
+            int x = i % batch->columns * batch->width;
+            int y = i / batch->columns * batch->height;
+            for (int row = 0; row < batch->height; row++) {
+                memcpy(atlas->buffer + (size_t)(y + row) * atlas->stride + x,
+                       canvas_row(&canvas, row, scratch), batch->width);
+            }
+        } else {
+            char* output = NULL;
+            size_t length = 0;
+            FILE* stream = open_memstream(&output, &length);
+            write_canvas(&canvas, batch->format, batch->palette, stream);
+            fclose(stream);
+
+            pthread_mutex_lock(&batch->lock);
+            batch->outputs[i] = output;
+            batch->lengths[i] = length;
+            flush_archive(batch);
+            pthread_mutex_unlock(&batch->lock);
+        }
+    }
+
+    free(scratch);
+    cleanup_canvas(&canvas);
+    return NULL;
+}
+
+int main(int argc, char** argv) {
+    OutputFormat format = OUTPUT_PPM;
+    int width = 25, height = 25;
+    int columns = 0;
+    int archive = 0;
+    const char* path = NULL;
+    Palette palette;
+    default_palette(&palette);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (!parse_output_format(argv[++i], &format)) {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+            FILE* in = fopen(argv[++i], "r");
+            if (!in || load_palette(&palette, in) < 0) {
+                fprintf(stderr, "Invalid palette: %s\n", argv[i]);
+                return 1;
+            }
+            fclose(in);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                fprintf(stderr, "Size must be WIDTHxHEIGHT: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--columns") == 0 && i + 1 < argc) {
+            columns = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--archive") == 0) {
+            archive = 1;
+        } else if (!path && argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Usage: %s [--format ansi|truecolor|ppm|raw] [--palette file] [--size WxH] [--columns n] [--archive] instances.txt\n", argv[0]);
+            return 1;
+        }
+    }
+    if (width < 1 || width > MAX_CANVAS_WIDTH || height < 1 || height > MAX_CANVAS_HEIGHT) {
+        fprintf(stderr, "Size must be at most %dx%d\n", MAX_CANVAS_WIDTH, MAX_CANVAS_HEIGHT);
+        return 1;
+    }
+
+    FILE* in = path ? fopen(path, "r") : stdin;
+    if (!in) {
+        perror(path);
+        return 1;
+    }
+    Batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.count = read_instances(in, path ? path : "<stdin>", &batch.instances);
+    if (in != stdin) fclose(in);
+    if (batch.count < 0) return 1;
+    batch.width = width;
+    batch.height = height;
+    batch.format = format;
+    batch.palette = &palette;
+    pthread_mutex_init(&batch.lock, NULL);
+
+    // Roughly square atlas by default
+    Canvas atlas;
+    uint8_t* atlas_buffer = NULL;
+    if (!archive && batch.count > 0) {
+        if (columns < 1) {
+            while (columns * columns < batch.count) columns++;
+        }
+        int rows = (batch.count + columns - 1) / columns;
+        atlas_buffer = (uint8_t*)calloc((size_t)columns * width * rows * height, 1);
+        if (!atlas_buffer) {
+            fprintf(stderr, "Atlas of %dx%d instances doesn't fit in memory\n", columns, rows);
+            return 1;
+        }
+        init_canvas_view(&atlas, atlas_buffer, columns * width, rows * height, columns * width);
+        batch.atlas = &atlas;
+        batch.columns = columns;
+    } else {
+        batch.out = stdout;
+        batch.outputs = (char**)calloc(batch.count + 1, sizeof(char*));
+        batch.lengths = (size_t*)calloc(batch.count + 1, sizeof(size_t));
+    }
+
+    // Instances are spread over the threads; each one renders alone
+    int threads = runtime_thread_count();
+    if (threads > batch.count) threads = batch.count;
+    double start = now_ms();
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * (threads + 1));
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &batch) == 0) {
+            started++;
+        }
+    }
+    batch_worker(&batch);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    double elapsed = now_ms() - start;
+    free(workers);
+
+    if (batch.atlas) {
+        write_canvas(&atlas, format, &palette, stdout);
+    }
+    fprintf(stderr, "%d renders in %.1f ms on %d threads (%.0f renders/s)\n", batch.count, elapsed,
+            started + 1, elapsed > 0 ? batch.count * 1000.0 / elapsed : 0.0);
+
+    for (int i = 0; i < batch.count; i++) {
+        free(batch.instances[i].values);
+        free(batch.instances[i].overridden);
+    }
+    free(batch.instances);
+    free(batch.outputs);
+    free(batch.lengths);
+    free(atlas_buffer);
+    pthread_mutex_destroy(&batch.lock);
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include "runtime.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Renders the compiled program on a large canvas once per memory layout
+// and reports the time and the cache misses of the apply loops plus the
+// de-tiling exporter, so the layouts can be compared on the same stencils.
+// Programs that can be packed (see packing_preserves_output) are also
+// rendered on a packed row-major canvas.
+
+extern const ApplyDesc stencil_applies[];
+extern const int stencil_apply_count;
+void stencil_reset_globals(void);
+
+static const char* layout_names[] = { "row", "tiled", "morton", "packed" };
+
+// Hardware cache-miss counter for this thread, or -1 where it isn't
+// available (non-Linux, or perf_event_paranoid forbids it)
+static int open_miss_counter() {
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.inherit = 1; // count the scheduler's worker threads too
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+static void start_counter(int fd) {
+#ifdef __linux__
+    if (fd < 0) return;
+    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+static long long stop_counter(int fd) {
+    long long count = -1;
+#ifdef __linux__
+    if (fd < 0) return -1;
+    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) count = -1;
+#endif
+    return count;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char** argv) {
+    int size = 2048;
+    int runs = 5;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: %s [--size N] [--runs N]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (size < 1 || size > MAX_CANVAS_WIDTH || size > MAX_CANVAS_HEIGHT || runs < 1) {
+        fprintf(stderr, "Size must be 1-%d and runs at least 1\n", MAX_CANVAS_WIDTH);
+        return 1;
+    }
+
+    // Output goes nowhere; only the cost of de-tiling it matters here
+    FILE* sink = fopen("/dev/null", "w");
+    if (!sink) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    int counter = open_miss_counter();
+    printf("%dx%d canvas, %d applies, best of %d runs\n", size, size, stencil_apply_count, runs);
+    printf("%-8s %12s %16s\n", "layout", "ms", "cache misses");
+
+    int packable = packing_preserves_output(stencil_applies, stencil_apply_count, OUTPUT_ANSI);
+    for (int layout = CANVAS_ROW_MAJOR; layout <= CANVAS_MORTON + packable; layout++) {
+        Canvas canvas;
+        init_canvas(&canvas, size, size);
+        if (layout > CANVAS_MORTON) {
+            set_canvas_format(&canvas, CANVAS_PACKED4);
+        } else {
+            set_canvas_layout(&canvas, (CanvasLayout)layout);
+        }
+
+        double best = 0;
+        long long misses = -1;
+        for (int run = 0; run < runs; run++) {
+            clear_canvas(&canvas);
+            stencil_reset_globals();
+            start_counter(counter);
+            double start = now_ms();
+            run_applies(&canvas, stencil_applies, stencil_apply_count);
+            write_canvas(&canvas, OUTPUT_RAW, NULL, sink);
+            double elapsed = now_ms() - start;
+            long long count = stop_counter(counter);
+            if (run == 0 || elapsed < best) {
+                best = elapsed;
+                misses = count;
+            }
+        }
+
+        if (misses >= 0) {
+            printf("%-8s %12.2f %16lld\n", layout_names[layout], best, misses);
+        } else {
+            printf("%-8s %12.2f %16s\n", layout_names[layout], best, "n/a");
+        }
+        cleanup_canvas(&canvas);
+    }
+
+#ifdef __linux__
+    if (counter >= 0) close(counter);
+#endif
+    fclose(sink);
+    return 0;
+}
@@ -1,6 +1,8 @@
 #include "codegen.h"
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 CodeGenContext* create_codegen_context(FILE* output) {
     CodeGenContext* ctx = (CodeGenContext*)malloc(sizeof(CodeGenContext));
@@ -10,6 +12,39 @@ CodeGenContext* create_codegen_context(FILE* output) {
     ctx->string_counter = 0;
     ctx->current_function = NULL;
     ctx->in_stencil = 0;
+    ctx->paint_returns = 0;
+    ctx->current_block = NULL;
+    ctx->function_output = NULL;
+    ctx->prologue = NULL;
+    ctx->prologue_buffer = NULL;
+    ctx->prologue_size = 0;
+    ctx->program = NULL;
+    memset(ctx->values, 0, sizeof(ctx->values));
+    ctx->value_stack = NULL;
+    ctx->body_buffer = NULL;
+    ctx->body_size = 0;
+    ctx->tail_header = NULL;
+    ctx->tail_calls = NULL;
+    ctx->metadata_buffer = NULL;
+    ctx->metadata_size = 0;
+    ctx->metadata = open_memstream(&ctx->metadata_buffer, &ctx->metadata_size);
+    ctx->metadata_counter = 0;
+    ctx->instrument = 0;
+    ctx->counter_count = 0;
+    ctx->profile = NULL;
+    ctx->profile_count = 0;
+    ctx->batch = 0;
+    ctx->debug = 0;
+    ctx->source_file = "stencil";
+    ctx->debug_unit = -1;
+    ctx->debug_file = -1;
+    ctx->debug_int = -1;
+    ctx->debug_scope = -1;
+    ctx->debug_line = 0;
+    ctx->debug_column = 0;
+    ctx->debug_globals = NULL;
+    ctx->debug_globals_buffer = NULL;
+    ctx->debug_globals_size = 0;
     return ctx;
 }
 
@@ -17,6 +52,10 @@ void free_codegen_context(CodeGenContext* ctx) {
     if (ctx->current_function) {
         free(ctx->current_function);
     }
+    free(ctx->current_block);
+    fclose(ctx->metadata);
+    free(ctx->metadata_buffer);
+    free(ctx->profile);
     free(ctx);
 }
 
@@ -25,6 +64,7 @@ SymbolTable* create_symbol_table() {
     table->vars = NULL;
     table->funcs = NULL;
     table->stencils = NULL;
+    table->applies = NULL;
     return table;
 }
 
@@ -54,6 +94,14 @@ void free_symbol_table(SymbolTable* table) {
         stencil = next;
     }
     
+    ApplyEntry* apply = table->applies;
+    while (apply) {
+        ApplyEntry* next = apply->next;
+        free(apply->stencil);
+        free(apply);
+        apply = next;
+    }
+    
     free(table);
 }
 
@@ -61,25 +109,64 @@ void add_var(SymbolTable* table, const char* name, const char* llvm_name) {
     VarEntry* entry = (VarEntry*)malloc(sizeof(VarEntry));
     entry->name = strdup(name);
     entry->llvm_name = strdup(llvm_name);
+    entry->by_value = 0;
+    entry->readonly = 0;
+    entry->debug_variable = -1;
     entry->next = table->vars;
     table->vars = entry;
 }
 
+void add_value(SymbolTable* table, const char* name, const char* llvm_name) {
+    add_var(table, name, llvm_name);
+    table->vars->by_value = 1;
+}
+
+void add_readonly_value(SymbolTable* table, const char* name, const char* llvm_name) {
+    add_value(table, name, llvm_name);
+    table->vars->readonly = 1;
+}
+
+// Assignment to an SSA variable: it now names a different value
+void set_value(VarEntry* var, const char* llvm_name) {
+    char* copy = strdup(llvm_name);
+    free(var->llvm_name);
+    var->llvm_name = copy;
+}
+
 char* lookup_var(SymbolTable* table, const char* name) {
+    VarEntry* entry = lookup_var_entry(table, name);
+    return entry ? entry->llvm_name : NULL;
+}
+
+VarEntry* lookup_var_entry(SymbolTable* table, const char* name) {
     VarEntry* entry = table->vars;
     while (entry) {
         if (strcmp(entry->name, name) == 0) {
-            return entry->llvm_name;
+            return entry;
         }
         entry = entry->next;
     }
     return NULL;
 }
 
+// Drops the variables declared since `saved` was the head of the list,
+// ending their scope.
+void pop_vars(SymbolTable* table, VarEntry* saved) {
+    while (table->vars && table->vars != saved) {
+        VarEntry* next = table->vars->next;
+        free(table->vars->name);
+        free(table->vars->llvm_name);
+        free(table->vars);
+        table->vars = next;
+    }
+}
+
 void add_func(SymbolTable* table, const char* name, int param_count) {
     FuncEntry* entry = (FuncEntry*)malloc(sizeof(FuncEntry));
     entry->name = strdup(name);
     entry->param_count = param_count;
+    entry->body = NULL;
+    entry->visiting = 0;
     entry->next = table->funcs;
     table->funcs = entry;
 }
@@ -98,6 +185,15 @@ FuncEntry* lookup_func(SymbolTable* table, const char* name) {
 void add_stencil(SymbolTable* table, const char* name) {
     StencilEntry* entry = (StencilEntry*)malloc(sizeof(StencilEntry));
     entry->name = strdup(name);
+    entry->effects = 0;
+    entry->radius = 0;
+    entry->piecewise = 0;
+    entry->sprite = 0;
+    entry->cacheable = 0;
+    entry->covers = 0;
+    entry->line = 0;
+    entry->x_break_count = 0;
+    entry->y_break_count = 0;
     entry->next = table->stencils;
     table->stencils = entry;
 }
@@ -113,6 +209,31 @@ StencilEntry* lookup_stencil(SymbolTable* table, const char* name) {
     return NULL;
 }
 
+ApplyEntry* add_apply(SymbolTable* table, const char* stencil, int x, int y, int size, int layer) {
+    ApplyEntry* entry = (ApplyEntry*)malloc(sizeof(ApplyEntry));
+    entry->index = 0;
+    entry->stencil = strdup(stencil);
+    entry->x = x;
+    entry->y = y;
+    entry->size = size;
+    entry->layer = layer;
+    entry->steps = 1;
+    entry->radius = 0;
+    entry->effects = 0;
+    entry->covers = 0;
+    entry->sprite = 0;
+    entry->next = NULL;
+    
+    // Keep program order, later applies paint over earlier ones
+    ApplyEntry** tail = &table->applies;
+    while (*tail) {
+        entry->index++;
+        tail = &(*tail)->next;
+    }
+    *tail = entry;
+    return entry;
+}
+
 char* new_temp(CodeGenContext* ctx) {
     char* temp = (char*)malloc(32);
     sprintf(temp, "%%tmp%d", ctx->temp_counter++);
@@ -131,17 +252,1009 @@ char* new_string_const(CodeGenContext* ctx) {
     return str;
 }
 
+static unsigned hash_instruction(const char* instruction) {
+    unsigned hash = 2166136261u;
+    for (const char* c = instruction; *c; c++) {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    return hash % VALUE_BUCKETS;
+}
+
+// Emits `temp = <instruction>`, formatted like printf, and returns the
+// temporary. Inside a function body an identical instruction that was
+// already emitted in a dominating block is reused instead. Only pure
+// instructions may go through here.
+char* emit_value(CodeGenContext* ctx, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    
+    char* instruction = (char*)malloc(length + 1);
+    va_start(args, format);
+    vsnprintf(instruction, length + 1, format, args);
+    va_end(args);
+    
+    // Outside function bodies there's no block structure to rely on
+    if (!ctx->function_output) {
+        char* temp = new_temp(ctx);
+        fprintf(ctx->output, "  %s = %s\n", temp, instruction);
+        free(instruction);
+        return temp;
+    }
+    
+    unsigned hash = hash_instruction(instruction);
+    for (ValueEntry* entry = ctx->values[hash]; entry; entry = entry->chain) {
+        if (strcmp(entry->instruction, instruction) == 0) {
+            free(instruction);
+            return strdup(entry->temp);
+        }
+    }
+    
+    ValueEntry* entry = (ValueEntry*)malloc(sizeof(ValueEntry));
+    entry->instruction = instruction;
+    entry->temp = new_temp(ctx);
+    entry->chain = ctx->values[hash];
+    entry->below = ctx->value_stack;
+    ctx->values[hash] = entry;
+    ctx->value_stack = entry;
+    
+    fprintf(ctx->output, "  %s = %s\n", entry->temp, instruction);
+    return strdup(entry->temp);
+}
+
+// Forgets the values numbered since `mark` (a previous ctx->value_stack),
+// when leaving a block they don't dominate. Entries are popped in reverse
+// order, so each one is still the head of its bucket.
+void pop_values(CodeGenContext* ctx, ValueEntry* mark) {
+    while (ctx->value_stack != mark) {
+        ValueEntry* entry = ctx->value_stack;
+        ctx->values[hash_instruction(entry->instruction)] = entry->chain;
+        ctx->value_stack = entry->below;
+        free(entry->instruction);
+        free(entry->temp);
+        free(entry);
+    }
+}
+
+// Reserves a metadata id; the node itself is written to ctx->metadata.
+int new_metadata(CodeGenContext* ctx) {
+    return ctx->metadata_counter++;
+}
+
+void emit_label(CodeGenContext* ctx, const char* label) {
+    fprintf(ctx->output, "%s:\n", label);
+    free(ctx->current_block);
+    ctx->current_block = strdup(label);
+}
+
+// Redirects output into a buffer until end_function_body, which writes
+// whatever was put in ctx->prologue meanwhile ahead of the body. Call it
+// right after emitting the entry label.
+void begin_function_body(CodeGenContext* ctx) {
+    ctx->function_output = ctx->output;
+    ctx->output = open_memstream(&ctx->body_buffer, &ctx->body_size);
+    ctx->prologue = open_memstream(&ctx->prologue_buffer, &ctx->prologue_size);
+    free(ctx->current_block);
+    ctx->current_block = strdup("entry");
+}
+
+void end_function_body(CodeGenContext* ctx) {
+    pop_values(ctx, NULL);
+    fclose(ctx->output);
+    fclose(ctx->prologue);
+    ctx->output = ctx->function_output;
+    ctx->function_output = NULL;
+    ctx->prologue = NULL;
+    
+    fwrite(ctx->prologue_buffer, 1, ctx->prologue_size, ctx->output);
+    fwrite(ctx->body_buffer, 1, ctx->body_size, ctx->output);
+    free(ctx->prologue_buffer);
+    free(ctx->body_buffer);
+    ctx->prologue_buffer = NULL;
+    ctx->body_buffer = NULL;
+}
+
+// Values of the mutable SSA variables in scope at some point, used to
+// place phis where control flow joins.
+typedef struct {
+    VarEntry** vars;
+    char** values;
+    int count;
+} Snapshot;
+
+static void take_snapshot(SymbolTable* table, Snapshot* snapshot) {
+    snapshot->count = 0;
+    for (VarEntry* var = table->vars; var; var = var->next) {
+        if (var->by_value && !var->readonly) snapshot->count++;
+    }
+    
+    snapshot->vars = (VarEntry**)malloc(sizeof(VarEntry*) * (snapshot->count + 1));
+    snapshot->values = (char**)malloc(sizeof(char*) * (snapshot->count + 1));
+    int i = 0;
+    for (VarEntry* var = table->vars; var; var = var->next) {
+        if (var->by_value && !var->readonly) {
+            snapshot->vars[i] = var;
+            snapshot->values[i] = strdup(var->llvm_name);
+            i++;
+        }
+    }
+}
+
+static void restore_snapshot(Snapshot* snapshot) {
+    for (int i = 0; i < snapshot->count; i++) {
+        set_value(snapshot->vars[i], snapshot->values[i]);
+    }
+}
+
+static void free_snapshot(Snapshot* snapshot) {
+    for (int i = 0; i < snapshot->count; i++) {
+        free(snapshot->values[i]);
+    }
+    free(snapshot->vars);
+    free(snapshot->values);
+}
+
+// Whether `node` contains an assignment to a variable called `name`
+int assigns_name(ASTNode* node, const char* name) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_ASSIGNMENT:
+            return strcmp(node->data.assignment.name, name) == 0;
+        case AST_BLOCK:
+            return assigns_name(node->data.block.statements, name);
+        case AST_STATEMENT_LIST:
+            return assigns_name(node->data.list.head, name) ||
+                   assigns_name(node->data.list.tail, name);
+        case AST_IF:
+            return assigns_name(node->data.if_stmt.then_stmt, name) ||
+                   assigns_name(node->data.if_stmt.else_stmt, name);
+        case AST_FOR:
+            return assigns_name(node->data.for_stmt.body, name);
+        case AST_FUNC_DEC:
+            return assigns_name(node->data.func_dec.body, name);
+        case AST_STENCIL:
+            return assigns_name(node->data.stencil.body, name);
+        default:
+            return 0;
+    }
+}
+
+// Which mutable globals `node` may read or write, following calls, plus
+// READS_CANVAS when it peeks. Names are looked up in `table` without
+// tracking local scopes, so a local that shadows a global counts as the
+// global.
+int global_effects(ASTNode* node, SymbolTable* table) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_IDENTIFIER: {
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            return var && !var->by_value ? READS_GLOBALS : 0;
+        }
+        case AST_ASSIGNMENT: {
+            VarEntry* var = lookup_var_entry(table, node->data.assignment.name);
+            int effects = global_effects(node->data.assignment.value, table);
+            return var && !var->by_value ? effects | WRITES_GLOBALS : effects;
+        }
+        case AST_BINARY_OP:
+            return global_effects(node->data.binary_op.left, table) |
+                   global_effects(node->data.binary_op.right, table);
+        case AST_UNARY_OP:
+            return global_effects(node->data.unary_op.operand, table);
+        case AST_VAR_DEC:
+            return global_effects(node->data.var_dec.value, table);
+        case AST_BLOCK:
+            return global_effects(node->data.block.statements, table);
+        case AST_STATEMENT_LIST:
+            return global_effects(node->data.list.head, table) |
+                   global_effects(node->data.list.tail, table);
+        case AST_IF:
+            return global_effects(node->data.if_stmt.condition, table) |
+                   global_effects(node->data.if_stmt.then_stmt, table) |
+                   global_effects(node->data.if_stmt.else_stmt, table);
+        case AST_FOR:
+            return global_effects(node->data.for_stmt.start, table) |
+                   global_effects(node->data.for_stmt.end, table) |
+                   global_effects(node->data.for_stmt.body, table);
+        case AST_RETURN:
+            return global_effects(node->data.return_stmt.value, table);
+        case AST_PAINT:
+            return global_effects(node->data.paint.value, table);
+        case AST_FUNC_CALL: {
+            int effects = global_effects(node->data.func_call.args, table);
+            if (is_peek(node, table)) effects |= READS_CANVAS;
+            FuncEntry* func = lookup_func(table, node->data.func_call.name);
+            if (func && !func->visiting) {
+                func->visiting = 1;
+                effects |= global_effects(func->body, table);
+                func->visiting = 0;
+            }
+            return effects;
+        }
+        default:
+            return 0;
+    }
+}
+
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * CODE_HASH_PRIME;
+    }
+    return hash;
+}
+
+static uint64_t hash_int(uint64_t hash, int value) {
+    return hash_bytes(hash, &value, sizeof(value));
+}
+
+static uint64_t hash_name(uint64_t hash, const char* name) {
+    return name ? hash_bytes(hash, name, strlen(name) + 1) : hash_int(hash, -1);
+}
+
+// Hash of what `node` computes: its shape, names and literals, the values
+// of the constant globals it uses and the code of the functions it calls.
+// Mutable globals only contribute their names; their values are hashed at
+// run time (see generate_cache_key).
+static uint64_t hash_code(ASTNode* node, SymbolTable* table, uint64_t hash) {
+    if (!node) return hash_int(hash, -1);
+    
+    hash = hash_int(hash, node->type);
+    switch (node->type) {
+        case AST_NUMBER:
+            return hash_int(hash, node->data.number.value);
+        case AST_IDENTIFIER: {
+            hash = hash_name(hash, node->data.identifier.name);
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            return var && var->by_value ? hash_name(hash, var->llvm_name) : hash;
+        }
+        case AST_ASSIGNMENT:
+            hash = hash_name(hash, node->data.assignment.name);
+            return hash_code(node->data.assignment.value, table, hash);
+        case AST_VAR_DEC:
+            hash = hash_name(hash, node->data.var_dec.name);
+            return hash_code(node->data.var_dec.value, table, hash);
+        case AST_BINARY_OP:
+            hash = hash_int(hash, node->data.binary_op.op);
+            hash = hash_code(node->data.binary_op.left, table, hash);
+            return hash_code(node->data.binary_op.right, table, hash);
+        case AST_UNARY_OP:
+            hash = hash_int(hash, node->data.unary_op.op);
+            return hash_code(node->data.unary_op.operand, table, hash);
+        case AST_BLOCK:
+            return hash_code(node->data.block.statements, table, hash);
+        case AST_STATEMENT_LIST:
+        case AST_EXPRESSION_LIST:
+        case AST_PARAMETER_LIST:
+            hash = hash_code(node->data.list.head, table, hash);
+            return hash_code(node->data.list.tail, table, hash);
+        case AST_IF:
+            hash = hash_code(node->data.if_stmt.condition, table, hash);
+            hash = hash_code(node->data.if_stmt.then_stmt, table, hash);
+            return hash_code(node->data.if_stmt.else_stmt, table, hash);
+        case AST_FOR:
+            hash = hash_name(hash, node->data.for_stmt.name);
+            hash = hash_code(node->data.for_stmt.start, table, hash);
+            hash = hash_code(node->data.for_stmt.end, table, hash);
+            return hash_code(node->data.for_stmt.body, table, hash);
+        case AST_RETURN:
+            return hash_code(node->data.return_stmt.value, table, hash);
+        case AST_PAINT:
+            return hash_code(node->data.paint.value, table, hash);
+        case AST_FUNC_CALL: {
+            hash = hash_name(hash, node->data.func_call.name);
+            hash = hash_code(node->data.func_call.args, table, hash);
+            FuncEntry* func = lookup_func(table, node->data.func_call.name);
+            if (func && !func->visiting) {
+                func->visiting = 1;
+                hash = hash_int(hash, func->param_count);
+                hash = hash_code(func->body, table, hash);
+                func->visiting = 0;
+            }
+            return hash;
+        }
+        default:
+            return hash;
+    }
+}
+
+// Adds the mutable globals `node` reads, following calls, to `vars`
+// (at most `max`, without repeats). Returns 0 if there are more.
+static int collect_global_reads(ASTNode* node, SymbolTable* table, VarEntry** vars, int* count, int max) {
+    if (!node) return 1;
+    
+    switch (node->type) {
+        case AST_IDENTIFIER: {
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            if (!var || var->by_value) return 1;
+            for (int i = 0; i < *count; i++) {
+                if (vars[i] == var) return 1;
+            }
+            if (*count == max) return 0;
+            vars[(*count)++] = var;
+            return 1;
+        }
+        case AST_ASSIGNMENT:
+            return collect_global_reads(node->data.assignment.value, table, vars, count, max);
+        case AST_VAR_DEC:
+            return collect_global_reads(node->data.var_dec.value, table, vars, count, max);
+        case AST_BINARY_OP:
+            return collect_global_reads(node->data.binary_op.left, table, vars, count, max) &&
+                   collect_global_reads(node->data.binary_op.right, table, vars, count, max);
+        case AST_UNARY_OP:
+            return collect_global_reads(node->data.unary_op.operand, table, vars, count, max);
+        case AST_BLOCK:
+            return collect_global_reads(node->data.block.statements, table, vars, count, max);
+        case AST_STATEMENT_LIST:
+        case AST_EXPRESSION_LIST:
+            return collect_global_reads(node->data.list.head, table, vars, count, max) &&
+                   collect_global_reads(node->data.list.tail, table, vars, count, max);
+        case AST_IF:
+            return collect_global_reads(node->data.if_stmt.condition, table, vars, count, max) &&
+                   collect_global_reads(node->data.if_stmt.then_stmt, table, vars, count, max) &&
+                   collect_global_reads(node->data.if_stmt.else_stmt, table, vars, count, max);
+        case AST_FOR:
+            return collect_global_reads(node->data.for_stmt.start, table, vars, count, max) &&
+                   collect_global_reads(node->data.for_stmt.end, table, vars, count, max) &&
+                   collect_global_reads(node->data.for_stmt.body, table, vars, count, max);
+        case AST_RETURN:
+            return collect_global_reads(node->data.return_stmt.value, table, vars, count, max);
+        case AST_PAINT:
+            return collect_global_reads(node->data.paint.value, table, vars, count, max);
+        case AST_FUNC_CALL: {
+            if (!collect_global_reads(node->data.func_call.args, table, vars, count, max)) return 0;
+            FuncEntry* func = lookup_func(table, node->data.func_call.name);
+            int complete = 1;
+            if (func && !func->visiting) {
+                func->visiting = 1;
+                complete = collect_global_reads(func->body, table, vars, count, max);
+                func->visiting = 0;
+            }
+            return complete;
+        }
+        default:
+            return 1;
+    }
+}
+
+// peek(dx, dy) is a builtin unless the program defines its own peek
+int is_peek(ASTNode* node, SymbolTable* table) {
+    return strcmp(node->data.func_call.name, "peek") == 0 && !lookup_func(table, "peek");
+}
+
+static int max_radius(int a, int b) {
+    if (a < 0 || b < 0) return -1;
+    return a > b ? a : b;
+}
+
+// How far from the current pixel the peeks in `node` read: the largest
+// constant offset, or -1 when some offset isn't constant
+int peek_radius(ASTNode* node, SymbolTable* table) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_FUNC_CALL: {
+            int radius = peek_radius(node->data.func_call.args, table);
+            if (is_peek(node, table)) {
+                ASTNode* args[2];
+                int dx, dy;
+                if (flatten_list(node->data.func_call.args, args, 2) != 2 ||
+                    !fold_constant(args[0], table, &dx) || !fold_constant(args[1], table, &dy)) {
+                    return -1;
+                }
+                radius = max_radius(radius, abs(dx));
+                radius = max_radius(radius, abs(dy));
+            }
+            return radius;
+        }
+        case AST_ASSIGNMENT:
+            return peek_radius(node->data.assignment.value, table);
+        case AST_BINARY_OP:
+            return max_radius(peek_radius(node->data.binary_op.left, table),
+                              peek_radius(node->data.binary_op.right, table));
+        case AST_UNARY_OP:
+            return peek_radius(node->data.unary_op.operand, table);
+        case AST_VAR_DEC:
+            return peek_radius(node->data.var_dec.value, table);
+        case AST_BLOCK:
+            return peek_radius(node->data.block.statements, table);
+        case AST_STATEMENT_LIST:
+            return max_radius(peek_radius(node->data.list.head, table),
+                              peek_radius(node->data.list.tail, table));
+        case AST_IF:
+            return max_radius(peek_radius(node->data.if_stmt.condition, table),
+                              max_radius(peek_radius(node->data.if_stmt.then_stmt, table),
+                                         peek_radius(node->data.if_stmt.else_stmt, table)));
+        case AST_FOR:
+            return max_radius(max_radius(peek_radius(node->data.for_stmt.start, table),
+                                         peek_radius(node->data.for_stmt.end, table)),
+                              peek_radius(node->data.for_stmt.body, table));
+        case AST_RETURN:
+            return peek_radius(node->data.return_stmt.value, table);
+        case AST_PAINT:
+            return peek_radius(node->data.paint.value, table);
+        default:
+            return 0;
+    }
+}
+
+static int add_break(int* breaks, int* count, int value) {
+    for (int i = 0; i < *count; i++) {
+        if (breaks[i] == value) return 1;
+    }
+    if (*count == MAX_BREAKS) return 0;
+    breaks[(*count)++] = value;
+    return 1;
+}
+
+static int is_coordinate(ASTNode* node) {
+    return node && node->type == AST_IDENTIFIER &&
+           (strcmp(node->data.identifier.name, "x") == 0 || strcmp(node->data.identifier.name, "y") == 0);
+}
+
+// Records where `coordinate op constant` changes value, as the first
+// coordinate of each half-open range it is constant on
+static int add_comparison_breaks(StencilEntry* stencil, const char* coordinate, OpType op, int value) {
+    int* breaks = coordinate[0] == 'x' ? stencil->x_breaks : stencil->y_breaks;
+    int* count = coordinate[0] == 'x' ? &stencil->x_break_count : &stencil->y_break_count;
+    
+    switch (op) {
+        case OP_LESS:
+            return add_break(breaks, count, value);
+        case OP_GREATER:
+            return add_break(breaks, count, value + 1);
+        default:
+            return add_break(breaks, count, value) && add_break(breaks, count, value + 1);
+    }
+}
+
+// Whether x and y only reach `node` through comparisons with constants,
+// collecting the breaks of those comparisons into `stencil`. If so, and
+// the stencil neither peeks nor writes globals, its painted value is
+// constant on every rectangle between breaks.
+static int find_breaks(ASTNode* node, SymbolTable* table, StencilEntry* stencil) {
+    if (!node) return 1;
+    
+    switch (node->type) {
+        case AST_IDENTIFIER:
+            return !is_coordinate(node);
+        
+        case AST_BINARY_OP: {
+            OpType op = node->data.binary_op.op;
+            ASTNode* left = node->data.binary_op.left;
+            ASTNode* right = node->data.binary_op.right;
+            int value;
+            
+            if (op == OP_EQUALS || op == OP_LESS || op == OP_GREATER) {
+                if (is_coordinate(left) && fold_constant(right, table, &value)) {
+                    return add_comparison_breaks(stencil, left->data.identifier.name, op, value);
+                }
+                if (is_coordinate(right) && fold_constant(left, table, &value)) {
+                    // c < x is x > c and the other way around
+                    OpType flipped = op == OP_LESS ? OP_GREATER : op == OP_GREATER ? OP_LESS : op;
+                    return add_comparison_breaks(stencil, right->data.identifier.name, flipped, value);
+                }
+            }
+            return find_breaks(left, table, stencil) && find_breaks(right, table, stencil);
+        }
+        
+        case AST_UNARY_OP:
+            return find_breaks(node->data.unary_op.operand, table, stencil);
+        case AST_ASSIGNMENT:
+            return find_breaks(node->data.assignment.value, table, stencil);
+        case AST_VAR_DEC:
+            return strcmp(node->data.var_dec.name, "x") != 0 && strcmp(node->data.var_dec.name, "y") != 0 &&
+                   find_breaks(node->data.var_dec.value, table, stencil);
+        case AST_BLOCK:
+            return find_breaks(node->data.block.statements, table, stencil);
+        case AST_STATEMENT_LIST:
+            return find_breaks(node->data.list.head, table, stencil) &&
+                   find_breaks(node->data.list.tail, table, stencil);
+        case AST_IF:
+            return find_breaks(node->data.if_stmt.condition, table, stencil) &&
+                   find_breaks(node->data.if_stmt.then_stmt, table, stencil) &&
+                   find_breaks(node->data.if_stmt.else_stmt, table, stencil);
+        case AST_FOR:
+            return strcmp(node->data.for_stmt.name, "x") != 0 && strcmp(node->data.for_stmt.name, "y") != 0 &&
+                   find_breaks(node->data.for_stmt.start, table, stencil) &&
+                   find_breaks(node->data.for_stmt.end, table, stencil) &&
+                   find_breaks(node->data.for_stmt.body, table, stencil);
+        case AST_RETURN:
+            return find_breaks(node->data.return_stmt.value, table, stencil);
+        case AST_PAINT:
+            return find_breaks(node->data.paint.value, table, stencil);
+        case AST_FUNC_CALL:
+            return !is_peek(node, table) && find_breaks(node->data.func_call.args, table, stencil);
+        default:
+            return 1;
+    }
+}
+
+// Evaluates expressions made of numbers, operators and constants known
+// to the symbol table. Returns 0 when `node` isn't constant.
+int fold_constant(ASTNode* node, SymbolTable* table, int* value) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_NUMBER:
+            *value = node->data.number.value;
+            return 1;
+        
+        case AST_IDENTIFIER: {
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            char* end;
+            if (!var || !var->by_value || !var->readonly) return 0;
+            long number = strtol(var->llvm_name, &end, 10);
+            if (*var->llvm_name == '\0' || *end != '\0') return 0;
+            *value = (int)number;
+            return 1;
+        }
+        
+        case AST_UNARY_OP: {
+            int operand;
+            if (!fold_constant(node->data.unary_op.operand, table, &operand)) return 0;
+            switch (node->data.unary_op.op) {
+                case OP_MINUS: *value = -operand; return 1;
+                case OP_PLUS: *value = operand; return 1;
+                case OP_NOT: *value = operand == 0; return 1;
+                default: return 0;
+            }
+        }
+        
+        case AST_BINARY_OP: {
+            int left, right;
+            if (!fold_constant(node->data.binary_op.left, table, &left) ||
+                !fold_constant(node->data.binary_op.right, table, &right)) {
+                return 0;
+            }
+            switch (node->data.binary_op.op) {
+                case OP_PLUS: *value = left + right; return 1;
+                case OP_MINUS: *value = left - right; return 1;
+                case OP_TIMES: *value = left * right; return 1;
+                case OP_DIVIDE:
+                    if (right == 0 || (left == -2147483647 - 1 && right == -1)) return 0;
+                    *value = left / right;
+                    return 1;
+                case OP_EQUALS: *value = left == right; return 1;
+                case OP_GREATER: *value = left > right; return 1;
+                case OP_LESS: *value = left < right; return 1;
+                case OP_AND: *value = left && right; return 1;
+                case OP_OR: *value = left || right; return 1;
+                default: return 0;
+            }
+        }
+        
+        default:
+            return 0;
+    }
+}
+
+// Numbers the profile counters in program order: two per if (then and
+// else arm) and one per function or stencil entry. An instrumented build
+// and a --profile-use build of the same source agree on the numbering.
+static void assign_counters(ASTNode* node, int* next) {
+    if (!node) return;
+    
+    switch (node->type) {
+        case AST_IF:
+            node->counter = *next;
+            *next += 2;
+            assign_counters(node->data.if_stmt.then_stmt, next);
+            assign_counters(node->data.if_stmt.else_stmt, next);
+            break;
+        case AST_BLOCK:
+            assign_counters(node->data.block.statements, next);
+            break;
+        case AST_STATEMENT_LIST:
+            assign_counters(node->data.list.head, next);
+            assign_counters(node->data.list.tail, next);
+            break;
+        case AST_FOR:
+            assign_counters(node->data.for_stmt.body, next);
+            break;
+        case AST_FUNC_DEC:
+            node->counter = (*next)++;
+            assign_counters(node->data.func_dec.body, next);
+            break;
+        case AST_STENCIL:
+            node->counter = (*next)++;
+            assign_counters(node->data.stencil.body, next);
+            break;
+        default:
+            break;
+    }
+}
+
+// Reads a profile written by the runtime of an instrumented program:
+// a "stencil-profile N" line followed by N counts. Returns 0 when the
+// file can't be read.
+int load_profile(CodeGenContext* ctx, const char* path) {
+    FILE* file = fopen(path, "r");
+    if (!file) return 0;
+    
+    int count;
+    if (fscanf(file, "stencil-profile %d", &count) != 1 || count < 0) {
+        fclose(file);
+        return 0;
+    }
+    
+    uint64_t* counts = (uint64_t*)calloc(count + 1, sizeof(uint64_t));
+    for (int i = 0; i < count; i++) {
+        unsigned long long value;
+        if (fscanf(file, "%llu", &value) != 1) {
+            free(counts);
+            fclose(file);
+            return 0;
+        }
+        counts[i] = value;
+    }
+    fclose(file);
+    
+    free(ctx->profile);
+    ctx->profile = counts;
+    ctx->profile_count = count;
+    return 1;
+}
+
+// Bumps a profile counter. Applies run on several threads, hence atomic.
+static void emit_counter(CodeGenContext* ctx, FILE* out, int counter) {
+    char* old = new_temp(ctx);
+    fprintf(out, "  %s = atomicrmw add i64* getelementptr inbounds ([%d x i64], [%d x i64]* @stencil_profile_counters, i32 0, i32 %d), i64 1 monotonic\n",
+            old, ctx->counter_count, ctx->counter_count, counter);
+    free(old);
+}
+
+// Metadata with the measured entry count of a function or stencil, for
+// its `define` line; empty without a profile
+static void function_entry_count(CodeGenContext* ctx, ASTNode* node, char* prof, size_t size) {
+    prof[0] = '\0';
+    if (!ctx->profile || node->counter < 0) return;
+    
+    int entry = new_metadata(ctx);
+    fprintf(ctx->metadata, "!%d = !{!\"function_entry_count\", i64 %llu}\n", entry,
+            (unsigned long long)ctx->profile[node->counter]);
+    snprintf(prof, size, " !prof !%d", entry);
+}
+
+// Branch weights for an if from its arm counts, scaled down to fit the
+// 32-bit weights LLVM takes
+static int branch_weights(CodeGenContext* ctx, uint64_t taken, uint64_t not_taken) {
+    while (taken > 0x7fffffff || not_taken > 0x7fffffff) {
+        taken >>= 1;
+        not_taken >>= 1;
+    }
+    
+    int weights = new_metadata(ctx);
+    fprintf(ctx->metadata, "!%d = !{!\"branch_weights\", i32 %d, i32 %d}\n", weights,
+            (int)taken, (int)not_taken);
+    return weights;
+}
+
+// Debug info. With -g every function gets a DISubprogram and every
+// statement a DILocation, so profilers and debuggers map the machine code
+// back to .stencil lines; locals and parameters are described with
+// llvm.dbg.value, since they are SSA values rather than memory.
+
+// Writes a string for a metadata string field
+static void print_metadata_string(FILE* out, const char* text) {
+    fputc('"', out);
+    for (const char* c = text; *c; c++) {
+        if (*c == '"' || *c == '\\' || (unsigned char)*c < 0x20) {
+            fprintf(out, "\\%02X", (unsigned char)*c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+// Reserves the compile unit's ids; the nodes themselves are written by
+// finish_debug_info once the globals are known
+static void begin_debug_info(CodeGenContext* ctx) {
+    ctx->debug_unit = new_metadata(ctx);
+    ctx->debug_file = new_metadata(ctx);
+    ctx->debug_int = new_metadata(ctx);
+    ctx->debug_globals = open_memstream(&ctx->debug_globals_buffer, &ctx->debug_globals_size);
+    fprintf(ctx->output, "declare void @llvm.dbg.value(metadata, metadata, metadata)\n\n");
+}
+
+static void finish_debug_info(CodeGenContext* ctx) {
+    FILE* md = ctx->metadata;
+    fclose(ctx->debug_globals);
+    ctx->debug_globals = NULL;
+    
+    int globals = new_metadata(ctx);
+    int dwarf_version = new_metadata(ctx);
+    int debug_version = new_metadata(ctx);
+    
+    fprintf(md, "!llvm.dbg.cu = !{!%d}\n", ctx->debug_unit);
+    fprintf(md, "!llvm.module.flags = !{!%d, !%d}\n", dwarf_version, debug_version);
+    fprintf(md, "!%d = distinct !DICompileUnit(language: DW_LANG_C99, file: !%d, producer: \"stencil\", "
+                "isOptimized: false, runtimeVersion: 0, emissionKind: FullDebug, globals: !%d)\n",
+            ctx->debug_unit, ctx->debug_file, globals);
+    // The leading ", " of the first entry is skipped
+    fprintf(md, "!%d = !{%s}\n", globals,
+            ctx->debug_globals_size > 0 ? ctx->debug_globals_buffer + 2 : "");
+    
+    char directory[4096];
+    if (!getcwd(directory, sizeof(directory))) {
+        strcpy(directory, ".");
+    }
+    fprintf(md, "!%d = !DIFile(filename: ", ctx->debug_file);
+    print_metadata_string(md, ctx->source_file);
+    fprintf(md, ", directory: ");
+    print_metadata_string(md, directory);
+    fprintf(md, ")\n");
+    fprintf(md, "!%d = !DIBasicType(name: \"int\", size: 32, encoding: DW_ATE_signed)\n", ctx->debug_int);
+    fprintf(md, "!%d = !{i32 7, !\"Dwarf Version\", i32 4}\n", dwarf_version);
+    fprintf(md, "!%d = !{i32 2, !\"Debug Info Version\", i32 3}\n", debug_version);
+    
+    free(ctx->debug_globals_buffer);
+    ctx->debug_globals_buffer = NULL;
+}
+
+// Starts a function's debug info, right before its `define`. `name` is
+// how the source calls it; apply loops take the apply's line.
+void debug_function(CodeGenContext* ctx, const char* name, const char* linkage_name, int line) {
+    if (!ctx->debug) return;
+    
+    int subprogram = new_metadata(ctx);
+    int location = new_metadata(ctx);
+    FILE* md = ctx->metadata;
+    fprintf(md, "!%d = distinct !DISubprogram(name: \"%s\", ", subprogram, name);
+    if (linkage_name && strcmp(linkage_name, name) != 0) {
+        fprintf(md, "linkageName: \"%s\", ", linkage_name);
+    }
+    fprintf(md, "scope: !%d, file: !%d, line: %d, type: !DISubroutineType(types: !{null}), "
+                "scopeLine: %d, spFlags: DISPFlagDefinition, unit: !%d)\n",
+            ctx->debug_file, ctx->debug_file, line, line, ctx->debug_unit);
+    fprintf(md, "!%d = !DILocation(line: %d, scope: !%d)\n", location, line, subprogram);
+    
+    fprintf(ctx->output, ";dbg-function !%d !%d\n", subprogram, location);
+    ctx->debug_scope = subprogram;
+    ctx->debug_line = line;
+    ctx->debug_column = 0;
+}
+
+// Code generated from here on belongs to `node`'s line and column
+void debug_location(CodeGenContext* ctx, ASTNode* node) {
+    if (!ctx->debug || ctx->debug_scope < 0 || node->line <= 0) return;
+    if (node->line == ctx->debug_line && node->column == ctx->debug_column) return;
+    
+    int location = new_metadata(ctx);
+    fprintf(ctx->metadata, "!%d = !DILocation(line: %d, column: %d, scope: !%d)\n",
+            location, node->line, node->column, ctx->debug_scope);
+    fprintf(ctx->output, ";dbg !%d\n", location);
+    ctx->debug_line = node->line;
+    ctx->debug_column = node->column;
+}
+
+// Describes a local of the current function; `arg` is the parameter's
+// position from 1, or 0 for a `var`
+void debug_variable(CodeGenContext* ctx, VarEntry* var, int line, int arg) {
+    if (!ctx->debug || ctx->debug_scope < 0) return;
+    
+    var->debug_variable = new_metadata(ctx);
+    fprintf(ctx->metadata, "!%d = !DILocalVariable(name: \"%s\", ", var->debug_variable, var->name);
+    if (arg > 0) {
+        fprintf(ctx->metadata, "arg: %d, ", arg);
+    }
+    fprintf(ctx->metadata, "scope: !%d, file: !%d, line: %d, type: !%d)\n",
+            ctx->debug_scope, ctx->debug_file, line, ctx->debug_int);
+}
+
+// Records the variable's current value. Not between phis: callers
+// describe the values of a join only after all of its phis.
+void debug_value(CodeGenContext* ctx, VarEntry* var) {
+    if (!ctx->debug || var->debug_variable < 0) return;
+    
+    fprintf(ctx->output, "  call void @llvm.dbg.value(metadata i32 %s, metadata !%d, metadata !DIExpression())\n",
+            var->llvm_name, var->debug_variable);
+}
+
+// Debug info of a global variable, for its definition line; empty
+// without -g
+static void debug_global(CodeGenContext* ctx, ASTNode* node, char* attachment, size_t size) {
+    attachment[0] = '\0';
+    if (!ctx->debug) return;
+    
+    int expression = new_metadata(ctx);
+    int variable = new_metadata(ctx);
+    fprintf(ctx->metadata, "!%d = !DIGlobalVariableExpression(var: !%d, expr: !DIExpression())\n",
+            expression, variable);
+    fprintf(ctx->metadata, "!%d = distinct !DIGlobalVariable(name: \"%s\", scope: !%d, file: !%d, "
+                           "line: %d, type: !%d, isLocal: false, isDefinition: true)\n",
+            variable, node->data.var_dec.name, ctx->debug_unit, ctx->debug_file, node->line, ctx->debug_int);
+    fprintf(ctx->debug_globals, ", !%d", expression);
+    snprintf(attachment, size, ", !dbg !%d", expression);
+}
+
+// Turns the markers written by debug_function and debug_location into
+// attachments: the `define` after a function marker gets the subprogram,
+// and each instruction up to the closing brace the location of the
+// marker before it (the function's own line before the first one).
+static void attach_debug_locations(const char* text, size_t size, FILE* out) {
+    int subprogram = -1;
+    int location = -1;
+    int in_function = 0;
+    
+    const char* end = text + size;
+    for (const char* line = text; line < end; ) {
+        const char* newline = memchr(line, '\n', end - line);
+        const char* next = newline ? newline + 1 : end;
+        int length = (int)((newline ? newline : end) - line);
+        
+        if (strncmp(line, ";dbg-function ", 14) == 0) {
+            sscanf(line, ";dbg-function !%d !%d", &subprogram, &location);
+        } else if (strncmp(line, ";dbg ", 5) == 0) {
+            sscanf(line, ";dbg !%d", &location);
+        } else if (strncmp(line, "define ", 7) == 0 && subprogram >= 0 &&
+                   length >= 2 && strncmp(line + length - 2, " {", 2) == 0) {
+            fprintf(out, "%.*s !dbg !%d {\n", length - 2, line, subprogram);
+            in_function = 1;
+        } else if (in_function && length == 1 && line[0] == '}') {
+            fprintf(out, "}\n");
+            in_function = 0;
+            subprogram = -1;
+        } else if (in_function && length > 2 && strncmp(line, "  ", 2) == 0 && line[2] != ';') {
+            fprintf(out, "%.*s, !dbg !%d\n", length, line, location);
+        } else {
+            fwrite(line, 1, next - line, out);
+        }
+        line = next;
+    }
+}
+
+// Cost model for lowering conditionals. Calls are the expensive part;
+// the rest is roughly one unit per instruction.
+#define CALL_COST 20
+#define SHORT_CIRCUIT_COST 4 // right operands of && and || above this get a branch
+#define SELECT_COST 8 // if arms up to this together run without a branch
+
+static int estimate_cost(ASTNode* node, SymbolTable* table) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_IDENTIFIER: {
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            return var && !var->by_value ? 1 : 0;
+        }
+        case AST_UNARY_OP:
+            return 1 + estimate_cost(node->data.unary_op.operand, table);
+        case AST_BINARY_OP: {
+            int cost = estimate_cost(node->data.binary_op.left, table) +
+                       estimate_cost(node->data.binary_op.right, table);
+            switch (node->data.binary_op.op) {
+                case OP_DIVIDE: return cost + 8;
+                case OP_LESS: case OP_GREATER: case OP_EQUALS: return cost + 2;
+                case OP_AND: case OP_OR: return cost + 4;
+                default: return cost + 1;
+            }
+        }
+        case AST_FUNC_CALL:
+            return (is_peek(node, table) ? 4 : CALL_COST) +
+                   estimate_cost(node->data.func_call.args, table);
+        case AST_EXPRESSION_LIST:
+        case AST_STATEMENT_LIST:
+            return estimate_cost(node->data.list.head, table) +
+                   estimate_cost(node->data.list.tail, table);
+        case AST_ASSIGNMENT:
+            return estimate_cost(node->data.assignment.value, table);
+        case AST_BLOCK:
+            return estimate_cost(node->data.block.statements, table);
+        case AST_PAINT:
+            return estimate_cost(node->data.paint.value, table);
+        default:
+            return 0;
+    }
+}
+
+// The paint statement an if arm consists of, if that's all it does
+static ASTNode* single_paint(ASTNode* arm) {
+    while (arm && arm->type == AST_BLOCK) {
+        ASTNode* statements[2];
+        if (flatten_list(arm->data.block.statements, statements, 2) != 1) return NULL;
+        arm = statements[0];
+    }
+    return arm && arm->type == AST_PAINT ? arm : NULL;
+}
+
+// Whether an if arm can be executed unconditionally and its results
+// picked with select: assignments to SSA locals of expressions that
+// neither trap nor have side effects
+static int speculatable(ASTNode* node, SymbolTable* table) {
+    if (!node) return 1;
+    
+    switch (node->type) {
+        case AST_NUMBER:
+        case AST_IDENTIFIER:
+            return 1;
+        case AST_UNARY_OP:
+            return speculatable(node->data.unary_op.operand, table);
+        case AST_BINARY_OP: {
+            int divisor;
+            if (node->data.binary_op.op == OP_DIVIDE &&
+                (!fold_constant(node->data.binary_op.right, table, &divisor) ||
+                 divisor == 0 || divisor == -1)) {
+                return 0;
+            }
+            return speculatable(node->data.binary_op.left, table) &&
+                   speculatable(node->data.binary_op.right, table);
+        }
+        case AST_ASSIGNMENT: {
+            VarEntry* var = lookup_var_entry(table, node->data.assignment.name);
+            return var && var->by_value && !var->readonly &&
+                   speculatable(node->data.assignment.value, table);
+        }
+        case AST_BLOCK:
+            return speculatable(node->data.block.statements, table);
+        case AST_STATEMENT_LIST:
+            return speculatable(node->data.list.head, table) &&
+                   speculatable(node->data.list.tail, table);
+        default:
+            return 0;
+    }
+}
+
 void emit_runtime_functions(CodeGenContext* ctx) {
     FILE* out = ctx->output;
     
+    // Apply descriptor, see ApplyDesc in runtime.h
+    fprintf(out, "%%ApplyDesc = type { void (i8*, i32, i32, i32, i32, i32)*, i32, i32, i32, i32, i32*, i32, i32, i32, i32, void (i8*, i32, i32, i32, i32, i32)*, i64 ()*, i32*, i32 }\n\n");
+    
     // External functions for pixel operations
     fprintf(out, "; External functions\n");
-    fprintf(out, "declare void @paint_pixel(i32, i32, i32)\n");
-    fprintf(out, "declare i32 @get_canvas_width()\n");
-    fprintf(out, "declare i32 @get_canvas_height()\n");
+    fprintf(out, "declare void @paint_pixel(i8*, i32, i32, i32)\n");
+    fprintf(out, "declare i32 @peek_pixel(i8*, i32, i32)\n");
+    fprintf(out, "declare void @fill_rect(i8*, i32, i32, i32, i32, i32)\n");
+    fprintf(out, "declare i32 @llvm.smax.i32(i32, i32)\n");
+    fprintf(out, "declare i32 @llvm.smin.i32(i32, i32)\n");
+    fprintf(out, "declare i32 @get_canvas_width(i8*)\n");
+    fprintf(out, "declare i32 @get_canvas_height(i8*)\n");
+    fprintf(out, "declare void @clear_pixel(i8*, i32, i32)\n");
+    fprintf(out, "declare i32 @run_applies(i8*, %%ApplyDesc*, i32)\n");
     fprintf(out, "\n");
 }
 
+// a && b or a || b evaluating b only when a doesn't decide the result.
+// Used when b is costly; b mustn't write globals, since skipping it
+// would then be visible.
+static char* generate_short_circuit(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
+    int is_and = node->data.binary_op.op == OP_AND;
+    char* left = generate_expression(node->data.binary_op.left, ctx, table);
+    char* left_bool = emit_value(ctx, "icmp ne i32 %s, 0", left);
+    char* left_block = strdup(ctx->current_block);
+    char* right_label = new_label(ctx);
+    char* end_label = new_label(ctx);
+    
+    fprintf(ctx->output, "  br i1 %s, label %%%s, label %%%s\n", left_bool,
+            is_and ? right_label : end_label, is_and ? end_label : right_label);
+    
+    // Values numbered for b don't dominate the end
+    ValueEntry* values = ctx->value_stack;
+    emit_label(ctx, right_label);
+    char* right = generate_expression(node->data.binary_op.right, ctx, table);
+    char* right_bool = emit_value(ctx, "icmp ne i32 %s, 0", right);
+    char* right_block = strdup(ctx->current_block);
+    fprintf(ctx->output, "  br label %%%s\n", end_label);
+    pop_values(ctx, values);
+    
+    emit_label(ctx, end_label);
+    char* phi = new_temp(ctx);
+    fprintf(ctx->output, "  %s = phi i1 [%s, %%%s], [%s, %%%s]\n", phi,
+            is_and ? "false" : "true", left_block, right_bool, right_block);
+    char* temp = emit_value(ctx, "zext i1 %s to i32", phi);
+    
+    free(left); free(left_bool); free(left_block);
+    free(right); free(right_bool); free(right_block);
+    free(right_label); free(end_label);
+    free(phi);
+    return temp;
+}
+
 char* generate_expression(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
     if (!node) return NULL;
     
@@ -156,25 +1269,14 @@ char* generate_expression(ASTNode* node, CodeGenContext* ctx, SymbolTable* table
         }
         
         case AST_IDENTIFIER: {
-            char* var_name = lookup_var(table, node->data.identifier.name);
-            if (var_name) {
-                if (ctx->in_stencil) {
-                    char* temp = new_temp(ctx);
-                    fprintf(out, "  %s = load i32, i32* %s\n", temp, var_name);
-                    return temp;
-                } else {
-                    return strdup(var_name);
-                }
-            } else if (ctx->in_stencil) {
-                if (strcmp(node->data.identifier.name, "x") == 0) {
-                    char* temp = new_temp(ctx);
-                    fprintf(out, "  %s = load i32, i32* %%x\n", temp);
-                    return temp;
-                } else if (strcmp(node->data.identifier.name, "y") == 0) {
-                    char* temp = new_temp(ctx);
-                    fprintf(out, "  %s = load i32, i32* %%y\n", temp);
-                    return temp;
+            VarEntry* var = lookup_var_entry(table, node->data.identifier.name);
+            if (var) {
+                if (var->by_value) {
+                    return strdup(var->llvm_name);
                 }
+                char* temp = new_temp(ctx);
+                fprintf(out, "  %s = load i32, i32* %s\n", temp, var->llvm_name);
+                return temp;
             }
             result = (char*)malloc(strlen(node->data.identifier.name) + 2);
             sprintf(result, "%%%s", node->data.identifier.name);
@@ -182,61 +1284,68 @@ char* generate_expression(ASTNode* node, CodeGenContext* ctx, SymbolTable* table
         }
         
         case AST_BINARY_OP: {
+            OpType op = node->data.binary_op.op;
+            ASTNode* right_node = node->data.binary_op.right;
+            if ((op == OP_AND || op == OP_OR) && estimate_cost(right_node, table) > SHORT_CIRCUIT_COST &&
+                !(global_effects(right_node, table) & WRITES_GLOBALS)) {
+                return generate_short_circuit(node, ctx, table);
+            }
+            
             char* left = generate_expression(node->data.binary_op.left, ctx, table);
-            char* right = generate_expression(node->data.binary_op.right, ctx, table);
-            char* temp = new_temp(ctx);
+            char* right = generate_expression(right_node, ctx, table);
             
-            switch (node->data.binary_op.op) {
+            // Operands of commutative operators in a fixed order, so that
+            // a + b and b + a number the same
+            const char* a = left;
+            const char* b = right;
+            if ((op == OP_PLUS || op == OP_TIMES || op == OP_EQUALS || op == OP_AND || op == OP_OR) &&
+                strcmp(a, b) > 0) {
+                a = right;
+                b = left;
+            }
+            
+            char* temp = NULL;
+            char* cmp_temp = NULL;
+            switch (op) {
                 case OP_PLUS:
-                    fprintf(out, "  %s = add i32 %s, %s\n", temp, left, right);
+                    temp = emit_value(ctx, "add i32 %s, %s", a, b);
                     break;
                 case OP_MINUS:
-                    fprintf(out, "  %s = sub i32 %s, %s\n", temp, left, right);
+                    temp = emit_value(ctx, "sub i32 %s, %s", a, b);
                     break;
                 case OP_TIMES:
-                    fprintf(out, "  %s = mul i32 %s, %s\n", temp, left, right);
+                    temp = emit_value(ctx, "mul i32 %s, %s", a, b);
                     break;
                 case OP_DIVIDE:
-                    fprintf(out, "  %s = sdiv i32 %s, %s\n", temp, left, right);
+                    temp = emit_value(ctx, "sdiv i32 %s, %s", a, b);
                     break;
-                case OP_LESS: {
-                    char* cmp_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp slt i32 %s, %s\n", cmp_temp, left, right);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, cmp_temp);
+                case OP_LESS:
+                    cmp_temp = emit_value(ctx, "icmp slt i32 %s, %s", a, b);
                     break;
-                }
-                case OP_GREATER: {
-                    char* cmp_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp sgt i32 %s, %s\n", cmp_temp, left, right);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, cmp_temp);
+                case OP_GREATER:
+                    cmp_temp = emit_value(ctx, "icmp sgt i32 %s, %s", a, b);
                     break;
-                }
-                case OP_EQUALS: {
-                    char* cmp_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp eq i32 %s, %s\n", cmp_temp, left, right);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, cmp_temp);
+                case OP_EQUALS:
+                    cmp_temp = emit_value(ctx, "icmp eq i32 %s, %s", a, b);
                     break;
-                }
-                case OP_AND: {
-                    char* left_bool = new_temp(ctx);
-                    char* right_bool = new_temp(ctx);
-                    char* and_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp ne i32 %s, 0\n", left_bool, left);
-                    fprintf(out, "  %s = icmp ne i32 %s, 0\n", right_bool, right);
-                    fprintf(out, "  %s = and i1 %s, %s\n", and_temp, left_bool, right_bool);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, and_temp);
-                    break;
-                }
+                case OP_AND:
                 case OP_OR: {
-                    char* left_bool = new_temp(ctx);
-                    char* right_bool = new_temp(ctx);
-                    char* or_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp ne i32 %s, 0\n", left_bool, left);
-                    fprintf(out, "  %s = icmp ne i32 %s, 0\n", right_bool, right);
-                    fprintf(out, "  %s = or i1 %s, %s\n", or_temp, left_bool, right_bool);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, or_temp);
+                    char* left_bool = emit_value(ctx, "icmp ne i32 %s, 0", a);
+                    char* right_bool = emit_value(ctx, "icmp ne i32 %s, 0", b);
+                    cmp_temp = emit_value(ctx, "%s i1 %s, %s", op == OP_AND ? "and" : "or",
+                                          left_bool, right_bool);
+                    free(left_bool);
+                    free(right_bool);
                     break;
                 }
+                default:
+                    temp = strdup("0");
+                    break;
+            }
+            
+            if (cmp_temp) {
+                temp = emit_value(ctx, "zext i1 %s to i32", cmp_temp);
+                free(cmp_temp);
             }
             
             free(left);
@@ -246,65 +1355,188 @@ char* generate_expression(ASTNode* node, CodeGenContext* ctx, SymbolTable* table
         
         case AST_UNARY_OP: {
             char* operand = generate_expression(node->data.unary_op.operand, ctx, table);
-            char* temp = new_temp(ctx);
+            char* temp;
             
             switch (node->data.unary_op.op) {
                 case OP_MINUS:
-                    fprintf(out, "  %s = sub i32 0, %s\n", temp, operand);
+                    temp = emit_value(ctx, "sub i32 0, %s", operand);
                     break;
-                case OP_PLUS:
-                    // No-op for unary plus
-                    free(temp);
-                    return operand;
                 case OP_NOT: {
-                    char* cmp_temp = new_temp(ctx);
-                    fprintf(out, "  %s = icmp eq i32 %s, 0\n", cmp_temp, operand);
-                    fprintf(out, "  %s = zext i1 %s to i32\n", temp, cmp_temp);
+                    char* cmp_temp = emit_value(ctx, "icmp eq i32 %s, 0", operand);
+                    temp = emit_value(ctx, "zext i1 %s to i32", cmp_temp);
+                    free(cmp_temp);
                     break;
                 }
+                default:
+                    // No-op for unary plus
+                    return operand;
             }
             
             free(operand);
             return temp;
         }
         
-        case AST_FUNC_CALL: {
-            char* temp = new_temp(ctx);
-            
-            int arg_count = 0;
-            char* args[100];
-            ASTNode* arg_list = node->data.func_call.args;
-            
-            while (arg_list && arg_count < 100) {
-                if (arg_list->type == AST_EXPRESSION_LIST) {
-                    args[arg_count++] = generate_expression(arg_list->data.list.head, ctx, table);
-                    arg_list = arg_list->data.list.tail;
-                } else {
-                    args[arg_count++] = generate_expression(arg_list, ctx, table);
-                    break;
-                }
-            }
-            
-            // Generate call
-            fprintf(out, "  %s = call i32 @%s(", temp, node->data.func_call.name);
-            for (int i = 0; i < arg_count; i++) {
-                if (i > 0) fprintf(out, ", ");
-                fprintf(out, "i32 %s", args[i]);
-                free(args[i]);
-            }
-            fprintf(out, ")\n");
-            
-            return temp;
-        }
+        case AST_FUNC_CALL:
+            return generate_call(node, ctx, table, "call");
         
         default:
             return NULL;
     }
 }
 
+// Collects the items of a comma separated list (arguments, parameters)
+// in source order, whatever way the parser nested them.
+int flatten_list(ASTNode* node, ASTNode** items, int max) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_STATEMENT_LIST:
+        case AST_EXPRESSION_LIST:
+        case AST_PARAMETER_LIST: {
+            int count = flatten_list(node->data.list.head, items, max);
+            return count + flatten_list(node->data.list.tail, items + count, max - count);
+        }
+        
+        default:
+            if (max <= 0) return 0;
+            items[0] = node;
+            return 1;
+    }
+}
+
+// peek(dx, dy): the canvas value next to the current pixel, as it was at
+// the start of the step. Only stencils have a current pixel.
+static char* generate_peek(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
+    ASTNode* args[3];
+    if (!ctx->in_stencil || flatten_list(node->data.func_call.args, args, 3) != 2) {
+        fprintf(stderr, "Error: peek(dx, dy) can only be used in a stencil\n");
+        return strdup("0");
+    }
+    
+    // The canvas doesn't change while a stencil runs (paint ends it), so
+    // peeks at the same place are numbered like any other value
+    char* dx = generate_expression(args[0], ctx, table);
+    char* dy = generate_expression(args[1], ctx, table);
+    char* base_x = emit_value(ctx, "add i32 %%x_val, %%offset_x");
+    char* base_y = emit_value(ctx, "add i32 %%y_val, %%offset_y");
+    char* peek_x = emit_value(ctx, "add i32 %s, %s", base_x, dx);
+    char* peek_y = emit_value(ctx, "add i32 %s, %s", base_y, dy);
+    char* value = emit_value(ctx, "call i32 @peek_pixel(i8* %%canvas_ptr, i32 %s, i32 %s)", peek_x, peek_y);
+    
+    free(dx); free(dy);
+    free(base_x); free(base_y);
+    free(peek_x); free(peek_y);
+    return value;
+}
+
+// `call` is the call instruction to emit: "call", "tail call" or
+// "musttail call". Plain calls to functions that don't touch mutable
+// globals are numbered: with the same arguments they return the same.
+char* generate_call(ASTNode* node, CodeGenContext* ctx, SymbolTable* table, const char* call) {
+    if (is_peek(node, table)) {
+        return generate_peek(node, ctx, table);
+    }
+    
+    ASTNode* arg_nodes[100];
+    int arg_count = flatten_list(node->data.func_call.args, arg_nodes, 100);
+    
+    char* args_buffer = NULL;
+    size_t args_size = 0;
+    FILE* args = open_memstream(&args_buffer, &args_size);
+    for (int i = 0; i < arg_count; i++) {
+        char* arg = generate_expression(arg_nodes[i], ctx, table);
+        fprintf(args, "%si32 %s", i > 0 ? ", " : "", arg);
+        free(arg);
+    }
+    fclose(args);
+    
+    char* temp;
+    if (strcmp(call, "call") == 0 && global_effects(node, table) == 0) {
+        temp = emit_value(ctx, "call i32 @%s(%s)", node->data.func_call.name, args_buffer);
+    } else {
+        temp = new_temp(ctx);
+        fprintf(ctx->output, "  %s = %s i32 @%s(%s)\n", temp, call, node->data.func_call.name, args_buffer);
+    }
+    
+    free(args_buffer);
+    return temp;
+}
+
+// A call to the function being generated, with the right arity, directly
+// under a return
+static int is_self_tail_call(ASTNode* value, CodeGenContext* ctx, SymbolTable* table) {
+    if (!value || value->type != AST_FUNC_CALL || !ctx->current_function) return 0;
+    if (strcmp(value->data.func_call.name, ctx->current_function) != 0) return 0;
+    
+    FuncEntry* func = lookup_func(table, ctx->current_function);
+    ASTNode* args[100];
+    return func && flatten_list(value->data.func_call.args, args, 100) == func->param_count;
+}
+
+static int has_self_tail_call(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_RETURN:
+            return is_self_tail_call(node->data.return_stmt.value, ctx, table);
+        case AST_BLOCK:
+            return has_self_tail_call(node->data.block.statements, ctx, table);
+        case AST_STATEMENT_LIST:
+            return has_self_tail_call(node->data.list.head, ctx, table) ||
+                   has_self_tail_call(node->data.list.tail, ctx, table);
+        case AST_IF:
+            return has_self_tail_call(node->data.if_stmt.then_stmt, ctx, table) ||
+                   has_self_tail_call(node->data.if_stmt.else_stmt, ctx, table);
+        case AST_FOR:
+            return has_self_tail_call(node->data.for_stmt.body, ctx, table);
+        default:
+            return 0;
+    }
+}
+
+// Paints the current pixel `color`, or transparent when NULL, and ends
+// the stencil. With ctx->paint_returns the value is returned instead:
+// 0-255 for a value, 256 for transparent (see fill_rect).
+static void emit_paint(CodeGenContext* ctx, const char* color) {
+    FILE* out = ctx->output;
+    
+    if (ctx->paint_returns) {
+        if (color) {
+            char* masked = new_temp(ctx);
+            fprintf(out, "  %s = and i32 %s, 255\n", masked, color);
+            fprintf(out, "  ret i32 %s\n", masked);
+            free(masked);
+        } else {
+            fprintf(out, "  ret i32 256\n");
+        }
+    } else {
+        // Calculate absolute coordinates
+        char* abs_x = emit_value(ctx, "add i32 %%x_val, %%offset_x");
+        char* abs_y = emit_value(ctx, "add i32 %%y_val, %%offset_y");
+        
+        // Paint at absolute coordinates
+        if (color) {
+            fprintf(out, "  call void @paint_pixel(i8* %%canvas_ptr, i32 %s, i32 %s, i32 %s)\n", abs_x, abs_y, color);
+        } else {
+            fprintf(out, "  call void @clear_pixel(i8* %%canvas_ptr, i32 %s, i32 %s)\n", abs_x, abs_y);
+        }
+        fprintf(out, "  ret void\n");
+        free(abs_x);
+        free(abs_y);
+    }
+    
+    // Anything after the paint lands in an unreachable block
+    char* dead_label = new_label(ctx);
+    emit_label(ctx, dead_label);
+    free(dead_label);
+}
+
 void generate_statement(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
     if (!node) return;
     
+    if (node->type != AST_STATEMENT_LIST && node->type != AST_BLOCK) {
+        debug_location(ctx, node);
+    }
     FILE* out = ctx->output;
     
     switch (node->type) {
@@ -318,27 +1550,28 @@ void generate_statement(ASTNode* node, CodeGenContext* ctx, SymbolTable* table)
             break;
             
         case AST_VAR_DEC: {
-            char* var_name = (char*)malloc(strlen(node->data.var_dec.name) + 2);
-            sprintf(var_name, "%%%s", node->data.var_dec.name);
-            
-            fprintf(out, "  %s = alloca i32\n", var_name);
-            
-            if (node->data.var_dec.value) {
-                char* value = generate_expression(node->data.var_dec.value, ctx, table);
-                fprintf(out, "  store i32 %s, i32* %s\n", value, var_name);
-                free(value);
-            }
-            
-            add_var(table, node->data.var_dec.name, var_name);
-            free(var_name);
+            char* value = node->data.var_dec.value
+                ? generate_expression(node->data.var_dec.value, ctx, table)
+                : strdup("0");
+            add_value(table, node->data.var_dec.name, value);
+            debug_variable(ctx, table->vars, node->line, 0);
+            debug_value(ctx, table->vars);
+            free(value);
             break;
         }
         
         case AST_ASSIGNMENT: {
-            char* var_name = lookup_var(table, node->data.assignment.name);
-            if (var_name) {
+            VarEntry* var = lookup_var_entry(table, node->data.assignment.name);
+            if (var && var->readonly) {
+                fprintf(stderr, "Error: cannot assign to '%s'\n", node->data.assignment.name);
+            } else if (var) {
                 char* value = generate_expression(node->data.assignment.value, ctx, table);
-                fprintf(out, "  store i32 %s, i32* %s\n", value, var_name);
+                if (var->by_value) {
+                    set_value(var, value);
+                    debug_value(ctx, var);
+                } else {
+                    fprintf(out, "  store i32 %s, i32* %s\n", value, var->llvm_name);
+                }
                 free(value);
             }
             break;
@@ -350,88 +1583,490 @@ void generate_statement(ASTNode* node, CodeGenContext* ctx, SymbolTable* table)
         }
         
         case AST_IF: {
+            ASTNode* arms[2] = { node->data.if_stmt.then_stmt, node->data.if_stmt.else_stmt };
             char* cond = generate_expression(node->data.if_stmt.condition, ctx, table);
             char* cond_bool = new_temp(ctx);
-            char* then_label = new_label(ctx);
-            char* else_label = new_label(ctx);
-            char* end_label = new_label(ctx);
-            
             fprintf(out, "  %s = icmp ne i32 %s, 0\n", cond_bool, cond);
             
-            if (node->data.if_stmt.else_stmt) {
-                fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", cond_bool, then_label, else_label);
-            } else {
-                fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", cond_bool, then_label, end_label);
+            // Measured counts of the two arms, when there's a profile
+            uint64_t counts[2] = { 0, 0 };
+            int profiled = ctx->profile && node->counter >= 0;
+            if (profiled) {
+                counts[0] = ctx->profile[node->counter];
+                counts[1] = ctx->profile[node->counter + 1];
+            }
+            uint64_t total = counts[0] + counts[1];
+            uint64_t colder = counts[0] < counts[1] ? counts[0] : counts[1];
+            
+            // Straight-line code runs both arms but can't mispredict. It
+            // pays off for cheap arms, unless a profile shows the branch
+            // is predictable, and for any arms when it shows it isn't.
+            int unbiased = profiled && total > 0 && colder * 5 >= total;
+            int biased = profiled && total > 0 && !unbiased;
+            int cost = estimate_cost(arms[0], table) + estimate_cost(arms[1], table);
+            int branchless = !ctx->instrument && !biased && (unbiased || cost <= SELECT_COST);
+            
+            // if (...) paint a; else paint b; paints one selected value
+            ASTNode* paints[2] = { single_paint(arms[0]), single_paint(arms[1]) };
+            if (branchless && ctx->in_stencil && paints[0] && paints[1] &&
+                paints[0]->data.paint.value && paints[1]->data.paint.value &&
+                speculatable(paints[0]->data.paint.value, table) &&
+                speculatable(paints[1]->data.paint.value, table)) {
+                char* a = generate_expression(paints[0]->data.paint.value, ctx, table);
+                char* b = generate_expression(paints[1]->data.paint.value, ctx, table);
+                char* color = emit_value(ctx, "select i1 %s, i32 %s, i32 %s", cond_bool, a, b);
+                emit_paint(ctx, color);
+                free(a);
+                free(b);
+                free(color);
+                free(cond);
+                free(cond_bool);
+                break;
+            }
+            
+            // Each arm starts from the values before the if; variables
+            // declared inside an arm go out of scope at its end, and so
+            // do values numbered in a branch arm
+            VarEntry* scope = table->vars;
+            ValueEntry* values = ctx->value_stack;
+            Snapshot before, after[2];
+            take_snapshot(table, &before);
+            
+            if (branchless && speculatable(arms[0], table) && speculatable(arms[1], table)) {
+                // Run both arms and select the results
+                for (int arm = 0; arm < 2; arm++) {
+                    restore_snapshot(&before);
+                    generate_statement(arms[arm], ctx, table);
+                    take_snapshot(table, &after[arm]);
+                }
+                
+                for (int i = 0; i < after[0].count; i++) {
+                    if (strcmp(after[0].values[i], after[1].values[i]) == 0) continue;
+                    
+                    char* select = new_temp(ctx);
+                    fprintf(out, "  %s = select i1 %s, i32 %s, i32 %s\n", select, cond_bool,
+                            after[0].values[i], after[1].values[i]);
+                    set_value(after[0].vars[i], select);
+                    debug_value(ctx, after[0].vars[i]);
+                    free(select);
+                }
+                
+                free_snapshot(&before);
+                free_snapshot(&after[0]);
+                free_snapshot(&after[1]);
+                free(cond);
+                free(cond_bool);
+                break;
             }
             
-            fprintf(out, "%s:\n", then_label);
-            generate_statement(node->data.if_stmt.then_stmt, ctx, table);
-            fprintf(out, "  br label %%%s\n", end_label);
+            // Instrumented code needs an else block to count in even when
+            // the if has no else
+            int has_else = arms[1] || ctx->instrument;
+            char* cond_block = strdup(ctx->current_block);
+            char* labels[2];
+            labels[0] = new_label(ctx);
+            labels[1] = new_label(ctx);
+            char* end_label = new_label(ctx);
+            if (!has_else) {
+                free(labels[1]);
+                labels[1] = strdup(end_label);
+            }
             
-            if (node->data.if_stmt.else_stmt) {
-                fprintf(out, "%s:\n", else_label);
-                generate_statement(node->data.if_stmt.else_stmt, ctx, table);
+            if (profiled && total > 0) {
+                fprintf(out, "  br i1 %s, label %%%s, label %%%s, !prof !%d\n", cond_bool,
+                        labels[0], labels[1], branch_weights(ctx, counts[0], counts[1]));
+            } else {
+                fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", cond_bool, labels[0], labels[1]);
+            }
+            
+            // The hotter arm is laid out first
+            char* blocks[2];
+            int first = has_else && counts[1] > counts[0] ? 1 : 0;
+            for (int k = 0; k < 2; k++) {
+                int arm = first ^ k;
+                restore_snapshot(&before);
+                if (arm == 1 && !has_else) {
+                    take_snapshot(table, &after[arm]);
+                    blocks[arm] = strdup(cond_block);
+                    continue;
+                }
+                
+                emit_label(ctx, labels[arm]);
+                if (ctx->instrument) {
+                    emit_counter(ctx, out, node->counter + arm);
+                }
+                generate_statement(arms[arm], ctx, table);
+                pop_vars(table, scope);
+                pop_values(ctx, values);
+                take_snapshot(table, &after[arm]);
+                blocks[arm] = strdup(ctx->current_block);
                 fprintf(out, "  br label %%%s\n", end_label);
             }
             
-            fprintf(out, "%s:\n", end_label);
+            emit_label(ctx, end_label);
             
+            // Variables that differ between the arms get a phi
+            for (int i = 0; i < after[0].count; i++) {
+                if (strcmp(after[0].values[i], after[1].values[i]) == 0) continue;
+                
+                char* phi = new_temp(ctx);
+                fprintf(out, "  %s = phi i32 [%s, %%%s], [%s, %%%s]\n", phi,
+                        after[0].values[i], blocks[0], after[1].values[i], blocks[1]);
+                set_value(after[0].vars[i], phi);
+                free(phi);
+            }
+            for (int i = 0; i < after[0].count; i++) {
+                if (strcmp(after[0].values[i], after[1].values[i]) == 0) continue;
+                debug_value(ctx, after[0].vars[i]);
+            }
+            
+            free_snapshot(&before);
+            for (int arm = 0; arm < 2; arm++) {
+                free_snapshot(&after[arm]);
+                free(blocks[arm]);
+                free(labels[arm]);
+            }
+            free(cond_block);
             free(cond);
             free(cond_bool);
-            free(then_label);
-            free(else_label);
             free(end_label);
             break;
         }
         
         case AST_RETURN: {
-            char* value = generate_expression(node->data.return_stmt.value, ctx, table);
-            fprintf(out, "  ret i32 %s\n", value);
-            free(value);
+            ASTNode* value_node = node->data.return_stmt.value;
+            
+            if (ctx->tail_header && is_self_tail_call(value_node, ctx, table)) {
+                // Self tail call: jump back to the header, the arguments
+                // become the next values of the parameter phis
+                ASTNode* arg_nodes[100];
+                int arg_count = flatten_list(value_node->data.func_call.args, arg_nodes, 100);
+                
+                TailCall* tail_call = (TailCall*)malloc(sizeof(TailCall));
+                tail_call->args = (char**)malloc(sizeof(char*) * (arg_count + 1));
+                for (int i = 0; i < arg_count; i++) {
+                    tail_call->args[i] = generate_expression(arg_nodes[i], ctx, table);
+                }
+                tail_call->block = strdup(ctx->current_block);
+                tail_call->next = ctx->tail_calls;
+                ctx->tail_calls = tail_call;
+                
+                fprintf(out, "  br label %%%s\n", ctx->tail_header);
+            } else {
+                char* value;
+                if (value_node && value_node->type == AST_FUNC_CALL && ctx->current_function) {
+                    // Tail call to another function. musttail needs identical
+                    // prototypes, which here means the same arity.
+                    FuncEntry* caller = lookup_func(table, ctx->current_function);
+                    FuncEntry* callee = lookup_func(table, value_node->data.func_call.name);
+                    int must = caller && callee && caller->param_count == callee->param_count;
+                    value = generate_call(value_node, ctx, table, must ? "musttail call" : "tail call");
+                } else {
+                    value = generate_expression(value_node, ctx, table);
+                }
+                fprintf(out, "  ret i32 %s\n", value);
+                free(value);
+            }
+            
+            // Anything after the return lands in an unreachable block
+            char* dead_label = new_label(ctx);
+            emit_label(ctx, dead_label);
+            free(dead_label);
+            break;
+        }
+        
+        case AST_FOR: {
+            // for (i in start..end): the bounds are evaluated once, and i is
+            // a read-only phi, so the trip count is known on loop entry.
+            char* start = generate_expression(node->data.for_stmt.start, ctx, table);
+            char* end = generate_expression(node->data.for_stmt.end, ctx, table);
+            char* counter = new_temp(ctx);
+            char* cond = new_temp(ctx);
+            char* next = new_temp(ctx);
+            char* head_label = new_label(ctx);
+            char* body_label = new_label(ctx);
+            char* latch_label = new_label(ctx);
+            char* exit_label = new_label(ctx);
+            char* preheader = strdup(ctx->current_block);
+            
+            // Variables assigned in the body are carried around the loop by
+            // a phi each. Their names are needed before the body is
+            // generated, their latch values only after.
+            Snapshot entry;
+            take_snapshot(table, &entry);
+            char** carried = (char**)calloc(entry.count + 1, sizeof(char*));
+            for (int i = 0; i < entry.count; i++) {
+                if (!assigns_name(node->data.for_stmt.body, entry.vars[i]->name)) continue;
+                carried[i] = new_temp(ctx);
+                set_value(entry.vars[i], carried[i]);
+            }
+            
+            fprintf(out, "  br label %%%s\n", head_label);
+            emit_label(ctx, head_label);
+            
+            // The rest of the loop is buffered until the phis can be written
+            char* loop_buffer = NULL;
+            size_t loop_size = 0;
+            ctx->output = open_memstream(&loop_buffer, &loop_size);
+            
+            fprintf(ctx->output, "  %s = icmp slt i32 %s, %s\n", cond, counter, end);
+            
+            // Constant bounds: record the trip count as branch weights
+            ASTNode* start_node = node->data.for_stmt.start;
+            ASTNode* end_node = node->data.for_stmt.end;
+            if (start_node->type == AST_NUMBER && end_node->type == AST_NUMBER &&
+                end_node->data.number.value > start_node->data.number.value) {
+                int weights = new_metadata(ctx);
+                fprintf(ctx->metadata, "!%d = !{!\"branch_weights\", i32 %d, i32 1}\n", weights,
+                        end_node->data.number.value - start_node->data.number.value);
+                fprintf(ctx->output, "  br i1 %s, label %%%s, label %%%s, !prof !%d\n",
+                        cond, body_label, exit_label, weights);
+            } else {
+                fprintf(ctx->output, "  br i1 %s, label %%%s, label %%%s\n", cond, body_label, exit_label);
+            }
+            
+            // Values numbered in the body don't dominate the exit
+            emit_label(ctx, body_label);
+            VarEntry* saved = table->vars;
+            ValueEntry* values = ctx->value_stack;
+            add_readonly_value(table, node->data.for_stmt.name, counter);
+            debug_variable(ctx, table->vars, node->line, 0);
+            debug_value(ctx, table->vars);
+            generate_statement(node->data.for_stmt.body, ctx, table);
+            pop_vars(table, saved);
+            pop_values(ctx, values);
+            fprintf(ctx->output, "  br label %%%s\n", latch_label);
+            
+            Snapshot latch;
+            take_snapshot(table, &latch);
+            
+            emit_label(ctx, latch_label);
+            int loop_id = new_metadata(ctx);
+            int progress = new_metadata(ctx);
+            fprintf(ctx->metadata, "!%d = distinct !{!%d, !%d}\n", loop_id, loop_id, progress);
+            fprintf(ctx->metadata, "!%d = !{!\"llvm.loop.mustprogress\"}\n", progress);
+            fprintf(ctx->output, "  %s = add nsw i32 %s, 1\n", next, counter);
+            fprintf(ctx->output, "  br label %%%s, !llvm.loop !%d\n", head_label, loop_id);
+            
+            fclose(ctx->output);
+            ctx->output = out;
+            
+            fprintf(out, "  %s = phi i32 [%s, %%%s], [%s, %%%s]\n",
+                    counter, start, preheader, next, latch_label);
+            for (int i = 0; i < entry.count; i++) {
+                if (!carried[i]) continue;
+                fprintf(out, "  %s = phi i32 [%s, %%%s], [%s, %%%s]\n",
+                        carried[i], entry.values[i], preheader, latch.values[i], latch_label);
+                // After the loop the variable holds its value at the header
+                set_value(entry.vars[i], carried[i]);
+            }
+            for (int i = 0; i < entry.count; i++) {
+                if (!carried[i]) continue;
+                debug_value(ctx, entry.vars[i]);
+                free(carried[i]);
+            }
+            fwrite(loop_buffer, 1, loop_size, out);
+            free(loop_buffer);
+            
+            emit_label(ctx, exit_label);
+            
+            free_snapshot(&entry);
+            free_snapshot(&latch);
+            free(carried);
+            free(start); free(end);
+            free(counter); free(cond); free(next);
+            free(head_label); free(body_label); free(latch_label); free(exit_label);
+            free(preheader);
             break;
         }
         
         case AST_PAINT: {
             if (ctx->in_stencil) {
                 char* color = generate_expression(node->data.paint.value, ctx, table);
-                char* rel_x = new_temp(ctx);
-                char* rel_y = new_temp(ctx);
-                char* offset_x = new_temp(ctx);
-                char* offset_y = new_temp(ctx);
-                char* abs_x = new_temp(ctx);
-                char* abs_y = new_temp(ctx);
-                
-                // Load relative coordinates and offsets
-                fprintf(out, "  %s = load i32, i32* %%x\n", rel_x);
-                fprintf(out, "  %s = load i32, i32* %%y\n", rel_y);
-                fprintf(out, "  %s = load i32, i32* %%ox\n", offset_x);
-                fprintf(out, "  %s = load i32, i32* %%oy\n", offset_y);
-                
-                // Calculate absolute coordinates
-                fprintf(out, "  %s = add i32 %s, %s\n", abs_x, rel_x, offset_x);
-                fprintf(out, "  %s = add i32 %s, %s\n", abs_y, rel_y, offset_y);
-                
-                // Paint at absolute coordinates
-                fprintf(out, "  call void @paint_pixel(i32 %s, i32 %s, i32 %s)\n", abs_x, abs_y, color);
-                fprintf(out, "  ret void\n");
-                
+                emit_paint(ctx, color);
                 free(color);
-                free(rel_x); free(rel_y);
-                free(offset_x); free(offset_y);
-                free(abs_x); free(abs_y);
             }
             break;
         }
-        
-        case AST_FUNC_CALL: {
-            char* result = generate_expression(node, ctx, table);
-            free(result);
-            break;
+        
+        case AST_FUNC_CALL: {
+            char* result = generate_expression(node, ctx, table);
+            free(result);
+            break;
+        }
+        
+        default:
+            break;
+    }
+}
+
+// Generates @stencil_NAME, which paints one pixel, or with `value_only`
+// @stencil_NAME_value, which returns what it would paint: 0-255, 256 for
+// transparent or -1 for nothing.
+static void generate_stencil_function(ASTNode* node, CodeGenContext* ctx, SymbolTable* table, int value_only) {
+    FILE* out = ctx->output;
+    
+    // Generate stencil function with canvas and offset parameters
+    char prof[32];
+    char linkage_name[256];
+    function_entry_count(ctx, node, prof, sizeof(prof));
+    snprintf(linkage_name, sizeof(linkage_name), "stencil_%s%s", node->data.stencil.name, value_only ? "_value" : "");
+    debug_function(ctx, node->data.stencil.name, linkage_name, node->line);
+    fprintf(out, "define %s @stencil_%s%s(i8* %%canvas_ptr, i32 %%x_val, i32 %%y_val, i32 %%offset_x, i32 %%offset_y)%s {\n",
+            value_only ? "i32" : "void", node->data.stencil.name, value_only ? "_value" : "", prof);
+    fprintf(out, "entry:\n");
+    
+    SymbolTable* stencil_table = create_symbol_table();
+    stencil_table->vars = table->vars; // Inherit global vars
+    stencil_table->funcs = table->funcs;
+    add_readonly_value(stencil_table, "x", "%x_val");
+    add_readonly_value(stencil_table, "y", "%y_val");
+    
+    ctx->in_stencil = 1;
+    ctx->paint_returns = value_only;
+    begin_function_body(ctx);
+    if (ctx->instrument) {
+        emit_counter(ctx, ctx->prologue, node->counter);
+    }
+    // x and y are the second and third parameters
+    for (VarEntry* var = stencil_table->vars; var != table->vars; var = var->next) {
+        debug_variable(ctx, var, node->line, strcmp(var->name, "x") == 0 ? 2 : 3);
+        debug_value(ctx, var);
+    }
+    generate_statement(node->data.stencil.body, ctx, stencil_table);
+    fprintf(ctx->output, value_only ? "  ret i32 -1\n" : "  ret void\n");
+    end_function_body(ctx);
+    ctx->paint_returns = 0;
+    ctx->in_stencil = 0;
+    
+    fprintf(out, "}\n\n");
+    ctx->debug_scope = -1;
+    
+    // Don't free the global vars and funcs stencil_table inherited
+    pop_vars(stencil_table, table->vars);
+    stencil_table->vars = NULL;
+    stencil_table->funcs = NULL;
+    free_symbol_table(stencil_table);
+}
+
+// Stencils whose pixels only depend on x, y and the globals they read can
+// be cached: returns how many mutable globals `node` (a stencil) reads,
+// filling in `globals` and the hash of its code, or -1 when it can't be.
+// Stencils that peek (even at their own pixel, which a scratch tile
+// doesn't have) or write globals must run every time.
+int cache_key_globals(ASTNode* node, SymbolTable* table, StencilEntry* stencil,
+                      VarEntry** globals, uint64_t* code) {
+    if (stencil->effects & (READS_CANVAS | WRITES_GLOBALS)) return -1;
+    
+    int global_count = 0;
+    if (!collect_global_reads(node->data.stencil.body, table, globals, &global_count, MAX_KEY_GLOBALS)) {
+        return -1;
+    }
+    
+    *code = hash_code(node->data.stencil.body, table, CODE_HASH_SEED);
+    return global_count;
+}
+
+// @stencil_<name>_key hashes the stencil's code with the current values of
+// the globals it reads. The runtime adds the apply's size and position and
+// looks the pixels up in its tile cache (see tilecache.h).
+static void generate_cache_key(ASTNode* node, CodeGenContext* ctx, SymbolTable* table,
+                               StencilEntry* stencil) {
+    VarEntry* globals[MAX_KEY_GLOBALS];
+    uint64_t code;
+    int global_count = cache_key_globals(node, table, stencil, globals, &code);
+    if (global_count < 0) return;
+    
+    FILE* out = ctx->output;
+    fprintf(out, "define i64 @stencil_%s_key() {\n", stencil->name);
+    fprintf(out, "entry:\n");
+    char hash[32];
+    snprintf(hash, sizeof(hash), "%lld", (long long)code);
+    for (int i = 0; i < global_count; i++) {
+        char* value = new_temp(ctx);
+        char* wide = new_temp(ctx);
+        char* mixed = new_temp(ctx);
+        char* next = new_temp(ctx);
+        fprintf(out, "  %s = load i32, i32* %s\n", value, globals[i]->llvm_name);
+        fprintf(out, "  %s = zext i32 %s to i64\n", wide, value);
+        fprintf(out, "  %s = xor i64 %s, %s\n", mixed, hash, wide);
+        fprintf(out, "  %s = mul i64 %s, %llu\n", next, mixed, CODE_HASH_PRIME);
+        snprintf(hash, sizeof(hash), "%s", next);
+        free(value); free(wide); free(mixed); free(next);
+    }
+    fprintf(out, "  ret i64 %s\n", hash);
+    fprintf(out, "}\n\n");
+    
+    stencil->cacheable = 1;
+}
+
+// Whether every run of `node` paints: 1 when it paints on every path, 0
+// when it can fall through without painting, -1 when it can return
+// without painting (which also skips whatever follows it)
+static int paint_coverage(ASTNode* node) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_PAINT:
+            return 1;
+        case AST_RETURN:
+            return -1;
+        case AST_BLOCK:
+            return paint_coverage(node->data.block.statements);
+        case AST_STATEMENT_LIST: {
+            int head = paint_coverage(node->data.list.head);
+            return head != 0 ? head : paint_coverage(node->data.list.tail);
+        }
+        case AST_IF: {
+            int then_arm = paint_coverage(node->data.if_stmt.then_stmt);
+            int else_arm = paint_coverage(node->data.if_stmt.else_stmt);
+            if (then_arm < 0 || else_arm < 0) return -1;
+            return then_arm && else_arm;
         }
-        
+        case AST_FOR:
+            // The range may be empty
+            return paint_coverage(node->data.for_stmt.body) < 0 ? -1 : 0;
         default:
-            break;
+            return 0;
+    }
+}
+
+static int paints_transparent(ASTNode* node) {
+    if (!node) return 0;
+    
+    switch (node->type) {
+        case AST_PAINT:
+            return node->data.paint.value == NULL;
+        case AST_BLOCK:
+            return paints_transparent(node->data.block.statements);
+        case AST_STATEMENT_LIST:
+            return paints_transparent(node->data.list.head) || paints_transparent(node->data.list.tail);
+        case AST_IF:
+            return paints_transparent(node->data.if_stmt.then_stmt) ||
+                   paints_transparent(node->data.if_stmt.else_stmt);
+        case AST_FOR:
+            return paints_transparent(node->data.for_stmt.body);
+        default:
+            return 0;
+    }
+}
+
+// Adds a stencil declaration to the table along with what the backends
+// need to know about it: the globals it touches, how far it peeks,
+// whether it is piecewise constant and whether it paints every pixel
+StencilEntry* declare_stencil(ASTNode* node, SymbolTable* table) {
+    add_stencil(table, node->data.stencil.name);
+    StencilEntry* stencil = table->stencils;
+    stencil->line = node->line;
+    stencil->effects = global_effects(node->data.stencil.body, table);
+    stencil->radius = peek_radius(node->data.stencil.body, table);
+    stencil->piecewise = !(stencil->effects & WRITES_GLOBALS) &&
+                         find_breaks(node->data.stencil.body, table, stencil);
+    if (paint_coverage(node->data.stencil.body) > 0) {
+        stencil->covers = paints_transparent(node->data.stencil.body) ? COVERS_PIXELS
+                                                                      : COVERS_PIXELS | COVERS_OPAQUE;
     }
+    return stencil;
 }
 
 void generate_global_decls(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
@@ -450,14 +2085,27 @@ void generate_global_decls(ASTNode* node, CodeGenContext* ctx, SymbolTable* tabl
             break;
             
         case AST_VAR_DEC: {
-            // Global variables
-            fprintf(out, "@%s = global i32 ", node->data.var_dec.name);
-            if (node->data.var_dec.value && node->data.var_dec.value->type == AST_NUMBER) {
-                fprintf(out, "%d\n", node->data.var_dec.value->data.number.value);
-            } else {
-                fprintf(out, "0\n");
+            // Global variables. Initializers are folded when constant; a
+            // global that is never assigned is just that constant. The
+            // others get their initial value from stencil_reset_globals.
+            int value = 0;
+            int folded = !node->data.var_dec.value || fold_constant(node->data.var_dec.value, table, &value);
+            char attachment[32];
+            debug_global(ctx, node, attachment, sizeof(attachment));
+            
+            // In batch mode any global may be overridden per instance (see
+            // generate_batch_globals), so none is folded, and every
+            // rendering thread has its own copy
+            if (!ctx->batch && folded && !assigns_name(ctx->program, node->data.var_dec.name)) {
+                char constant[16];
+                snprintf(constant, sizeof(constant), "%d", value);
+                fprintf(out, "@%s = constant i32 %d%s\n", node->data.var_dec.name, value, attachment);
+                add_readonly_value(table, node->data.var_dec.name, constant);
+                break;
             }
             
+            fprintf(out, "@%s = %sglobal i32 %d%s\n", node->data.var_dec.name,
+                    ctx->batch ? "thread_local " : "", value, attachment);
             char* global_name = (char*)malloc(strlen(node->data.var_dec.name) + 2);
             sprintf(global_name, "@%s", node->data.var_dec.name);
             add_var(table, node->data.var_dec.name, global_name);
@@ -466,101 +2114,117 @@ void generate_global_decls(ASTNode* node, CodeGenContext* ctx, SymbolTable* tabl
         }
         
         case AST_FUNC_DEC: {
-            // Count parameters
-            int param_count = 0;
-            ASTNode* params = node->data.func_dec.params;
-            while (params) {
-                if (params->type == AST_PARAMETER_LIST) {
-                    param_count++;
-                    params = params->data.list.tail;
-                } else {
-                    param_count++;
-                    break;
-                }
-            }
+            ASTNode* params[100];
+            int param_count = flatten_list(node->data.func_dec.params, params, 100);
             
             add_func(table, node->data.func_dec.name, param_count);
-            
-            // Generate function
-            fprintf(out, "define i32 @%s(", node->data.func_dec.name);
+            table->funcs->body = node->data.func_dec.body;
             
             SymbolTable* local_table = create_symbol_table();
             local_table->vars = table->vars; // Inherit global vars
+            local_table->funcs = table->funcs;
             
-            // Generate parameters
-            params = node->data.func_dec.params;
-            int param_idx = 0;
-            while (params) {
-                if (param_idx > 0) fprintf(out, ", ");
-                
-                ASTNode* param = params;
-                if (params->type == AST_PARAMETER_LIST) {
-                    param = params->data.list.head;
-                    params = params->data.list.tail;
-                } else {
-                    params = NULL;
-                }
+            ctx->current_function = strdup(node->data.func_dec.name);
+            int tail_recursive = has_self_tail_call(node->data.func_dec.body, ctx, local_table);
+            
+            // Generate function. With self tail calls the parameters come in
+            // as %name.arg and %name is a phi in the loop header.
+            debug_function(ctx, node->data.func_dec.name, NULL, node->line);
+            fprintf(out, "define i32 @%s(", node->data.func_dec.name);
+            for (int i = 0; i < param_count; i++) {
+                if (i > 0) fprintf(out, ", ");
+                if (params[i]->type != AST_VAR_DEC) continue;
                 
-                if (param && param->type == AST_VAR_DEC) {
-                    fprintf(out, "i32 %%%s", param->data.var_dec.name);
-                    
-                    char* param_name = (char*)malloc(strlen(param->data.var_dec.name) + 2);
-                    sprintf(param_name, "%%%s", param->data.var_dec.name);
-                    add_var(local_table, param->data.var_dec.name, param_name);
-                    free(param_name);
-                }
+                fprintf(out, "i32 %%%s%s", params[i]->data.var_dec.name, tail_recursive ? ".arg" : "");
                 
-                param_idx++;
+                char* param_name = (char*)malloc(strlen(params[i]->data.var_dec.name) + 2);
+                sprintf(param_name, "%%%s", params[i]->data.var_dec.name);
+                add_value(local_table, params[i]->data.var_dec.name, param_name);
+                free(param_name);
             }
             
-            fprintf(out, ") {\n");
+            char prof[32];
+            function_entry_count(ctx, node, prof, sizeof(prof));
+            fprintf(out, ")%s {\n", prof);
             fprintf(out, "entry:\n");
             
-            // Generate function body
-            ctx->current_function = strdup(node->data.func_dec.name);
+            // Generate function body. The entry counter goes in the
+            // prologue, ahead of the tail recursion header.
+            begin_function_body(ctx);
+            if (ctx->instrument) {
+                emit_counter(ctx, ctx->prologue, node->counter);
+            }
+            for (int i = 0; i < param_count; i++) {
+                if (params[i]->type != AST_VAR_DEC) continue;
+                VarEntry* param = lookup_var_entry(local_table, params[i]->data.var_dec.name);
+                debug_variable(ctx, param, params[i]->line, i + 1);
+                debug_value(ctx, param);
+            }
+            if (tail_recursive) {
+                ctx->tail_header = new_label(ctx);
+                free(ctx->current_block);
+                ctx->current_block = strdup(ctx->tail_header);
+            }
             generate_statement(node->data.func_dec.body, ctx, local_table);
             
             // Add default return if needed
-            fprintf(out, "  ret i32 0\n");
+            fprintf(ctx->output, "  ret i32 0\n");
+            
+            if (tail_recursive) {
+                // The header goes between the entry block and the body
+                FILE* header = ctx->prologue;
+                fprintf(header, "  br label %%%s\n", ctx->tail_header);
+                fprintf(header, "%s:\n", ctx->tail_header);
+                for (int i = 0; i < param_count; i++) {
+                    if (params[i]->type != AST_VAR_DEC) continue;
+                    const char* name = params[i]->data.var_dec.name;
+                    fprintf(header, "  %%%s = phi i32 [%%%s.arg, %%entry]", name, name);
+                    for (TailCall* call = ctx->tail_calls; call; call = call->next) {
+                        fprintf(header, ", [%s, %%%s]", call->args[i], call->block);
+                    }
+                    fprintf(header, "\n");
+                }
+                
+                while (ctx->tail_calls) {
+                    TailCall* next = ctx->tail_calls->next;
+                    for (int i = 0; i < param_count; i++) {
+                        free(ctx->tail_calls->args[i]);
+                    }
+                    free(ctx->tail_calls->args);
+                    free(ctx->tail_calls->block);
+                    free(ctx->tail_calls);
+                    ctx->tail_calls = next;
+                }
+                free(ctx->tail_header);
+                ctx->tail_header = NULL;
+            }
+            
+            end_function_body(ctx);
             fprintf(out, "}\n\n");
+            ctx->debug_scope = -1;
             
             free(ctx->current_function);
             ctx->current_function = NULL;
             
-            // Don't free local_table->vars since it points to global vars
+            // Don't free the global vars and funcs local_table inherited
+            pop_vars(local_table, table->vars);
             local_table->vars = NULL;
+            local_table->funcs = NULL;
             free_symbol_table(local_table);
             break;
         }
         
         case AST_STENCIL: {
-            add_stencil(table, node->data.stencil.name);
+            StencilEntry* stencil = declare_stencil(node, table);
+            generate_stencil_function(node, ctx, table, 0);
             
-            // Generate stencil function with offset parameters
-            fprintf(out, "define void @stencil_%s(i32 %%x_val, i32 %%y_val, i32 %%offset_x, i32 %%offset_y) {\n", node->data.stencil.name);
-            fprintf(out, "entry:\n");
-            fprintf(out, "  %%x = alloca i32\n");
-            fprintf(out, "  %%y = alloca i32\n");
-            fprintf(out, "  %%ox = alloca i32\n");
-            fprintf(out, "  %%oy = alloca i32\n");
-            fprintf(out, "  store i32 %%x_val, i32* %%x\n");
-            fprintf(out, "  store i32 %%y_val, i32* %%y\n");
-            fprintf(out, "  store i32 %%offset_x, i32* %%ox\n");
-            fprintf(out, "  store i32 %%offset_y, i32* %%oy\n");
-            
-            SymbolTable* stencil_table = create_symbol_table();
-            stencil_table->vars = table->vars; // Inherit global vars
-            
-            ctx->in_stencil = 1;
-            generate_statement(node->data.stencil.body, ctx, stencil_table);
-            ctx->in_stencil = 0;
-            
-            fprintf(out, "  ret void\n");
-            fprintf(out, "}\n\n");
+            // Piecewise constant stencils also get a function returning the
+            // value they would paint, evaluated once per rectangle
+            if (stencil->piecewise) {
+                generate_stencil_function(node, ctx, table, 1);
+            }
             
-            // Don't free stencil_table->vars since it points to global vars
-            stencil_table->vars = NULL;
-            free_symbol_table(stencil_table);
+            generate_cache_key(node, ctx, table, stencil);
             break;
         }
         
@@ -569,6 +2233,126 @@ void generate_global_decls(ASTNode* node, CodeGenContext* ctx, SymbolTable* tabl
     }
 }
 
+#define MAX_BATCH_GLOBALS 256
+
+// Top-level variable declarations, in program order
+static int collect_globals(ASTNode* node, ASTNode** globals, int count) {
+    if (!node) return count;
+    if (node->type == AST_STATEMENT_LIST) {
+        count = collect_globals(node->data.list.head, globals, count);
+        return collect_globals(node->data.list.tail, globals, count);
+    }
+    if (node->type == AST_VAR_DEC && count < MAX_BATCH_GLOBALS) {
+        globals[count++] = node;
+    }
+    return count;
+}
+
+// Batch mode (see batch.c): the names of the globals, and
+// @stencil_init_globals, which sets the calling thread's globals for a
+// new instance. Overridden globals (overridden[i] != 0) take values[i],
+// the others their initializer, in program order so that initializers
+// see earlier overrides.
+static void generate_batch_globals(CodeGenContext* ctx, SymbolTable* table) {
+    FILE* out = ctx->output;
+    ASTNode* globals[MAX_BATCH_GLOBALS];
+    int count = collect_globals(ctx->program, globals, 0);
+    
+    for (int i = 0; i < count; i++) {
+        const char* name = globals[i]->data.var_dec.name;
+        fprintf(out, "@global_name_%d = private constant [%d x i8] c\"%s\\00\"\n",
+                i, (int)strlen(name) + 1, name);
+    }
+    fprintf(out, "@stencil_global_names = constant [%d x i8*] [", count);
+    for (int i = 0; i < count; i++) {
+        int length = (int)strlen(globals[i]->data.var_dec.name) + 1;
+        fprintf(out, "%si8* getelementptr inbounds ([%d x i8], [%d x i8]* @global_name_%d, i32 0, i32 0)",
+                i > 0 ? ", " : "", length, length, i);
+    }
+    fprintf(out, "]\n");
+    fprintf(out, "@stencil_global_count = constant i32 %d\n\n", count);
+    
+    fprintf(out, "define void @stencil_init_globals(i32* %%values, i8* %%overridden) {\n");
+    fprintf(out, "entry:\n");
+    free(ctx->current_block);
+    ctx->current_block = strdup("entry");
+    for (int i = 0; i < count; i++) {
+        const char* name = globals[i]->data.var_dec.name;
+        char* flag_ptr = new_temp(ctx);
+        char* flag = new_temp(ctx);
+        char* is_set = new_temp(ctx);
+        char* value_ptr = new_temp(ctx);
+        char* value = new_temp(ctx);
+        char* set_label = new_label(ctx);
+        char* init_label = new_label(ctx);
+        char* next_label = new_label(ctx);
+        
+        fprintf(out, "  %s = getelementptr i8, i8* %%overridden, i32 %d\n", flag_ptr, i);
+        fprintf(out, "  %s = load i8, i8* %s\n", flag, flag_ptr);
+        fprintf(out, "  %s = icmp ne i8 %s, 0\n", is_set, flag);
+        fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", is_set, set_label, init_label);
+        
+        emit_label(ctx, set_label);
+        fprintf(out, "  %s = getelementptr i32, i32* %%values, i32 %d\n", value_ptr, i);
+        fprintf(out, "  %s = load i32, i32* %s\n", value, value_ptr);
+        fprintf(out, "  store i32 %s, i32* @%s\n", value, name);
+        fprintf(out, "  br label %%%s\n", next_label);
+        
+        // Initializers may call functions, so they only run when needed
+        emit_label(ctx, init_label);
+        char* initial = globals[i]->data.var_dec.value
+            ? generate_expression(globals[i]->data.var_dec.value, ctx, table)
+            : strdup("0");
+        fprintf(out, "  store i32 %s, i32* @%s\n", initial, name);
+        fprintf(out, "  br label %%%s\n", next_label);
+        pop_values(ctx, NULL);
+        
+        emit_label(ctx, next_label);
+        free(flag_ptr); free(flag); free(is_set);
+        free(value_ptr); free(value); free(initial);
+        free(set_label); free(init_label); free(next_label);
+    }
+    fprintf(out, "  ret void\n");
+    fprintf(out, "}\n\n");
+}
+
+// Stores the initial value of every top-level global that isn't a
+// constant, in program order
+static void generate_global_resets(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
+    if (!node) return;
+    if (node->type == AST_STATEMENT_LIST) {
+        generate_global_resets(node->data.list.head, ctx, table);
+        generate_global_resets(node->data.list.tail, ctx, table);
+        return;
+    }
+    if (node->type != AST_VAR_DEC) return;
+    
+    VarEntry* var = lookup_var_entry(table, node->data.var_dec.name);
+    if (!var || var->readonly) return;
+    
+    char* initial = node->data.var_dec.value
+        ? generate_expression(node->data.var_dec.value, ctx, table)
+        : strdup("0");
+    fprintf(ctx->output, "  store i32 %s, i32* %s\n", initial, var->llvm_name);
+    pop_values(ctx, NULL);
+    free(initial);
+}
+
+// @stencil_reset_globals, which puts the globals back to their initial
+// values. llvm_main calls it before every render, so a program renders
+// the same however many times it is run in one process (the daemon and
+// libstencil keep modules loaded between renders).
+static void generate_reset_globals(CodeGenContext* ctx, SymbolTable* table) {
+    FILE* out = ctx->output;
+    fprintf(out, "define void @stencil_reset_globals() {\n");
+    fprintf(out, "entry:\n");
+    free(ctx->current_block);
+    ctx->current_block = strdup("entry");
+    generate_global_resets(ctx->program, ctx, table);
+    fprintf(out, "  ret void\n");
+    fprintf(out, "}\n\n");
+}
+
 void emit_main_function(CodeGenContext* ctx, SymbolTable* table) {
     FILE* out = ctx->output;
     
@@ -581,6 +2365,225 @@ void emit_main_function(CodeGenContext* ctx, SymbolTable* table) {
     fprintf(out, "}\n");
 }
 
+// Sorted ranges [bounds[i], bounds[i + 1]) of 0..size that a piecewise
+// constant stencil is constant on
+int break_ranges(const int* breaks, int break_count, int size, int* bounds) {
+    int count = 0;
+    bounds[count++] = 0;
+    for (int i = 0; i < break_count; i++) {
+        if (breaks[i] > 0 && breaks[i] < size) {
+            bounds[count++] = breaks[i];
+        }
+    }
+    bounds[count++] = size;
+    
+    for (int i = 1; i < count; i++) {
+        for (int j = i; j > 0 && bounds[j - 1] > bounds[j]; j--) {
+            int swap = bounds[j];
+            bounds[j] = bounds[j - 1];
+            bounds[j - 1] = swap;
+        }
+    }
+    return count - 1;
+}
+
+// Apply of a piecewise constant stencil: instead of calling the stencil
+// for every pixel, each constant rectangle (clipped to the sub-rectangle
+// the runtime asks for) is evaluated once and filled with fill_rect.
+// That paints every pixel, which any step allows.
+static void generate_fill_apply(CodeGenContext* ctx, StencilEntry* stencil, ApplyEntry* apply) {
+    FILE* out = ctx->output;
+    int xs[MAX_BREAKS + 2], ys[MAX_BREAKS + 2];
+    int x_ranges = break_ranges(stencil->x_breaks, stencil->x_break_count, apply->size, xs);
+    int y_ranges = break_ranges(stencil->y_breaks, stencil->y_break_count, apply->size, ys);
+    
+    fprintf(out, "; Apply stencil %s, %d constant rectangles\n", stencil->name, x_ranges * y_ranges);
+    fprintf(out, "define void @apply_%d(i8* %%canvas_ptr, i32 %%x0, i32 %%y0, i32 %%x1, i32 %%y1, i32 %%step) {\n",
+            apply->index);
+    fprintf(out, "entry:\n");
+    
+    for (int j = 0; j < y_ranges; j++) {
+        for (int i = 0; i < x_ranges; i++) {
+            int range_x0 = xs[i], range_x1 = xs[i + 1];
+            int range_y0 = ys[j], range_y1 = ys[j + 1];
+            
+            char* lo_x = new_temp(ctx);
+            char* hi_x = new_temp(ctx);
+            char* lo_y = new_temp(ctx);
+            char* hi_y = new_temp(ctx);
+            char* width = new_temp(ctx);
+            char* height = new_temp(ctx);
+            char* has_x = new_temp(ctx);
+            char* has_y = new_temp(ctx);
+            char* has = new_temp(ctx);
+            char* value = new_temp(ctx);
+            char* abs_x = new_temp(ctx);
+            char* abs_y = new_temp(ctx);
+            char* fill_label = new_label(ctx);
+            char* next_label = new_label(ctx);
+            
+            fprintf(out, "  %s = call i32 @llvm.smax.i32(i32 %%x0, i32 %d)\n", lo_x, range_x0);
+            fprintf(out, "  %s = call i32 @llvm.smin.i32(i32 %%x1, i32 %d)\n", hi_x, range_x1);
+            fprintf(out, "  %s = call i32 @llvm.smax.i32(i32 %%y0, i32 %d)\n", lo_y, range_y0);
+            fprintf(out, "  %s = call i32 @llvm.smin.i32(i32 %%y1, i32 %d)\n", hi_y, range_y1);
+            fprintf(out, "  %s = icmp slt i32 %s, %s\n", has_x, lo_x, hi_x);
+            fprintf(out, "  %s = icmp slt i32 %s, %s\n", has_y, lo_y, hi_y);
+            fprintf(out, "  %s = and i1 %s, %s\n", has, has_x, has_y);
+            fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", has, fill_label, next_label);
+            
+            fprintf(out, "%s:\n", fill_label);
+            fprintf(out, "  %s = call i32 @stencil_%s_value(i8* %%canvas_ptr, i32 %s, i32 %s, i32 %d, i32 %d)\n",
+                    value, stencil->name, lo_x, lo_y, apply->x, apply->y);
+            fprintf(out, "  %s = add i32 %s, %d\n", abs_x, lo_x, apply->x);
+            fprintf(out, "  %s = add i32 %s, %d\n", abs_y, lo_y, apply->y);
+            fprintf(out, "  %s = sub i32 %s, %s\n", width, hi_x, lo_x);
+            fprintf(out, "  %s = sub i32 %s, %s\n", height, hi_y, lo_y);
+            fprintf(out, "  call void @fill_rect(i8* %%canvas_ptr, i32 %s, i32 %s, i32 %s, i32 %s, i32 %s)\n",
+                    abs_x, abs_y, width, height, value);
+            fprintf(out, "  br label %%%s\n", next_label);
+            fprintf(out, "%s:\n", next_label);
+            
+            free(lo_x); free(hi_x); free(lo_y); free(hi_y);
+            free(width); free(height);
+            free(has_x); free(has_y); free(has);
+            free(value); free(abs_x); free(abs_y);
+            free(fill_label); free(next_label);
+        }
+    }
+    
+    fprintf(out, "  ret void\n");
+    fprintf(out, "}\n\n");
+}
+
+// Calls stencil `stencil` for every step-th pixel of [x0, x1) x [y0, y1)
+// in both directions, with the apply's top left corner at (start_x,
+// start_y)
+static void generate_apply_loop(CodeGenContext* ctx, const char* stencil, const char* function,
+                                int start_x, int start_y) {
+    FILE* out = ctx->output;
+    
+    char* y_counter = new_temp(ctx);
+    char* x_counter = new_temp(ctx);
+    char* y_cond = new_temp(ctx);
+    char* x_cond = new_temp(ctx);
+    char* y_next = new_temp(ctx);
+    char* x_next = new_temp(ctx);
+    
+    char* y_loop = new_label(ctx);
+    char* y_body = new_label(ctx);
+    char* y_exit = new_label(ctx);
+    char* x_loop = new_label(ctx);
+    char* x_body = new_label(ctx);
+    char* x_exit = new_label(ctx);
+    
+    fprintf(out, "define void @%s(i8* %%canvas_ptr, i32 %%x0, i32 %%y0, i32 %%x1, i32 %%y1, i32 %%step) {\n",
+            function);
+    fprintf(out, "entry:\n");
+    
+    fprintf(out, "  br label %%%s\n", y_loop);
+    fprintf(out, "%s:\n", y_loop);
+    fprintf(out, "  %s = phi i32 [%%y0, %%entry], [%s, %%%s]\n", 
+            y_counter, y_next, x_exit);
+    fprintf(out, "  %s = icmp slt i32 %s, %%y1\n", y_cond, y_counter);
+    fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", y_cond, y_body, y_exit);
+    
+    fprintf(out, "%s:\n", y_body);
+    
+    fprintf(out, "  br label %%%s\n", x_loop);
+    fprintf(out, "%s:\n", x_loop);
+    fprintf(out, "  %s = phi i32 [%%x0, %%%s], [%s, %%%s]\n", 
+            x_counter, y_body, x_next, x_body);
+    fprintf(out, "  %s = icmp slt i32 %s, %%x1\n", x_cond, x_counter);
+    fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", x_cond, x_body, x_exit);
+    
+    fprintf(out, "%s:\n", x_body);
+    
+    fprintf(out, "  call void @stencil_%s(i8* %%canvas_ptr, i32 %s, i32 %s, i32 %d, i32 %d)\n", 
+            stencil, x_counter, y_counter, start_x, start_y);
+    
+    fprintf(out, "  %s = add i32 %s, %%step\n", x_next, x_counter);
+    fprintf(out, "  br label %%%s\n", x_loop);
+    
+    fprintf(out, "%s:\n", x_exit);
+    
+    fprintf(out, "  %s = add i32 %s, %%step\n", y_next, y_counter);
+    fprintf(out, "  br label %%%s\n", y_loop);
+    
+    fprintf(out, "%s:\n", y_exit);
+    fprintf(out, "  ret void\n");
+    fprintf(out, "}\n\n");
+    
+    free(y_counter); free(x_counter);
+    free(y_cond); free(x_cond);
+    free(y_next); free(x_next);
+    free(y_loop); free(y_body); free(y_exit);
+    free(x_loop); free(x_body); free(x_exit);
+}
+
+// Adds an apply statement to the table with its directives (default
+// size 50) and what its stencil touches; NULL for unknown stencils
+ApplyEntry* declare_apply(ASTNode* node, SymbolTable* table) {
+    StencilEntry* stencil = lookup_stencil(table, node->data.apply.name);
+    if (!stencil) return NULL;
+    
+    int start_x = 0, start_y = 0;
+    int size = 50;
+    int layer = 0;
+    int steps = 1;
+    ASTNode* directive_queue[10];
+    int queue_front = 0, queue_back = 0;
+    
+    if (node->data.apply.directives) {
+        directive_queue[queue_back++] = node->data.apply.directives;
+    }
+    
+    while (queue_front < queue_back) {
+        ASTNode* current = directive_queue[queue_front++];
+        if (!current) continue;
+        
+        if (current->type == AST_LOCATION_DIRECTIVE) {
+            ASTNode* coord = current->data.location_directive.coordinate;
+            if (coord && coord->type == AST_COORDINATE) {
+                if (coord->data.coordinate.x && coord->data.coordinate.x->type == AST_NUMBER) {
+                    start_x = coord->data.coordinate.x->data.number.value;
+                }
+                if (coord->data.coordinate.y && coord->data.coordinate.y->type == AST_NUMBER) {
+                    start_y = coord->data.coordinate.y->data.number.value;
+                }
+            }
+        } else if (current->type == AST_SIZE_DIRECTIVE) {
+            if (current->data.size_directive.size && 
+                current->data.size_directive.size->type == AST_NUMBER) {
+                size = current->data.size_directive.size->data.number.value;
+            }
+        } else if (current->type == AST_LAYER_DIRECTIVE) {
+            if (current->data.layer_directive.layer &&
+                current->data.layer_directive.layer->type == AST_NUMBER) {
+                layer = current->data.layer_directive.layer->data.number.value;
+            }
+        } else if (current->type == AST_STEPS_DIRECTIVE) {
+            if (current->data.steps_directive.steps &&
+                current->data.steps_directive.steps->type == AST_NUMBER) {
+                steps = current->data.steps_directive.steps->data.number.value;
+            }
+        } else if (current->type == AST_DIRECTIVE_LIST || current->type == AST_STATEMENT_LIST) {
+            if (current->data.list.head && queue_back < 9) {
+                directive_queue[queue_back++] = current->data.list.head;
+            }
+            if (current->data.list.tail && queue_back < 9) {
+                directive_queue[queue_back++] = current->data.list.tail;
+            }
+        }
+    }
+    
+    ApplyEntry* apply = add_apply(table, node->data.apply.name, start_x, start_y, size, layer);
+    apply->steps = steps;
+    apply->radius = stencil->radius;
+    apply->effects = stencil->effects;
+    apply->covers = stencil->covers;
+    return apply;
+}
+
 void generate_apply_statements(ASTNode* node, CodeGenContext* ctx, SymbolTable* table) {
     if (!node) return;
     
@@ -597,99 +2600,25 @@ void generate_apply_statements(ASTNode* node, CodeGenContext* ctx, SymbolTable*
             break;
             
         case AST_APPLY: {
+            ApplyEntry* apply = declare_apply(node, table);
+            if (!apply) break;
             StencilEntry* stencil = lookup_stencil(table, node->data.apply.name);
-            if (!stencil) break;
-            
-            int start_x = 0, start_y = 0;
-            int size = 50;
-            ASTNode* directive_queue[10];
-            int queue_front = 0, queue_back = 0;
             
-            if (node->data.apply.directives) {
-                directive_queue[queue_back++] = node->data.apply.directives;
-            }
+            char function[32];
+            snprintf(function, sizeof(function), "apply_%d", apply->index);
+            debug_function(ctx, node->data.apply.name, function, node->line);
             
-            while (queue_front < queue_back) {
-                ASTNode* current = directive_queue[queue_front++];
-                if (!current) continue;
-                
-                if (current->type == AST_LOCATION_DIRECTIVE) {
-                    ASTNode* coord = current->data.location_directive.coordinate;
-                    if (coord && coord->type == AST_COORDINATE) {
-                        if (coord->data.coordinate.x && coord->data.coordinate.x->type == AST_NUMBER) {
-                            start_x = coord->data.coordinate.x->data.number.value;
-                        }
-                        if (coord->data.coordinate.y && coord->data.coordinate.y->type == AST_NUMBER) {
-                            start_y = coord->data.coordinate.y->data.number.value;
-                        }
-                    }
-                } else if (current->type == AST_SIZE_DIRECTIVE) {
-                    if (current->data.size_directive.size && 
-                        current->data.size_directive.size->type == AST_NUMBER) {
-                        size = current->data.size_directive.size->data.number.value;
-                    }
-                } else if (current->type == AST_DIRECTIVE_LIST || current->type == AST_STATEMENT_LIST) {
-                    if (current->data.list.head && queue_back < 9) {
-                        directive_queue[queue_back++] = current->data.list.head;
-                    }
-                    if (current->data.list.tail && queue_back < 9) {
-                        directive_queue[queue_back++] = current->data.list.tail;
-                    }
-                }
+            if (stencil->piecewise) {
+                generate_fill_apply(ctx, stencil, apply);
+                break;
             }
             
-            char* y_counter = new_temp(ctx);
-            char* x_counter = new_temp(ctx);
-            char* y_cond = new_temp(ctx);
-            char* x_cond = new_temp(ctx);
-            char* y_next = new_temp(ctx);
-            char* x_next = new_temp(ctx);
-            
-            char* y_loop = new_label(ctx);
-            char* y_body = new_label(ctx);
-            char* y_exit = new_label(ctx);
-            char* x_loop = new_label(ctx);
-            char* x_body = new_label(ctx);
-            char* x_exit = new_label(ctx);
-            
-            fprintf(out, "  ; Apply stencil %s\n", node->data.apply.name);
-            
-            fprintf(out, "  br label %%%s\n", y_loop);
-            fprintf(out, "%s:\n", y_loop);
-            fprintf(out, "  %s = phi i32 [0, %%entry], [%s, %%%s]\n", 
-                    y_counter, y_next, x_exit);
-            fprintf(out, "  %s = icmp slt i32 %s, %d\n", y_cond, y_counter, size);
-            fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", y_cond, y_body, y_exit);
-            
-            fprintf(out, "%s:\n", y_body);
-            
-            fprintf(out, "  br label %%%s\n", x_loop);
-            fprintf(out, "%s:\n", x_loop);
-            fprintf(out, "  %s = phi i32 [0, %%%s], [%s, %%%s]\n", 
-                    x_counter, y_body, x_next, x_body);
-            fprintf(out, "  %s = icmp slt i32 %s, %d\n", x_cond, x_counter, size);
-            fprintf(out, "  br i1 %s, label %%%s, label %%%s\n", x_cond, x_body, x_exit);
-            
-            fprintf(out, "%s:\n", x_body);
-            
-            fprintf(out, "  call void @stencil_%s(i32 %s, i32 %s, i32 %d, i32 %d)\n", 
-                    node->data.apply.name, x_counter, y_counter, start_x, start_y);
-            
-            fprintf(out, "  %s = add i32 %s, 1\n", x_next, x_counter);
-            fprintf(out, "  br label %%%s\n", x_loop);
-            
-            fprintf(out, "%s:\n", x_exit);
-            
-            fprintf(out, "  %s = add i32 %s, 1\n", y_next, y_counter);
-            fprintf(out, "  br label %%%s\n", y_loop);
-            
-            fprintf(out, "%s:\n", y_exit);
-            
-            free(y_counter); free(x_counter);
-            free(y_cond); free(x_cond);
-            free(y_next); free(x_next);
-            free(y_loop); free(y_body); free(y_exit);
-            free(x_loop); free(x_body); free(x_exit);
+            // Each apply is its own function over a sub-rectangle [x0, x1) x [y0, y1)
+            // of the stencil's local coordinates, sampled every `step` pixels;
+            // the runtime decides which region to run and on which layer (see
+            // run_applies).
+            fprintf(out, "; Apply stencil %s\n", node->data.apply.name);
+            generate_apply_loop(ctx, node->data.apply.name, function, apply->x, apply->y);
             break;
         }
         
@@ -698,8 +2627,307 @@ void generate_apply_statements(ASTNode* node, CodeGenContext* ctx, SymbolTable*
     }
 }
 
+// How far outside its rectangle an apply reads the canvas
+static long read_margin(ApplyEntry* apply) {
+    return apply->radius < 0 ? 1L << 40 : apply->radius;
+}
+
+// Whether the rectangle `a` writes, grown by `margin`, overlaps the one
+// `b` writes
+static int rects_overlap(ApplyEntry* a, long margin, ApplyEntry* b) {
+    return a->x - margin < (long)b->x + b->size && b->x < a->x + a->size + margin &&
+           a->y - margin < (long)b->y + b->size && b->y < a->y + a->size + margin;
+}
+
+// Whether `later` has to wait for `earlier`: on the same layer one paints
+// where the other paints or peeks, or one writes globals the other uses
+static int apply_conflicts(ApplyEntry* earlier, ApplyEntry* later) {
+    if ((earlier->effects & WRITES_GLOBALS && later->effects & GLOBAL_EFFECTS) ||
+        (later->effects & WRITES_GLOBALS && earlier->effects & GLOBAL_EFFECTS)) {
+        return 1;
+    }
+    
+    return earlier->layer == later->layer &&
+           (rects_overlap(earlier, read_margin(earlier), later) ||
+            rects_overlap(later, read_margin(later), earlier));
+}
+
+// Whether `outer` paints everything `inner` paints or peeks at
+static int apply_covers(ApplyEntry* outer, ApplyEntry* inner) {
+    long margin = read_margin(inner);
+    return outer->layer == inner->layer &&
+           outer->x <= inner->x - margin && inner->x + inner->size + margin <= outer->x + outer->size &&
+           outer->y <= inner->y - margin && inner->y + inner->size + margin <= outer->y + outer->size;
+}
+
+// Whether `later` paints over everything `earlier` paints where the two
+// overlap, with nothing in between able to tell. `later` mustn't read the
+// canvas itself; it has to paint every pixel, and opaquely unless it is on
+// layer 0, where transparent paints the background (on higher layers a
+// transparent pixel, even painted over an earlier one on the same layer,
+// would let the layers below show through).
+static int apply_hides(ApplyEntry* earlier, ApplyEntry* later) {
+    if (later->steps > 1 || later->effects & READS_CANVAS || later->layer < earlier->layer) return 0;
+    return later->covers & (later->layer > 0 ? COVERS_OPAQUE : COVERS_PIXELS);
+}
+
+static int rect_overlaps(const int* rect, int x0, int y0, int x1, int y1) {
+    return x0 < rect[2] && rect[0] < x1 && y0 < rect[3] && rect[1] < y1;
+}
+
+// Removes [x0, x1) x [y0, y1) from the rectangles in `rects` (x0, y0, x1,
+// y1 each), which are disjoint and stay so: each one it cuts becomes up
+// to four bands around the hole. Returns the new count, or -1 when more
+// than MAX_VISIBLE_RECTS would be needed and `rects` is left as it was.
+static int subtract_rect(int* rects, int count, int x0, int y0, int x1, int y1) {
+    int pieces[4 * 4 * MAX_VISIBLE_RECTS];
+    int piece_count = 0;
+    for (int i = 0; i < count; i++) {
+        int* r = rects + 4 * i;
+        if (!rect_overlaps(r, x0, y0, x1, y1)) {
+            memcpy(pieces + 4 * piece_count++, r, sizeof(int) * 4);
+            continue;
+        }
+        
+        int top = y0 > r[1] ? y0 : r[1];
+        int bottom = y1 < r[3] ? y1 : r[3];
+        int bands[4][4] = {
+            { r[0], r[1], r[2], top },                     // above the hole
+            { r[0], bottom, r[2], r[3] },                  // below it
+            { r[0], top, x0 < r[2] ? x0 : r[2], bottom },  // left of it
+            { x1 > r[0] ? x1 : r[0], top, r[2], bottom },  // right of it
+        };
+        for (int k = 0; k < 4; k++) {
+            if (bands[k][0] < bands[k][2] && bands[k][1] < bands[k][3]) {
+                memcpy(pieces + 4 * piece_count++, bands[k], sizeof(bands[k]));
+            }
+        }
+    }
+    if (piece_count > MAX_VISIBLE_RECTS) return -1;
+    
+    memcpy(rects, pieces, sizeof(int) * 4 * piece_count);
+    return piece_count;
+}
+
+// Overdraw elimination: the parts of applies[i] that later applies don't
+// paint over, into `rects` as x0, y0, x1, y1 in the apply's local
+// coordinates (room for MAX_VISIBLE_RECTS). Returns how many there are,
+// possibly 0, or -1 when the whole apply has to run. Applies that peek,
+// step or write globals always run whole, since their other pixels
+// matter too, and the search stops at the first later apply that reads
+// the canvas, which could see what is underneath.
+int visible_rects(ApplyEntry** applies, int count, int i, int* rects) {
+    ApplyEntry* apply = applies[i];
+    if (apply->steps > 1 || apply->effects & (READS_CANVAS | WRITES_GLOBALS)) return -1;
+    
+    int rect_count = 1;
+    rects[0] = apply->x;
+    rects[1] = apply->y;
+    rects[2] = apply->x + apply->size;
+    rects[3] = apply->y + apply->size;
+    int hidden = 0;
+    for (int j = i + 1; j < count && rect_count > 0; j++) {
+        ApplyEntry* later = applies[j];
+        if (later->steps > 1 || later->effects & READS_CANVAS) break;
+        if (!apply_hides(apply, later)) continue;
+        
+        int x0 = later->x, y0 = later->y;
+        int x1 = later->x + later->size, y1 = later->y + later->size;
+        int overlaps = 0;
+        for (int k = 0; k < rect_count; k++) {
+            overlaps |= rect_overlaps(rects + 4 * k, x0, y0, x1, y1);
+        }
+        
+        // A cut that needs too many rectangles is skipped, and that part
+        // just gets painted twice
+        int remaining = overlaps ? subtract_rect(rects, rect_count, x0, y0, x1, y1) : -1;
+        if (remaining >= 0) {
+            rect_count = remaining;
+            hidden = 1;
+        }
+    }
+    if (!hidden) return -1;
+    
+    for (int k = 0; k < rect_count; k++) {
+        rects[4 * k] -= apply->x;
+        rects[4 * k + 1] -= apply->y;
+        rects[4 * k + 2] -= apply->x;
+        rects[4 * k + 3] -= apply->y;
+    }
+    return rect_count;
+}
+
+// Whether an apply paints the same pixels wherever it is placed: the
+// stencil only sees local x and y unless it peeks at the canvas, steps,
+// or uses globals that some apply changes. Piecewise constant stencils
+// are already filled a rectangle at a time.
+static int translation_invariant(ApplyEntry* apply, StencilEntry* stencil, int globals_written) {
+    return !stencil->piecewise && apply->steps <= 1 && !(apply->effects & READS_CANVAS) &&
+           !(apply->effects & WRITES_GLOBALS) && !(apply->effects & GLOBAL_EFFECTS && globals_written);
+}
+
+// Applies of a translation invariant stencil that is applied more than
+// once with the same size are instanced: the runtime renders the stencil
+// once through @sprite_<name> (the apply loop at (0, 0)) and blits the
+// result at every position, see render_sprites.
+void find_sprites(SymbolTable* table) {
+    int globals_written = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        if (apply->effects & WRITES_GLOBALS) globals_written = 1;
+    }
+    
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        StencilEntry* stencil = lookup_stencil(table, apply->stencil);
+        if (!stencil || !translation_invariant(apply, stencil, globals_written)) continue;
+        
+        for (ApplyEntry* other = table->applies; other; other = other->next) {
+            if (other != apply && other->size == apply->size &&
+                strcmp(other->stencil, apply->stencil) == 0) {
+                apply->sprite = 1;
+                break;
+            }
+        }
+    }
+}
+
+// Emits @sprite_<name> for the stencils find_sprites instanced
+void mark_sprites(CodeGenContext* ctx, SymbolTable* table) {
+    find_sprites(table);
+    
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        StencilEntry* stencil = lookup_stencil(table, apply->stencil);
+        if (apply->sprite && !stencil->sprite) {
+            char function[256];
+            snprintf(function, sizeof(function), "sprite_%s", stencil->name);
+            fprintf(ctx->output, "; Sprite of stencil %s, shared by its instanced applies\n", stencil->name);
+            debug_function(ctx, stencil->name, function, stencil->line);
+            generate_apply_loop(ctx, stencil->name, function, 0, 0);
+            stencil->sprite = 1;
+        }
+    }
+}
+
+// The earlier applies applies[i] has to wait for, nearest first, into
+// `deps`; returns how many there are
+int apply_dependencies(ApplyEntry** applies, int i, int* deps) {
+    int dep_count = 0;
+    for (int j = i - 1; j >= 0; j--) {
+        if (!apply_conflicts(applies[j], applies[i])) continue;
+        deps[dep_count++] = j;
+        
+        // Anything before j that touches what i paints or peeks at
+        // also touches j, which already waits for it
+        if (!(applies[i]->effects & GLOBAL_EFFECTS) && apply_covers(applies[j], applies[i])) break;
+    }
+    return dep_count;
+}
+
+// Exported so hosts can re-run parts of a program (e.g. a single layer)
+// without going through llvm_main.
+//
+// The apply table, in program order. Each apply lists the earlier applies
+// it depends on, so that the runtime can run the others concurrently and
+// still produce the same pixels as running them in order.
+void emit_apply_table(CodeGenContext* ctx, SymbolTable* table) {
+    FILE* out = ctx->output;
+    
+    int count = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        count++;
+    }
+    
+    fprintf(out, "@stencil_apply_count = constant i32 %d\n", count);
+    if (count == 0) {
+        fprintf(out, "@stencil_applies = constant [0 x %%ApplyDesc] zeroinitializer\n\n");
+        return;
+    }
+    
+    ApplyEntry** applies = (ApplyEntry**)malloc(sizeof(ApplyEntry*) * count);
+    int index = 0;
+    for (ApplyEntry* apply = table->applies; apply; apply = apply->next) {
+        applies[index++] = apply;
+    }
+    
+    int* deps = (int*)malloc(sizeof(int) * count);
+    int* dep_counts = (int*)calloc(count, sizeof(int));
+    for (int i = 0; i < count; i++) {
+        int dep_count = apply_dependencies(applies, i, deps);
+        dep_counts[i] = dep_count;
+        if (dep_count == 0) continue;
+        
+        fprintf(out, "@apply_deps_%d = private constant [%d x i32] [", i, dep_count);
+        for (int k = 0; k < dep_count; k++) {
+            fprintf(out, "%si32 %d", k > 0 ? ", " : "", deps[k]);
+        }
+        fprintf(out, "]\n");
+    }
+    
+    // Overdraw elimination: only the parts no later apply paints over
+    int* visible_counts = (int*)malloc(sizeof(int) * count);
+    int rects[4 * MAX_VISIBLE_RECTS];
+    for (int i = 0; i < count; i++) {
+        int rect_count = visible_rects(applies, count, i, rects);
+        visible_counts[i] = rect_count;
+        if (rect_count < 0) continue;
+        
+        fprintf(out, "@apply_visible_%d = private constant [%d x i32] [", i, 4 * rect_count);
+        for (int k = 0; k < 4 * rect_count; k++) {
+            fprintf(out, "%si32 %d", k > 0 ? ", " : "", rects[k]);
+        }
+        fprintf(out, "]\n");
+    }
+    
+    fprintf(out, "@stencil_applies = constant [%d x %%ApplyDesc] [\n", count);
+    for (int i = 0; i < count; i++) {
+        ApplyEntry* apply = applies[i];
+        fprintf(out, "  %%ApplyDesc { void (i8*, i32, i32, i32, i32, i32)* @apply_%d, i32 %d, i32 %d, i32 %d, i32 %d, ",
+                apply->index, apply->x, apply->y, apply->size, apply->layer);
+        if (dep_counts[i] > 0) {
+            fprintf(out, "i32* getelementptr inbounds ([%d x i32], [%d x i32]* @apply_deps_%d, i32 0, i32 0), ",
+                    dep_counts[i], dep_counts[i], i);
+        } else {
+            fprintf(out, "i32* null, ");
+        }
+        fprintf(out, "i32 %d, i32 %d, i32 %d, i32 %d, ", dep_counts[i], apply->steps, apply->radius,
+                apply->effects);
+        if (apply->sprite) {
+            fprintf(out, "void (i8*, i32, i32, i32, i32, i32)* @sprite_%s, ", apply->stencil);
+        } else {
+            fprintf(out, "void (i8*, i32, i32, i32, i32, i32)* null, ");
+        }
+        StencilEntry* stencil = lookup_stencil(table, apply->stencil);
+        if (stencil && stencil->cacheable && apply->steps <= 1) {
+            fprintf(out, "i64 ()* @stencil_%s_key, ", apply->stencil);
+        } else {
+            fprintf(out, "i64 ()* null, ");
+        }
+        if (visible_counts[i] >= 0) {
+            fprintf(out, "i32* getelementptr inbounds ([%d x i32], [%d x i32]* @apply_visible_%d, i32 0, i32 0), i32 %d }",
+                    4 * visible_counts[i], 4 * visible_counts[i], i, visible_counts[i]);
+        } else {
+            fprintf(out, "i32* null, i32 0 }");
+        }
+        fprintf(out, "%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(out, "]\n\n");
+    
+    free(deps);
+    free(dep_counts);
+    free(visible_counts);
+    free(applies);
+}
+
 void generate_code(ASTNode* ast, CodeGenContext* ctx, SymbolTable* global_table) {
+    // With debug info the module goes through attach_debug_locations
+    FILE* module = ctx->output;
+    char* module_buffer = NULL;
+    size_t module_size = 0;
+    if (ctx->debug) {
+        ctx->output = open_memstream(&module_buffer, &module_size);
+    }
+    
     FILE* out = ctx->output;
+    ctx->program = ast;
     
     // LLVM module header
     fprintf(out, "; ModuleID = 'stencil'\n");
@@ -709,20 +2937,73 @@ void generate_code(ASTNode* ast, CodeGenContext* ctx, SymbolTable* global_table)
     
     // Emit runtime function declarations
     emit_runtime_functions(ctx);
+    if (ctx->debug) {
+        begin_debug_info(ctx);
+    }
+    
+    assign_counters(ast, &ctx->counter_count);
+    if (ctx->profile && ctx->profile_count != ctx->counter_count) {
+        fprintf(stderr, "Warning: profile has %d counters, the program %d; ignoring it\n",
+                ctx->profile_count, ctx->counter_count);
+        free(ctx->profile);
+        ctx->profile = NULL;
+    }
+    if (ctx->instrument) {
+        fprintf(out, "declare void @profile_register(i64*, i32)\n");
+        fprintf(out, "@stencil_profile_counters = global [%d x i64] zeroinitializer\n\n",
+                ctx->counter_count);
+        
+        // Registered from a constructor, so the counters are written out
+        // however the program is run (stencil-run, the daemon, libstencil)
+        fprintf(out, "@llvm.global_ctors = appending global [1 x { i32, void ()*, i8* }] [{ i32, void ()*, i8* } { i32 65535, void ()* @stencil_profile_init, i8* null }]\n\n");
+        fprintf(out, "define internal void @stencil_profile_init() {\n");
+        fprintf(out, "entry:\n");
+        fprintf(out, "  call void @profile_register(i64* getelementptr inbounds ([%d x i64], [%d x i64]* @stencil_profile_counters, i32 0, i32 0), i32 %d)\n",
+                ctx->counter_count, ctx->counter_count, ctx->counter_count);
+        fprintf(out, "  ret void\n");
+        fprintf(out, "}\n\n");
+    }
     
     // First pass: generate global declarations, functions, and stencils
     generate_global_decls(ast, ctx, global_table);
     
-    // Generate main function with apply statements
-    fprintf(out, "define i32 @llvm_main() {\n");
-    fprintf(out, "entry:\n");
-    
-    // Reset temp counter for main function
-    ctx->temp_counter = 0;
-    
-    // Process apply statements
+    // Second pass: one function per apply statement, plus the table
+    // describing them
     generate_apply_statements(ast, ctx, global_table);
+    mark_sprites(ctx, global_table);
+    emit_apply_table(ctx, global_table);
+    if (ctx->batch) {
+        generate_batch_globals(ctx, global_table);
+    } else {
+        generate_reset_globals(ctx, global_table);
+    }
     
-    fprintf(out, "  ret i32 0\n");
+    int count = 0;
+    for (ApplyEntry* apply = global_table->applies; apply; apply = apply->next) {
+        count++;
+    }
+    
+    fprintf(out, "define i32 @llvm_main(i8* %%canvas_ptr) {\n");
+    fprintf(out, "entry:\n");
+    if (!ctx->batch) {
+        fprintf(out, "  call void @stencil_reset_globals()\n");
+    }
+    fprintf(out, "  %%result = call i32 @run_applies(i8* %%canvas_ptr, %%ApplyDesc* getelementptr inbounds ([%d x %%ApplyDesc], [%d x %%ApplyDesc]* @stencil_applies, i32 0, i32 0), i32 %d)\n",
+            count, count, count);
+    fprintf(out, "  ret i32 %%result\n");
     fprintf(out, "}\n");
-}
\ No newline at end of file
+    
+    if (ctx->debug) {
+        finish_debug_info(ctx);
+        fclose(out);
+        out = ctx->output = module;
+        attach_debug_locations(module_buffer, module_size, out);
+        free(module_buffer);
+    }
+    
+    fflush(ctx->metadata);
+    if (ctx->metadata_size > 0) {
+        fprintf(out, "\n");
+        fwrite(ctx->metadata_buffer, 1, ctx->metadata_size, out);
+    }
+}
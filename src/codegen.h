@@ -2,8 +2,31 @@
 #define CODEGEN_H
 
 #include "ast.h"
+#include <stdint.h>
 #include <stdio.h>
 
+// A self call in tail position, compiled as a jump back to the function
+// header with new values for the parameter phis
+typedef struct TailCall {
+    char* block;
+    char** args;
+    struct TailCall* next;
+} TailCall;
+
+// Local value numbering: instructions already emitted in the current
+// function, keyed by their text (opcode and SSA operands), with the
+// temporary that holds the result. Entries also form a stack, so leaving
+// an if arm or loop body drops the ones that don't dominate the code
+// that follows (see emit_value and pop_values).
+typedef struct ValueEntry {
+    char* instruction;
+    char* temp;
+    struct ValueEntry* chain; // next entry in the same bucket
+    struct ValueEntry* below; // entry pushed before this one
+} ValueEntry;
+
+#define VALUE_BUCKETS 256
+
 typedef struct {
     FILE* output;
     int label_counter;
@@ -11,29 +34,156 @@ typedef struct {
     int string_counter;
     char* current_function;
     int in_stencil;
+    int paint_returns; // paint returns the value instead (stencil_NAME_value)
+    
+    // Label of the basic block currently being emitted, for phi operands
+    char* current_block;
+    
+    // Function bodies are buffered so that a prologue (the tail recursion
+    // header) can be placed ahead of them (see begin_function_body)
+    FILE* function_output;
+    FILE* prologue;
+    char* prologue_buffer;
+    size_t prologue_size;
+    char* body_buffer;
+    size_t body_size;
+    
+    // Value numbering table of the function being generated
+    ValueEntry* values[VALUE_BUCKETS];
+    ValueEntry* value_stack;
+    
+    // Whole program, for analyses that need to see every statement
+    ASTNode* program;
+    
+    // Header block of the current function when it has self tail calls
+    char* tail_header;
+    TailCall* tail_calls;
+    
+    // Metadata nodes, written out after all functions
+    FILE* metadata;
+    char* metadata_buffer;
+    size_t metadata_size;
+    int metadata_counter;
+    
+    // Profile-guided optimization. With `instrument` every if arm and
+    // function entry bumps a counter; `profile` holds the counts of an
+    // earlier instrumented run (see assign_counters and load_profile).
+    int instrument;
+    int counter_count;
+    uint64_t* profile;
+    int profile_count;
+    
+    // Globals are per-thread and can be set per instance (stencil-batch)
+    int batch;
+    
+    // Debug info (-g): DWARF metadata mapping the IR back to the .stencil
+    // source. Statements write location markers into the IR, which
+    // attach_debug_locations turns into !dbg attachments at the end.
+    int debug;
+    const char* source_file;
+    int debug_unit;     // DICompileUnit
+    int debug_file;     // DIFile of source_file
+    int debug_int;      // DIBasicType of every variable
+    int debug_scope;    // DISubprogram of the function being generated, -1 outside one
+    int debug_line;     // location of the last marker written in it
+    int debug_column;
+    FILE* debug_globals; // ", !N" for every DIGlobalVariableExpression
+    char* debug_globals_buffer;
+    size_t debug_globals_size;
 } CodeGenContext;
 
+// Locals, parameters and constants are SSA values: llvm_name holds the
+// variable's current value and assignments just rebind it. Globals that
+// are written somewhere live in memory and llvm_name is their address.
 typedef struct VarEntry {
     char* name;
     char* llvm_name;
+    int by_value; // llvm_name is the value itself rather than its address
+    int readonly;
+    int debug_variable; // its DILocalVariable with -g, -1 otherwise
     struct VarEntry* next;
 } VarEntry;
 
+// Accesses to mutable globals. Applies that touch the same globals are
+// ordered even when they paint disjoint rectangles. READS_CANVAS is set
+// for any builtin peek, even peek(0, 0), whose radius is 0. Same values
+// as APPLY_READS_GLOBALS / APPLY_WRITES_GLOBALS / APPLY_READS_CANVAS in
+// runtime.h.
+#define READS_GLOBALS 1
+#define WRITES_GLOBALS 2
+#define READS_CANVAS 4
+#define GLOBAL_EFFECTS (READS_GLOBALS | WRITES_GLOBALS)
+
 typedef struct FuncEntry {
     char* name;
     int param_count;
+    ASTNode* body;
+    int visiting; // guards recursion in global_effects
     struct FuncEntry* next;
 } FuncEntry;
 
+#define MAX_BREAKS 8
+
+// Stencils that paint every pixel they are applied to, see paint_coverage
+#define COVERS_PIXELS 1 // possibly transparent
+#define COVERS_OPAQUE 2 // never transparent
+
 typedef struct StencilEntry {
     char* name;
+    int effects;
+    int radius; // how far peek reaches, -1 when not constant
+    
+    // A piecewise constant stencil paints the same value everywhere
+    // between consecutive breaks of x and of y (see find_breaks)
+    int piecewise;
+    int x_breaks[MAX_BREAKS];
+    int x_break_count;
+    int y_breaks[MAX_BREAKS];
+    int y_break_count;
+    
+    // Whether @sprite_<name> was emitted, see mark_sprites
+    int sprite;
+    
+    // Whether @stencil_<name>_key was emitted, see generate_cache_key
+    int cacheable;
+    
+    int covers; // COVERS_PIXELS / COVERS_OPAQUE
+    
+    int line; // of the declaration, for debug info
+    
     struct StencilEntry* next;
 } StencilEntry;
 
+typedef struct ApplyEntry {
+    int index;
+    char* stencil;
+    int x;
+    int y;
+    int size;
+    int layer;
+    int steps;
+    int radius;
+    int effects;
+    int covers;
+    int sprite; // rendered once and blitted, shared with other applies
+    struct ApplyEntry* next;
+} ApplyEntry;
+
+// Tile cache keys: FNV-1a over the stencil's code (see hash_code), then
+// over the values of the globals it reads
+#define CODE_HASH_SEED 14695981039346656037ULL
+#define CODE_HASH_PRIME 1099511628211ULL
+#define MAX_KEY_GLOBALS 32
+
+// Rectangles an apply is cut into at most when later applies paint over
+// parts of it (see visible_rects)
+#define MAX_VISIBLE_RECTS 16
+
 typedef struct {
     VarEntry* vars;
     FuncEntry* funcs;
     StencilEntry* stencils;
+    ApplyEntry* applies; // in program order
 } SymbolTable;
 
 CodeGenContext* create_codegen_context(FILE* output);
@@ -43,7 +193,12 @@ SymbolTable* create_symbol_table();
 void free_symbol_table(SymbolTable* table);
 
 void add_var(SymbolTable* table, const char* name, const char* llvm_name);
+void add_value(SymbolTable* table, const char* name, const char* llvm_name);
+void add_readonly_value(SymbolTable* table, const char* name, const char* llvm_name);
+void set_value(VarEntry* var, const char* llvm_name);
 char* lookup_var(SymbolTable* table, const char* name);
+VarEntry* lookup_var_entry(SymbolTable* table, const char* name);
+void pop_vars(SymbolTable* table, VarEntry* saved);
 
 void add_func(SymbolTable* table, const char* name, int param_count);
 FuncEntry* lookup_func(SymbolTable* table, const char* name);
@@ -51,14 +206,45 @@ FuncEntry* lookup_func(SymbolTable* table, const char* name);
 void add_stencil(SymbolTable* table, const char* name);
 StencilEntry* lookup_stencil(SymbolTable* table, const char* name);
 
+ApplyEntry* add_apply(SymbolTable* table, const char* stencil, int x, int y, int size, int layer);
+
 char* new_temp(CodeGenContext* ctx);
 char* new_label(CodeGenContext* ctx);
 char* new_string_const(CodeGenContext* ctx);
+int new_metadata(CodeGenContext* ctx);
+void emit_label(CodeGenContext* ctx, const char* label);
+char* emit_value(CodeGenContext* ctx, const char* format, ...);
+void pop_values(CodeGenContext* ctx, ValueEntry* mark);
+void begin_function_body(CodeGenContext* ctx);
+void end_function_body(CodeGenContext* ctx);
 
+int load_profile(CodeGenContext* ctx, const char* path);
+void debug_function(CodeGenContext* ctx, const char* name, const char* linkage_name, int line);
+void debug_location(CodeGenContext* ctx, ASTNode* node);
+void debug_variable(CodeGenContext* ctx, VarEntry* var, int line, int arg);
+void debug_value(CodeGenContext* ctx, VarEntry* var);
 void generate_code(ASTNode* ast, CodeGenContext* ctx, SymbolTable* global_table);
 char* generate_expression(ASTNode* node, CodeGenContext* ctx, SymbolTable* table);
+char* generate_call(ASTNode* node, CodeGenContext* ctx, SymbolTable* table, const char* call);
+int flatten_list(ASTNode* node, ASTNode** items, int max);
+int fold_constant(ASTNode* node, SymbolTable* table, int* value);
+int assigns_name(ASTNode* node, const char* name);
+int global_effects(ASTNode* node, SymbolTable* table);
+int is_peek(ASTNode* node, SymbolTable* table);
+int peek_radius(ASTNode* node, SymbolTable* table);
+int cache_key_globals(ASTNode* node, SymbolTable* table, StencilEntry* stencil,
+                      VarEntry** globals, uint64_t* code);
+int break_ranges(const int* breaks, int break_count, int size, int* bounds);
+StencilEntry* declare_stencil(ASTNode* node, SymbolTable* table);
+ApplyEntry* declare_apply(ASTNode* node, SymbolTable* table);
+void find_sprites(SymbolTable* table);
+int apply_dependencies(ApplyEntry** applies, int i, int* deps);
+int visible_rects(ApplyEntry** applies, int count, int i, int* rects);
 void generate_statement(ASTNode* node, CodeGenContext* ctx, SymbolTable* table);
 void generate_global_decls(ASTNode* node, CodeGenContext* ctx, SymbolTable* table);
+void generate_apply_statements(ASTNode* node, CodeGenContext* ctx, SymbolTable* table);
+void mark_sprites(CodeGenContext* ctx, SymbolTable* table);
+void emit_apply_table(CodeGenContext* ctx, SymbolTable* table);
 
 void emit_runtime_functions(CodeGenContext* ctx);
 void emit_main_function(CodeGenContext* ctx, SymbolTable* table);
@@ -0,0 +1,199 @@
+#include "runtime.h"
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Long-running render server. Compiled stencil programs are loaded as
+// shared objects (see the `%.so` rule in the Makefile) and stay resident,
+// and the canvas buffer is reused between requests. A module's llvm_main
+// resets the program's globals before rendering, so a resident module
+// renders the same for every request.
+//
+// Protocol, one request per line:
+//   <module.so> <width> <height> <ansi|truecolor|ppm|raw>
+// Each request is answered with `ok <length>\n` followed by <length> bytes
+// of output, or with a single `error <message>\n` line.
+//
+// With --socket every client is served by its own thread, so a slow or
+// idle client doesn't hold up the others. Renders themselves still run
+// one at a time (each one using all the runtime's threads): they share
+// the canvas, and a module's globals belong to the whole process.
+
+typedef int (*ProgramMain)(Canvas* canvas);
+
+typedef struct Module {
+    char* path;
+    void* handle;
+    ProgramMain main;
+    struct Module* next;
+} Module;
+
+static Module* modules = NULL;
+static Canvas canvas;
+// Held while loading modules and rendering
+static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the module, or NULL with the reason in `error`. dlerror() is
+// read before anything else calls into the dynamic linker, which would
+// replace or clear it.
+static Module* load_module(const char* path, char* error, size_t size) {
+    for (Module* module = modules; module; module = module->next) {
+        if (strcmp(module->path, path) == 0) {
+            return module;
+        }
+    }
+
+    void* handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        snprintf(error, size, "%s", dlerror());
+        return NULL;
+    }
+
+    dlerror();
+    ProgramMain main = (ProgramMain)dlsym(handle, "llvm_main");
+    if (!main) {
+        const char* reason = dlerror();
+        snprintf(error, size, "%s", reason ? reason : "llvm_main is NULL");
+        dlclose(handle);
+        return NULL;
+    }
+
+    Module* module = (Module*)malloc(sizeof(Module));
+    module->path = strdup(path);
+    module->handle = handle;
+    module->main = main;
+    module->next = modules;
+    modules = module;
+    return module;
+}
+
+static void unload_modules() {
+    Module* module = modules;
+    while (module) {
+        Module* next = module->next;
+        dlclose(module->handle);
+        free(module->path);
+        free(module);
+        module = next;
+    }
+    modules = NULL;
+}
+
+static void handle_request(char* line, FILE* out) {
+    char path[4096];
+    char format[16];
+    int width, height;
+
+    if (sscanf(line, "%4095s %d %d %15s", path, &width, &height, format) != 4) {
+        fprintf(out, "error malformed request\n");
+        return;
+    }
+
+    OutputFormat output;
+    if (!parse_output_format(format, &output)) {
+        fprintf(out, "error unknown format %s\n", format);
+        return;
+    }
+
+    pthread_mutex_lock(&render_lock);
+    char error[1024];
+    Module* module = load_module(path, error, sizeof(error));
+    if (!module) {
+        pthread_mutex_unlock(&render_lock);
+        fprintf(out, "error %s\n", error);
+        return;
+    }
+
+    resize_canvas(&canvas, width, height);
+    module->main(&canvas);
+
+    char* payload = NULL;
+    size_t length = 0;
+    FILE* buffer = open_memstream(&payload, &length);
+    write_canvas(&canvas, output, NULL, buffer);
+    fclose(buffer);
+    pthread_mutex_unlock(&render_lock);
+
+    fprintf(out, "ok %zu\n", length);
+    fwrite(payload, 1, length, out);
+    free(payload);
+}
+
+static void serve(FILE* in, FILE* out) {
+    char* line = NULL;
+    size_t capacity = 0;
+
+    while (getline(&line, &capacity, in) > 0) {
+        if (strncmp(line, "quit", 4) == 0) break;
+        handle_request(line, out);
+        fflush(out);
+    }
+
+    free(line);
+}
+
+static void* serve_client(void* arg) {
+    int client = (int)(intptr_t)arg;
+    FILE* in = fdopen(client, "r");
+    FILE* out = fdopen(dup(client), "w");
+    serve(in, out);
+    fclose(in);
+    fclose(out);
+    return NULL;
+}
+
+static int serve_socket(const char* path) {
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0) {
+        perror("socket");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    unlink(path);
+
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) < 0 || listen(server, 16) < 0) {
+        perror(path);
+        close(server);
+        return 1;
+    }
+
+    for (;;) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) continue;
+
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, serve_client, (void*)(intptr_t)client) == 0) {
+            pthread_detach(thread);
+        } else {
+            serve_client((void*)(intptr_t)client);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    init_canvas(&canvas, DEFAULT_CANVAS_WIDTH, DEFAULT_CANVAS_HEIGHT);
+
+    int result = 0;
+    if (argc > 2 && strcmp(argv[1], "--socket") == 0) {
+        result = serve_socket(argv[2]);
+    } else {
+        serve(stdin, stdout);
+    }
+
+    // Instrumented modules' counters must be written before they're unloaded
+    profile_register(NULL, 0);
+    unload_modules();
+    cleanup_canvas(&canvas);
+
+    return result;
+}
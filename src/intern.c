@@ -0,0 +1,104 @@
+#include "intern.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_CHUNK_SIZE 65536
+#define INITIAL_CAPACITY 1024
+
+typedef struct Chunk {
+    struct Chunk* next;
+    size_t used;
+    size_t size;
+    char data[];
+} Chunk;
+
+// Open addressing, linear probing. Lookups compare the (pointer, length)
+// view being scanned against the stored copy, so a name that was seen
+// before costs a hash and a memcmp and allocates nothing.
+typedef struct {
+    const char* name;
+    size_t length;
+    uint32_t hash;
+} InternEntry;
+
+static InternEntry* entries = NULL;
+static size_t capacity = 0;
+static size_t count = 0;
+static Chunk* chunks = NULL;
+
+static uint32_t hash_view(const char* text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char* arena_copy(const char* text, size_t length) {
+    if (!chunks || chunks->used + length + 1 > chunks->size) {
+        size_t size = length + 1 > ARENA_CHUNK_SIZE ? length + 1 : ARENA_CHUNK_SIZE;
+        Chunk* chunk = (Chunk*)malloc(sizeof(Chunk) + size);
+        chunk->next = chunks;
+        chunk->used = 0;
+        chunk->size = size;
+        chunks = chunk;
+    }
+    
+    char* copy = chunks->data + chunks->used;
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    chunks->used += length + 1;
+    return copy;
+}
+
+static void grow(void) {
+    size_t old_capacity = capacity;
+    InternEntry* old_entries = entries;
+    
+    capacity = capacity ? capacity * 2 : INITIAL_CAPACITY;
+    entries = (InternEntry*)calloc(capacity, sizeof(InternEntry));
+    
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (!old_entries[i].name) continue;
+        size_t slot = old_entries[i].hash & (capacity - 1);
+        while (entries[slot].name) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        entries[slot] = old_entries[i];
+    }
+    free(old_entries);
+}
+
+const char* intern(const char* text, size_t length) {
+    if ((count + 1) * 2 > capacity) grow();
+    
+    uint32_t hash = hash_view(text, length);
+    size_t slot = hash & (capacity - 1);
+    while (entries[slot].name) {
+        InternEntry* entry = &entries[slot];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(entry->name, text, length) == 0) {
+            return entry->name;
+        }
+        slot = (slot + 1) & (capacity - 1);
+    }
+    
+    entries[slot].name = arena_copy(text, length);
+    entries[slot].length = length;
+    entries[slot].hash = hash;
+    count++;
+    return entries[slot].name;
+}
+
+void free_interned(void) {
+    while (chunks) {
+        Chunk* next = chunks->next;
+        free(chunks);
+        chunks = next;
+    }
+    free(entries);
+    entries = NULL;
+    capacity = 0;
+    count = 0;
+}
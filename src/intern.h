@@ -0,0 +1,13 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+// Identifiers are interned: every distinct name is copied once into an
+// arena and all of its occurrences share that copy. Interned names stay
+// valid until free_interned, can be compared by pointer, and are never
+// owned (or freed) by the AST.
+const char* intern(const char* text, size_t length);
+void free_interned(void);
+
+#endif
@@ -1,16 +1,225 @@
 #include "runtime.h"
+#include "tilecache.h"
+#include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
-int llvm_main();
+int llvm_main(Canvas* canvas);
+void stencil_reset_globals(void);
+
+// Apply table of the compiled program
+extern const ApplyDesc stencil_applies[];
+extern const int stencil_apply_count;
+
+// Canvas whose buffer is POSIX shared memory, so that pixels painted by
+// forked workers are visible to the parent without copying
+static uint8_t* init_shared_canvas(Canvas* canvas, int width, int height) {
+    char name[64];
+    snprintf(name, sizeof(name), "/stencil-canvas-%d", (int)getpid());
+    int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return NULL;
+    }
+    // The mapping outlives the name, and forked workers inherit it
+    shm_unlink(name);
+    
+    uint8_t* buffer = NULL;
+    if (ftruncate(fd, width * height) == 0) {
+        buffer = (uint8_t*)mmap(NULL, width * height, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (!buffer || buffer == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    
+    init_canvas_view(canvas, buffer, width, height, width);
+    return buffer;
+}
+
+// Renders with `processes` worker processes, each painting its own band
+// of rows. A worker that crashes only loses its band.
+static int render_processes(Canvas* canvas, int processes) {
+    if (processes > canvas->height) processes = canvas->height;
+    
+    pid_t* workers = (pid_t*)malloc(sizeof(pid_t) * processes);
+    for (int i = 0; i < processes; i++) {
+        int y0 = canvas->height * i / processes;
+        int y1 = canvas->height * (i + 1) / processes;
+        
+        workers[i] = fork();
+        if (workers[i] == 0) {
+            run_applies_rows(canvas, stencil_applies, stencil_apply_count, y0, y1);
+            profile_flush(); // _exit skips atexit
+            _exit(0);
+        }
+        if (workers[i] < 0) {
+            perror("fork");
+        }
+    }
+    
+    int result = 0;
+    for (int i = 0; i < processes; i++) {
+        int status;
+        if (workers[i] < 0 || waitpid(workers[i], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "Worker for rows %d-%d failed\n",
+                    canvas->height * i / processes, canvas->height * (i + 1) / processes - 1);
+            result = 1;
+        }
+    }
+    free(workers);
+    return result;
+}
+
+// --pack: two pixels per byte, where that can't change the output
+static void pack_canvas(Canvas* canvas, OutputFormat format) {
+    if (canvas->layout != CANVAS_ROW_MAJOR) {
+        fprintf(stderr, "Warning: --pack needs the row layout, ignoring it\n");
+        return;
+    }
+    if (!packing_preserves_output(stencil_applies, stencil_apply_count, format)) {
+        fprintf(stderr, "Warning: --pack only applies to ANSI output of programs that don't peek, ignoring it\n");
+        return;
+    }
+    set_canvas_format(canvas, CANVAS_PACKED4);
+}
+
+// --progressive: each pass is written out as soon as it is done. The
+// terminal formats draw it over the previous one, the others write one
+// image after another.
+typedef struct {
+    OutputFormat format;
+    const Palette* palette;
+    int lines; // taken by the last pass on the terminal
+} Progress;
+
+static void write_pass(const Canvas* canvas, int stride, void* data) {
+    Progress* progress = (Progress*)data;
+    (void)stride;
+    if (progress->format != OUTPUT_ANSI && progress->format != OUTPUT_TRUECOLOR) {
+        write_canvas(canvas, progress->format, progress->palette, stdout);
+        fflush(stdout);
+        return;
+    }
+
+    char* text = NULL;
+    size_t length = 0;
+    FILE* stream = open_memstream(&text, &length);
+    write_canvas(canvas, progress->format, progress->palette, stream);
+    fclose(stream);
+
+    if (progress->lines > 0) {
+        printf("\033[%dA\r", progress->lines);
+    }
+    fwrite(text, 1, length, stdout);
+    fflush(stdout);
+    progress->lines = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (text[i] == '\n') progress->lines++;
+    }
+    free(text);
+}
 
 int main(int argc, char** argv) {
-    init_canvas(25, 25);
+    OutputFormat format = OUTPUT_ANSI;
+    int processes = 1;
+    int pipeline = 0;
+    int pack = 0;
+    int progressive = 0;
+    int width = 25, height = 25;
+    CanvasLayout layout = CANVAS_ROW_MAJOR;
+    Palette palette;
+    default_palette(&palette);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            if (!parse_output_format(argv[++i], &format)) {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--palette") == 0 && i + 1 < argc) {
+            FILE* in = fopen(argv[++i], "r");
+            if (!in || load_palette(&palette, in) < 0) {
+                fprintf(stderr, "Invalid palette: %s\n", argv[i]);
+                return 1;
+            }
+            fclose(in);
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2) {
+                fprintf(stderr, "Size must be WIDTHxHEIGHT: %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--processes") == 0 && i + 1 < argc) {
+            processes = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--pipeline") == 0) {
+            pipeline = 1;
+        } else if (strcmp(argv[i], "--pack") == 0) {
+            pack = 1;
+        } else if (strcmp(argv[i], "--progressive") == 0) {
+            progressive = 1;
+        } else if (strcmp(argv[i], "--layout") == 0 && i + 1 < argc) {
+            if (!parse_canvas_layout(argv[++i], &layout)) {
+                fprintf(stderr, "Unknown layout: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Usage: %s [--format ansi|truecolor|ppm|raw] [--palette file] [--size WxH] [--processes n] [--pipeline] [--layout row|tiled|morton] [--pack] [--progressive]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (width < 1 || width > MAX_CANVAS_WIDTH || height < 1 || height > MAX_CANVAS_HEIGHT) {
+        fprintf(stderr, "Size must be at most %dx%d\n", MAX_CANVAS_WIDTH, MAX_CANVAS_HEIGHT);
+        return 1;
+    }
+
+    Canvas canvas;
+    uint8_t* shared = NULL;
+    int result;
+
+    // llvm_main does this itself, the other modes run the apply table
+    stencil_reset_globals();
 
-    int result = llvm_main();
+    // Programs whose rows depend on each other always run in-process
+    if (processes > 1 && applies_split_by_rows(stencil_applies, stencil_apply_count)) {
+        shared = init_shared_canvas(&canvas, width, height);
+        if (!shared) return 1;
+        result = render_processes(&canvas, processes);
+        write_canvas(&canvas, format, &palette, stdout);
+    } else if (progressive) {
+        init_canvas(&canvas, width, height);
+        set_canvas_layout(&canvas, layout);
+        if (pack) pack_canvas(&canvas, format);
+        Progress progress = { format, &palette, 0 };
+        result = run_applies_progressive(&canvas, stencil_applies, stencil_apply_count,
+                                         write_pass, &progress);
+    } else if (pipeline) {
+        // Bands are written while the next ones are computed
+        init_canvas(&canvas, width, height);
+        set_canvas_layout(&canvas, layout);
+        if (pack) pack_canvas(&canvas, format);
+        result = run_applies_pipelined(&canvas, stencil_applies, stencil_apply_count,
+                                       format, &palette, stdout);
+    } else {
+        init_canvas(&canvas, width, height);
+        set_canvas_layout(&canvas, layout);
+        if (pack) pack_canvas(&canvas, format);
+        result = llvm_main(&canvas);
+        write_canvas(&canvas, format, &palette, stdout);
+    }
 
-    render_canvas();
+    cleanup_canvas(&canvas);
+    if (shared) {
+        munmap(shared, width * height);
+    }
 
-    cleanup_canvas();
+    // Only when STENCIL_CACHE is set
+    tile_cache_report(stderr);
 
     return result;
-}
\ No newline at end of file
+}
@@ -1,18 +1,42 @@
 %{
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "src/ast.h"
+#include "src/asmgen.h"
 #include "src/codegen.h"
+#include "src/intern.h"
 
 void yyerror(const char *s);
 extern int yylex();
+extern int scan_file(const char* path);
+extern void finish_scan(void);
 
 ASTNode* root = NULL;
+
+// Bison's default location rule, also handing the rule's start to
+// create_node: actions run right after it, so the nodes they create
+// point at the construct they came from.
+#define YYLLOC_DEFAULT(Current, Rhs, N)                                     \
+    do {                                                                    \
+        if (N) {                                                            \
+            (Current).first_line = YYRHSLOC(Rhs, 1).first_line;             \
+            (Current).first_column = YYRHSLOC(Rhs, 1).first_column;         \
+            (Current).last_line = YYRHSLOC(Rhs, N).last_line;               \
+            (Current).last_column = YYRHSLOC(Rhs, N).last_column;           \
+        } else {                                                            \
+            (Current).first_line = (Current).last_line = YYRHSLOC(Rhs, 0).last_line;       \
+            (Current).first_column = (Current).last_column = YYRHSLOC(Rhs, 0).last_column; \
+        }                                                                   \
+        set_source_location((Current).first_line, (Current).first_column); \
+    } while (0)
 %}
 
+%locations
+
 %union {
     int number;
-    char* identifier;
+    const char* identifier;
     ASTNode* node;
 }
 
@@ -25,15 +49,15 @@ ASTNode* root = NULL;
 %token AND OR NOT
 %token ASSIGN
 %token LPAREN RPAREN LBRACE RBRACE LBRACKET RBRACKET
-%token COMMA SEMICOLON
-%token IF ELSE FUNC RETURN
-%token STENCIL APPLY AT SIZE PAINT
+%token COMMA SEMICOLON RANGE
+%token IF ELSE FOR IN FUNC RETURN
+%token STENCIL APPLY AT SIZE PAINT LAYER TRANSPARENT STEPS
 %token VAR
 
 %type <node> program statement_list statement expression rel_exp term factor
-%type <node> assignment var_dec block if_statement func_declaration func_call
+%type <node> assignment var_dec block if_statement for_statement func_declaration func_call
 %type <node> expression_list stencil_declaration apply_statement directive_list
-%type <node> coordinate location_directive size_directive paint_statement
+%type <node> coordinate location_directive size_directive layer_directive steps_directive paint_statement
 %type <node> return_statement
 
 %left OR
@@ -59,6 +83,7 @@ statement
     | func_call SEMICOLON { $$ = $1; }
     | block { $$ = $1; }
     | if_statement { $$ = $1; }
+    | for_statement { $$ = $1; }
     | func_declaration { $$ = $1; }
     | stencil_declaration { $$ = $1; }
     | apply_statement SEMICOLON { $$ = $1; }
@@ -122,6 +147,10 @@ if_statement
     | IF LPAREN rel_exp RPAREN statement ELSE statement { $$ = create_if($3, $5, $7); }
     ;
 
+for_statement
+    : FOR LPAREN IDENTIFIER IN expression RANGE expression RPAREN statement { $$ = create_for($3, $5, $7, $9); }
+    ;
+
 func_declaration
     : FUNC IDENTIFIER LPAREN RPAREN block { $$ = create_func_dec($2, NULL, $5); }
     | FUNC IDENTIFIER LPAREN var_dec RPAREN block { $$ = create_func_dec($2, $4, $6); }
@@ -149,6 +178,8 @@ directive_list
     : /* empty */ { $$ = NULL; }
     | directive_list location_directive { $$ = create_list($1, $2); }
     | directive_list size_directive { $$ = create_list($1, $2); }
+    | directive_list layer_directive { $$ = create_list($1, $2); }
+    | directive_list steps_directive { $$ = create_list($1, $2); }
     ;
 
 coordinate
@@ -163,28 +194,86 @@ size_directive
     : SIZE factor { $$ = create_size_directive($2); }
     ;
 
+layer_directive
+    : LAYER factor { $$ = create_layer_directive($2); }
+    ;
+
+steps_directive
+    : STEPS factor { $$ = create_steps_directive($2); }
+    ;
+
 paint_statement
     : PAINT factor { $$ = create_paint($2); }
+    | PAINT TRANSPARENT { $$ = create_paint(NULL); }
     ;
 
 %%
 
 void yyerror(const char *s) {
-    fprintf(stderr, "Error: %s\n", s);
+    fprintf(stderr, "Error: %s at line %d, column %d\n", s, yylloc.first_line, yylloc.first_column);
 }
 
+// Usage: parser [--instrument | --profile-use PROFILE] [-g] [--batch] [--asm] [file.stencil],
+// reading stdin when no file is given
 int main(int argc, char** argv) {
+    const char* input = NULL;
+    const char* profile = NULL;
+    int instrument = 0;
+    int debug = 0;
+    int batch = 0;
+    int assembly = 0;
+    
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--instrument") == 0) {
+            instrument = 1;
+        } else if (strcmp(argv[i], "-g") == 0) {
+            debug = 1;
+        } else if (strcmp(argv[i], "--batch") == 0) {
+            batch = 1;
+        } else if (strcmp(argv[i], "--asm") == 0) {
+            assembly = 1;
+        } else if (strcmp(argv[i], "--profile-use") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else {
+            input = argv[i];
+        }
+    }
+    
+    if (assembly && (batch || instrument || profile)) {
+        fprintf(stderr, "Error: --asm doesn't support --batch, --instrument or --profile-use\n");
+        return 1;
+    }
+    
+    if (input && !scan_file(input)) {
+        perror(input);
+        return 1;
+    }
+    
     int result = yyparse();
+    if (input) finish_scan();
     if (result == 0 && root) {
-        // Generate LLVM code
+        // Generate LLVM code, or with --asm x86-64 assembly
         CodeGenContext* ctx = create_codegen_context(stdout);
         SymbolTable* table = create_symbol_table();
         
-        generate_code(root, ctx, table);
+        ctx->instrument = instrument;
+        ctx->debug = debug;
+        ctx->batch = batch;
+        ctx->source_file = input ? input : "<stdin>";
+        if (profile && !load_profile(ctx, profile)) {
+            fprintf(stderr, "Warning: cannot read profile %s\n", profile);
+        }
+        
+        if (assembly) {
+            generate_assembly(root, ctx, table);
+        } else {
+            generate_code(root, ctx, table);
+        }
         
         free_codegen_context(ctx);
         free_symbol_table(table);
         free_ast(root);
     }
+    free_interned();
     return result;
 } 
\ No newline at end of file
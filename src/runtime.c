@@ -1,56 +1,422 @@
 #include "runtime.h"
+#include "tilecache.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
 
-static Canvas canvas = {NULL, 0, 0};
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 #define ANSI_RESET "\033[0m"
 #define ANSI_BOLD "\033[1m"
 
-void init_canvas(int width, int height) {
+void init_canvas(Canvas* canvas, int width, int height) {
+    canvas->buffer = NULL;
+    canvas->mask = NULL;
+    canvas->capacity = 0;
+    canvas->layers = NULL;
+    canvas->layer_count = 0;
+    canvas->origin_x = 0;
+    canvas->origin_y = 0;
+    canvas->source = NULL;
+    canvas->layout = CANVAS_ROW_MAJOR;
+    canvas->format = CANVAS_BYTES;
+    resize_canvas(canvas, width, height);
+}
+
+void init_canvas_view(Canvas* canvas, uint8_t* buffer, int width, int height, int stride) {
+    canvas->mask = NULL;
+    canvas->layers = NULL;
+    canvas->layer_count = 0;
+    canvas->origin_x = 0;
+    canvas->origin_y = 0;
+    canvas->source = NULL;
+    set_canvas_buffer(canvas, buffer, width, height, stride);
+}
+
+// Points an existing canvas at a caller buffer, keeping its layers so a
+// later run_layer can reuse them.
+void set_canvas_buffer(Canvas* canvas, uint8_t* buffer, int width, int height, int stride) {
+    canvas->buffer = buffer;
+    canvas->width = width;
+    canvas->height = height;
+    canvas->stride = stride;
+    canvas->capacity = 0;
+    canvas->layout = CANVAS_ROW_MAJOR;
+    canvas->format = CANVAS_BYTES;
+}
+
+// Reuses the current buffer when it is large enough, so long-running
+// hosts (see daemon.c) don't allocate a new canvas for every render.
+void resize_canvas(Canvas* canvas, int width, int height) {
     if (width > MAX_CANVAS_WIDTH) width = MAX_CANVAS_WIDTH;
     if (height > MAX_CANVAS_HEIGHT) height = MAX_CANVAS_HEIGHT;
     if (width <= 0) width = DEFAULT_CANVAS_WIDTH;
     if (height <= 0) height = DEFAULT_CANVAS_HEIGHT;
     
-    canvas.width = width;
-    canvas.height = height;
+    // Tiled layouts round up to whole blocks, packed rows to whole bytes
+    int stride = width;
+    int rows = height;
+    if (canvas->layout != CANVAS_ROW_MAJOR) {
+        stride = (width + CANVAS_TILE - 1) & ~(CANVAS_TILE - 1);
+        rows = (height + CANVAS_TILE - 1) & ~(CANVAS_TILE - 1);
+    } else if (canvas->format == CANVAS_PACKED4) {
+        stride = (width + 1) & ~1;
+    }
+    int size = canvas->format == CANVAS_PACKED4 ? stride * rows / 2 : stride * rows;
     
-    canvas.buffer = (Color*)calloc(width * height, sizeof(Color));
-    if (!canvas.buffer) {
-        fprintf(stderr, "Failed to allocate canvas buffer\n");
-        exit(1);
+    if (size > canvas->capacity) {
+        if (canvas->capacity > 0) {
+            free(canvas->buffer);
+        }
+        canvas->buffer = (uint8_t*)calloc(size, sizeof(uint8_t));
+        if (!canvas->buffer) {
+            fprintf(stderr, "Failed to allocate canvas buffer\n");
+            exit(1);
+        }
+        canvas->capacity = size;
     }
     
-    clear_canvas();
+    canvas->width = width;
+    canvas->height = height;
+    canvas->stride = stride;
+    
+    clear_canvas(canvas);
+}
+
+// Bytes of buffer the canvas spans, padding included
+static int canvas_bytes(const Canvas* canvas) {
+    if (canvas->layout == CANVAS_ROW_MAJOR) {
+        int pixels = canvas->height > 0 ? (canvas->height - 1) * canvas->stride + canvas->width : 0;
+        return canvas->format == CANVAS_PACKED4 ? (pixels + 1) / 2 : pixels;
+    }
+    int rows = (canvas->height + CANVAS_TILE - 1) & ~(CANVAS_TILE - 1);
+    return rows * canvas->stride;
 }
 
-void cleanup_canvas() {
-    if (canvas.buffer) {
-        free(canvas.buffer);
-        canvas.buffer = NULL;
+// Pixel `index` (see canvas_index) of the canvas buffer
+static inline int load_pixel(const Canvas* canvas, int index) {
+    if (canvas->format == CANVAS_PACKED4) {
+        return (canvas->buffer[index >> 1] >> ((index & 1) << 2)) & 0x0f;
     }
-    canvas.width = 0;
-    canvas.height = 0;
+    return canvas->buffer[index];
 }
 
-void paint_pixel(int x, int y, int color) {
-    if (x < 0 || x >= canvas.width || y < 0 || y >= canvas.height) {
+static inline void store_pixel(Canvas* canvas, int index, uint8_t value) {
+    if (canvas->format == CANVAS_PACKED4) {
+        uint8_t* pair = canvas->buffer + (index >> 1);
+        int shift = (index & 1) << 2;
+        *pair = (uint8_t)((*pair & ~(0x0f << shift)) | ((value & 0x0f) << shift));
         return;
     }
+    canvas->buffer[index] = value;
+}
+
+// Pixels [x0, x0 + width) of a packed row (starting at pixel 0) to one
+// byte each. The vector loops turn 16 bytes into 32 pixels by splitting
+// the nibbles and interleaving them.
+static void unpack_row(const uint8_t* row, int x0, int width, uint8_t* dst) {
+    int x = x0;
+    int x1 = x0 + width;
+    if ((x & 1) && x < x1) {
+        *dst++ = row[x >> 1] >> 4;
+        x++;
+    }
+    
+    const uint8_t* src = row + (x >> 1);
+    int pairs = (x1 - x) >> 1;
+    int i = 0;
+#if defined(__x86_64__)
+    const __m128i low = _mm_set1_epi8(0x0f);
+    for (; i + 16 <= pairs; i += 16) {
+        __m128i packed = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i even = _mm_and_si128(packed, low);
+        __m128i odd = _mm_and_si128(_mm_srli_epi16(packed, 4), low);
+        _mm_storeu_si128((__m128i*)(dst + 2 * i), _mm_unpacklo_epi8(even, odd));
+        _mm_storeu_si128((__m128i*)(dst + 2 * i + 16), _mm_unpackhi_epi8(even, odd));
+    }
+#elif defined(__aarch64__)
+    for (; i + 16 <= pairs; i += 16) {
+        uint8x16_t packed = vld1q_u8(src + i);
+        uint8x16x2_t pixels = { { vandq_u8(packed, vdupq_n_u8(0x0f)), vshrq_n_u8(packed, 4) } };
+        vst2q_u8(dst + 2 * i, pixels);
+    }
+#endif
+    for (; i < pairs; i++) {
+        dst[2 * i] = src[i] & 0x0f;
+        dst[2 * i + 1] = src[i] >> 4;
+    }
+    if ((x1 - x) & 1) {
+        dst[2 * pairs] = src[pairs] & 0x0f;
+    }
+}
+
+// The inverse of unpack_row; the other nibble of a pair cut by either
+// end of the run is kept. Vector loops narrow 32 pixels into 16 bytes.
+static void pack_row(uint8_t* row, int x0, int width, const uint8_t* src) {
+    int x = x0;
+    int x1 = x0 + width;
+    if ((x & 1) && x < x1) {
+        row[x >> 1] = (uint8_t)((row[x >> 1] & 0x0f) | (*src++ << 4));
+        x++;
+    }
     
-    int index = y * canvas.width + x;
+    uint8_t* dst = row + (x >> 1);
+    int pairs = (x1 - x) >> 1;
+    int i = 0;
+#if defined(__x86_64__)
+    // A 16-bit lane holds one pair; fold it into its low byte, then
+    // saturate the lanes down to bytes
+    const __m128i low = _mm_set1_epi16(0x000f);
+    const __m128i high = _mm_set1_epi16(0x00f0);
+    for (; i + 16 <= pairs; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(src + 2 * i + 16));
+        a = _mm_or_si128(_mm_and_si128(a, low), _mm_and_si128(_mm_srli_epi16(a, 4), high));
+        b = _mm_or_si128(_mm_and_si128(b, low), _mm_and_si128(_mm_srli_epi16(b, 4), high));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_packus_epi16(a, b));
+    }
+#elif defined(__aarch64__)
+    for (; i + 16 <= pairs; i += 16) {
+        uint8x16x2_t pixels = vld2q_u8(src + 2 * i);
+        vst1q_u8(dst + i, vorrq_u8(vandq_u8(pixels.val[0], vdupq_n_u8(0x0f)), vshlq_n_u8(pixels.val[1], 4)));
+    }
+#endif
+    for (; i < pairs; i++) {
+        dst[i] = (uint8_t)((src[2 * i] & 0x0f) | (src[2 * i + 1] << 4));
+    }
+    if ((x1 - x) & 1) {
+        dst[pairs] = (uint8_t)((dst[pairs] & 0xf0) | (src[2 * pairs] & 0x0f));
+    }
+}
+
+static void fill_packed_row(uint8_t* row, int x0, int width, uint8_t value) {
+    int x = x0;
+    int x1 = x0 + width;
+    value &= 0x0f;
+    if ((x & 1) && x < x1) {
+        row[x >> 1] = (uint8_t)((row[x >> 1] & 0x0f) | (value << 4));
+        x++;
+    }
+    memset(row + (x >> 1), value | (value << 4), (x1 - x) >> 1);
+    if ((x1 - x) & 1) {
+        row[(x1 - 1) >> 1] = (uint8_t)((row[(x1 - 1) >> 1] & 0xf0) | value);
+    }
+}
+
+// Start of row y of a packed canvas
+static inline uint8_t* packed_row(const Canvas* canvas, int y) {
+    return canvas->buffer + y * (canvas->stride >> 1);
+}
+
+// Sets [x0, x1) x [y0, y1) of `plane` (a canvas buffer or mask laid out
+// like `canvas`) to `value`, one contiguous run at a time
+static void fill_plane(const Canvas* canvas, uint8_t* plane, int x0, int y0, int x1, int y1, uint8_t value) {
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0, run; x < x1; x += run) {
+            run = canvas_run(canvas, x, x1 - x);
+            memset(plane + canvas_index(canvas, x, y), value, run);
+        }
+    }
+}
+
+// Copies [x0, x1) x [y0, y1) of the canvas to or from a row-major buffer
+// whose first byte is pixel (x0, y0)
+static void read_rect(const Canvas* canvas, int x0, int y0, int x1, int y1, uint8_t* dst, int dst_stride) {
+    if (canvas->format == CANVAS_PACKED4) {
+        for (int y = y0; y < y1; y++) {
+            unpack_row(packed_row(canvas, y), x0, x1 - x0, dst + (y - y0) * dst_stride);
+        }
+        return;
+    }
     
-    canvas.buffer[index] = value_to_color(color);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0, run; x < x1; x += run) {
+            run = canvas_run(canvas, x, x1 - x);
+            memcpy(dst + (y - y0) * dst_stride + (x - x0), canvas->buffer + canvas_index(canvas, x, y), run);
+        }
+    }
+}
+
+static void write_plane(const Canvas* canvas, uint8_t* plane, int x0, int y0, int x1, int y1,
+                        const uint8_t* src, int src_stride) {
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0, run; x < x1; x += run) {
+            run = canvas_run(canvas, x, x1 - x);
+            memcpy(plane + canvas_index(canvas, x, y), src + (y - y0) * src_stride + (x - x0), run);
+        }
+    }
 }
 
-int get_canvas_width() {
-    return canvas.width;
+static void write_rect(Canvas* canvas, int x0, int y0, int x1, int y1, const uint8_t* src, int src_stride) {
+    if (canvas->format == CANVAS_PACKED4) {
+        for (int y = y0; y < y1; y++) {
+            pack_row(packed_row(canvas, y), x0, x1 - x0, src + (y - y0) * src_stride);
+        }
+        return;
+    }
+    write_plane(canvas, canvas->buffer, x0, y0, x1, y1, src, src_stride);
 }
 
-int get_canvas_height() {
-    return canvas.height;
+static void fill_pixels(Canvas* canvas, int x0, int y0, int x1, int y1, uint8_t value) {
+    if (canvas->format == CANVAS_PACKED4) {
+        for (int y = y0; y < y1; y++) {
+            fill_packed_row(packed_row(canvas, y), x0, x1 - x0, value);
+        }
+        return;
+    }
+    fill_plane(canvas, canvas->buffer, x0, y0, x1, y1, value);
+}
+
+// Row y as contiguous pixels: a pointer into the buffer when the canvas
+// is row-major with a byte per pixel, otherwise gathered or unpacked into
+// `scratch` (width bytes)
+const uint8_t* canvas_row(const Canvas* canvas, int y, uint8_t* scratch) {
+    if (canvas->format == CANVAS_PACKED4) {
+        unpack_row(packed_row(canvas, y), 0, canvas->width, scratch);
+        return scratch;
+    }
+    if (canvas->layout == CANVAS_ROW_MAJOR) {
+        return canvas->buffer + y * canvas->stride;
+    }
+    read_rect(canvas, 0, y, canvas->width, y + 1, scratch, canvas->width);
+    return scratch;
+}
+
+static void free_layers(Canvas* canvas) {
+    for (int i = 0; i < canvas->layer_count; i++) {
+        cleanup_canvas(&canvas->layers[i]);
+    }
+    free(canvas->layers);
+    canvas->layers = NULL;
+    canvas->layer_count = 0;
+}
+
+void cleanup_canvas(Canvas* canvas) {
+    if (canvas->buffer && canvas->capacity > 0) {
+        free(canvas->buffer);
+    }
+    free(canvas->mask);
+    free_layers(canvas);
+    canvas->buffer = NULL;
+    canvas->mask = NULL;
+    canvas->width = 0;
+    canvas->height = 0;
+    canvas->stride = 0;
+    canvas->capacity = 0;
+}
+
+// Switches an owned canvas to another layout. The contents and layers are
+// discarded; callers borrowing a buffer keep it row-major.
+void set_canvas_layout(Canvas* canvas, CanvasLayout layout) {
+    if (canvas->layout == layout || (canvas->buffer && canvas->capacity == 0)) return;
+    
+    free_layers(canvas);
+    canvas->layout = layout;
+    if (layout != CANVAS_ROW_MAJOR) {
+        canvas->format = CANVAS_BYTES;
+    }
+    resize_canvas(canvas, canvas->width, canvas->height);
+}
+
+// Switches an owned row-major canvas to another pixel format, discarding
+// its contents. Layers keep a byte per pixel, as their masks do.
+void set_canvas_format(Canvas* canvas, CanvasFormat format) {
+    if (canvas->format == format || canvas->layout != CANVAS_ROW_MAJOR ||
+        (canvas->buffer && canvas->capacity == 0)) {
+        return;
+    }
+    
+    canvas->format = format;
+    resize_canvas(canvas, canvas->width, canvas->height);
+}
+
+int parse_canvas_layout(const char* name, CanvasLayout* layout) {
+    if (strcmp(name, "row") == 0) *layout = CANVAS_ROW_MAJOR;
+    else if (strcmp(name, "tiled") == 0) *layout = CANVAS_TILED;
+    else if (strcmp(name, "morton") == 0) *layout = CANVAS_MORTON;
+    else return 0;
+    return 1;
+}
+
+void paint_pixel(Canvas* canvas, int x, int y, int color) {
+    if (x < 0 || x >= canvas->width || y < 0 || y >= canvas->height) {
+        return;
+    }
+    
+    int index = canvas_index(canvas, x - canvas->origin_x, y - canvas->origin_y);
+    
+    // Store the raw value; it is mapped to a color when the canvas is
+    // written out, so painting stays a single byte store (or a nibble
+    // update on a packed canvas).
+    store_pixel(canvas, index, (uint8_t)color);
+    if (canvas->mask) {
+        canvas->mask[index] = 0xff;
+    }
+}
+
+// `paint transparent`: uncovers the pixel on a layer, or paints the
+// background on an opaque canvas.
+void clear_pixel(Canvas* canvas, int x, int y) {
+    if (x < 0 || x >= canvas->width || y < 0 || y >= canvas->height) {
+        return;
+    }
+    
+    int index = canvas_index(canvas, x - canvas->origin_x, y - canvas->origin_y);
+    
+    store_pixel(canvas, index, 0);
+    if (canvas->mask) {
+        canvas->mask[index] = 0;
+    }
+}
+
+// Fills a rectangle with what a piecewise constant stencil paints over
+// it: a value 0-255, 256 for transparent, or -1 for nothing at all
+void fill_rect(Canvas* canvas, int x, int y, int width, int height, int value) {
+    if (value < 0) return;
+    
+    int x0 = x < 0 ? 0 : x;
+    int y0 = y < 0 ? 0 : y;
+    int x1 = x + width > canvas->width ? canvas->width : x + width;
+    int y1 = y + height > canvas->height ? canvas->height : y + height;
+    if (x0 >= x1 || y0 >= y1) return;
+    
+    uint8_t color = value > 255 ? 0 : (uint8_t)value;
+    uint8_t mask = value > 255 ? 0 : 0xff;
+    x0 -= canvas->origin_x;
+    x1 -= canvas->origin_x;
+    y0 -= canvas->origin_y;
+    y1 -= canvas->origin_y;
+    fill_pixels(canvas, x0, y0, x1, y1, color);
+    if (canvas->mask) {
+        fill_plane(canvas, canvas->mask, x0, y0, x1, y1, mask);
+    }
+}
+
+// Value at (x, y) as of the start of the current step; 0 outside the canvas
+int peek_pixel(Canvas* canvas, int x, int y) {
+    const Canvas* source = canvas->source ? canvas->source : canvas;
+    if (x < 0 || x >= source->width || y < 0 || y >= source->height) {
+        return 0;
+    }
+    
+    return load_pixel(source, canvas_index(source, x - source->origin_x, y - source->origin_y));
+}
+
+int get_canvas_width(Canvas* canvas) {
+    return canvas->width;
+}
+
+int get_canvas_height(Canvas* canvas) {
+    return canvas->height;
 }
 
 Color value_to_color(int value) {
@@ -76,24 +442,1437 @@ void get_ansi_color(Color color, char* buffer) {
     sprintf(buffer, "\033[%dm", 40 + color.code);
 }
 
-void render_pixel(Color color) {
+void render_pixel(FILE* out, Color color) {
     char ansi_color[32];
     get_ansi_color(color, ansi_color);
-    printf("%s  %s", ansi_color, ANSI_RESET);
+    fprintf(out, "%s  %s", ansi_color, ANSI_RESET);
+}
+
+void render_canvas(const Canvas* canvas) {
+    render_canvas_to(canvas, stdout);
+}
+
+void render_canvas_to(const Canvas* canvas, FILE* out) {
+    uint8_t* scratch = (uint8_t*)malloc(canvas->width + 1);
+    for (int y = 0; y < canvas->height; y++) {
+        const uint8_t* row = canvas_row(canvas, y, scratch);
+        for (int x = 0; x < canvas->width; x++) {
+            render_pixel(out, value_to_color(row[x]));
+        }
+        fprintf(out, "\n");
+    }
+    free(scratch);
+}
+
+// One byte per pixel, row-major, holding the raw pixel value.
+void write_canvas_raw(const Canvas* canvas, FILE* out) {
+    uint8_t* scratch = (uint8_t*)malloc(canvas->width + 1);
+    for (int y = 0; y < canvas->height; y++) {
+        fwrite(canvas_row(canvas, y, scratch), sizeof(uint8_t), canvas->width, out);
+    }
+    free(scratch);
+}
+
+void clear_canvas(Canvas* canvas) {
+    if (!canvas->buffer) return;
+    
+    if (canvas->layout != CANVAS_ROW_MAJOR || canvas->format == CANVAS_PACKED4) {
+        memset(canvas->buffer, 0, canvas_bytes(canvas));
+        return;
+    }
+    for (int y = 0; y < canvas->height; y++) {
+        memset(canvas->buffer + y * canvas->stride, 0, canvas->width);
+    }
+}
+
+int parse_output_format(const char* name, OutputFormat* format) {
+    if (strcmp(name, "ansi") == 0) *format = OUTPUT_ANSI;
+    else if (strcmp(name, "truecolor") == 0) *format = OUTPUT_TRUECOLOR;
+    else if (strcmp(name, "ppm") == 0) *format = OUTPUT_PPM;
+    else if (strcmp(name, "raw") == 0) *format = OUTPUT_RAW;
+    else return 0;
+    return 1;
+}
+
+// PPM pixel data without the header
+static void write_rgb_rows(const uint32_t* pixels, int width, int height, int stride, FILE* out) {
+    uint8_t* rgb = (uint8_t*)malloc(width * 3);
+    for (int y = 0; y < height; y++) {
+        const uint32_t* row = pixels + y * stride;
+        for (int x = 0; x < width; x++) {
+            rgb[x * 3] = row[x] & 0xff;
+            rgb[x * 3 + 1] = (row[x] >> 8) & 0xff;
+            rgb[x * 3 + 2] = (row[x] >> 16) & 0xff;
+        }
+        fwrite(rgb, 1, width * 3, out);
+    }
+    free(rgb);
+}
+
+void write_canvas(const Canvas* canvas, OutputFormat format, const Palette* palette, FILE* out) {
+    write_canvas_rows(canvas, format, palette, 0, canvas->height, out);
+}
+
+// Writes rows [y0, y1) of the canvas, so that a canvas can be written out
+// a band at a time. The PPM header goes out with row 0.
+void write_canvas_rows(const Canvas* canvas, OutputFormat format, const Palette* palette,
+                       int y0, int y1, FILE* out) {
+    // Tiled canvases are gathered into a row-major band first; packed
+    // rows are unpacked one at a time by canvas_row
+    Canvas rows;
+    uint8_t* band = NULL;
+    if (canvas->format == CANVAS_PACKED4) {
+        init_canvas_view(&rows, packed_row(canvas, y0), canvas->width, y1 - y0, canvas->stride);
+        rows.format = CANVAS_PACKED4;
+    } else if (canvas->layout == CANVAS_ROW_MAJOR) {
+        init_canvas_view(&rows, canvas->buffer + y0 * canvas->stride, canvas->width, y1 - y0, canvas->stride);
+    } else {
+        band = (uint8_t*)malloc(canvas->width * (y1 - y0) + 1);
+        read_rect(canvas, 0, y0, canvas->width, y1, band, canvas->width);
+        init_canvas_view(&rows, band, canvas->width, y1 - y0, canvas->width);
+    }
+    
+    if (format == OUTPUT_ANSI) {
+        render_canvas_to(&rows, out);
+        free(band);
+        return;
+    }
+    if (format == OUTPUT_RAW) {
+        write_canvas_raw(&rows, out);
+        free(band);
+        return;
+    }
+
+    Palette fallback;
+    if (!palette) {
+        default_palette(&fallback);
+        palette = &fallback;
+    }
+
+    uint32_t* pixels = (uint32_t*)malloc(rows.width * rows.height * sizeof(uint32_t) + 1);
+    if (!pixels) {
+        fprintf(stderr, "Failed to allocate RGBA buffer\n");
+        exit(1);
+    }
+
+    convert_to_rgba(&rows, palette, pixels, rows.width);
+    if (format == OUTPUT_TRUECOLOR) {
+        render_rgba_truecolor(pixels, rows.width, rows.height, rows.width, out);
+    } else {
+        if (y0 == 0) {
+            fprintf(out, "P6\n%d %d\n255\n", canvas->width, canvas->height);
+        }
+        write_rgb_rows(pixels, rows.width, rows.height, rows.width, out);
+    }
+
+    free(pixels);
+    free(band);
+}
+
+// The 8 ANSI colors, repeated so that a raw value maps to the same color
+// it gets in the ANSI renderer.
+void default_palette(Palette* palette) {
+    static const uint32_t ansi[8] = {
+        RGBA(0x00, 0x00, 0x00, 0xff),
+        RGBA(0xcd, 0x00, 0x00, 0xff),
+        RGBA(0x00, 0xcd, 0x00, 0xff),
+        RGBA(0xcd, 0xcd, 0x00, 0xff),
+        RGBA(0x00, 0x00, 0xee, 0xff),
+        RGBA(0xcd, 0x00, 0xcd, 0xff),
+        RGBA(0x00, 0xcd, 0xcd, 0xff),
+        RGBA(0xe5, 0xe5, 0xe5, 0xff),
+    };
+    for (int i = 0; i < PALETTE_SIZE; i++) {
+        palette->colors[i] = ansi[i % 8];
+    }
+}
+
+// Palette files hold one `<value> <rrggbb>` entry per line (the color may
+// be prefixed with '#'); entries not listed keep the default colors.
+// Returns the number of entries read, or -1 on a malformed line.
+int load_palette(Palette* palette, FILE* in) {
+    default_palette(palette);
+
+    char line[256];
+    int entries = 0;
+    while (fgets(line, sizeof(line), in)) {
+        char* p = line;
+        while (*p == ' ' || *p == '\t') p++;
+        if (*p == '\0' || *p == '\n' || *p == '#') continue;
+
+        int index;
+        unsigned int rgb;
+        if (sscanf(p, "%d #%6x", &index, &rgb) != 2 && sscanf(p, "%d %6x", &index, &rgb) != 2) {
+            return -1;
+        }
+        if (index < 0 || index >= PALETTE_SIZE) return -1;
+
+        palette->colors[index] = RGBA((rgb >> 16) & 0xff, (rgb >> 8) & 0xff, rgb & 0xff, 0xff);
+        entries++;
+    }
+    return entries;
+}
+
+static void convert_row_scalar(const uint8_t* src, const uint32_t* colors, uint32_t* dst, int width) {
+    for (int x = 0; x < width; x++) {
+        dst[x] = colors[src[x]];
+    }
+}
+
+#if defined(__x86_64__)
+// Eight pixels per iteration: widen the raw bytes to 32-bit indices and
+// gather their colors from the palette.
+__attribute__((target("avx2")))
+static void convert_row_avx2(const uint8_t* src, const uint32_t* colors, uint32_t* dst, int width) {
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i raw = _mm_loadl_epi64((const __m128i*)(src + x));
+        __m256i indices = _mm256_cvtepu8_epi32(raw);
+        __m256i rgba = _mm256_i32gather_epi32((const int*)colors, indices, 4);
+        _mm256_storeu_si256((__m256i*)(dst + x), rgba);
+    }
+    convert_row_scalar(src + x, colors, dst + x, width - x);
+}
+#endif
+
+void convert_to_rgba(const Canvas* canvas, const Palette* palette, uint32_t* out, int out_stride) {
+    void (*convert_row)(const uint8_t*, const uint32_t*, uint32_t*, int) = convert_row_scalar;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        convert_row = convert_row_avx2;
+    }
+#endif
+
+    uint8_t* scratch = (uint8_t*)malloc(canvas->width + 1);
+    for (int y = 0; y < canvas->height; y++) {
+        convert_row(canvas_row(canvas, y, scratch), palette->colors,
+                    out + y * out_stride, canvas->width);
+    }
+    free(scratch);
+}
+
+void render_rgba_truecolor(const uint32_t* pixels, int width, int height, int stride, FILE* out) {
+    for (int y = 0; y < height; y++) {
+        const uint32_t* row = pixels + y * stride;
+        for (int x = 0; x < width; x++) {
+            // Runs of the same color share one escape sequence
+            if (x == 0 || row[x] != row[x - 1]) {
+                fprintf(out, "\033[48;2;%u;%u;%um", row[x] & 0xff, (row[x] >> 8) & 0xff, (row[x] >> 16) & 0xff);
+            }
+            fputs("  ", out);
+        }
+        fprintf(out, "%s\n", ANSI_RESET);
+    }
+}
+
+// Binary PPM (P6); alpha is dropped.
+void write_rgba_ppm(const uint32_t* pixels, int width, int height, int stride, FILE* out) {
+    fprintf(out, "P6\n%d %d\n255\n", width, height);
+    write_rgb_rows(pixels, width, height, stride, out);
+}
+
+// Returns layer `layer`, allocating it (empty) on first use or when the
+// canvas changed size since it was allocated.
+Canvas* canvas_layer(Canvas* canvas, int layer) {
+    if (layer < 0) layer = 0;
+    if (layer >= MAX_LAYERS) layer = MAX_LAYERS - 1;
+    
+    if (!canvas->layers) {
+        canvas->layers = (Canvas*)calloc(MAX_LAYERS, sizeof(Canvas));
+        canvas->layer_count = MAX_LAYERS;
+    }
+    
+    // Layers of a tiled canvas share its layout, so compositing doesn't
+    // have to convert between layouts
+    Canvas* target = &canvas->layers[layer];
+    if (target->buffer && (target->width != canvas->width || target->height != canvas->height ||
+                           target->layout != canvas->layout)) {
+        cleanup_canvas(target);
+    }
+    if (!target->buffer) {
+        target->layout = canvas->layout;
+        target->width = canvas->width;
+        target->height = canvas->height;
+        target->stride = canvas->layout == CANVAS_ROW_MAJOR ? canvas->width : canvas->stride;
+        int size = canvas_bytes(target);
+        target->buffer = (uint8_t*)calloc(size, sizeof(uint8_t));
+        target->mask = layer > 0 ? (uint8_t*)calloc(size, sizeof(uint8_t)) : NULL;
+        if (!target->buffer || (layer > 0 && !target->mask)) {
+            fprintf(stderr, "Failed to allocate canvas layer\n");
+            exit(1);
+        }
+        target->capacity = size;
+    }
+    return target;
+}
+
+static void reset_layer(Canvas* layer) {
+    memset(layer->buffer, 0, canvas_bytes(layer));
+    if (layer->mask) {
+        memset(layer->mask, 0, canvas_bytes(layer));
+    }
+}
+
+typedef uint8_t ByteVector __attribute__((vector_size(32)));
+
+// dst = mask ? src : dst, 32 pixels at a time. Masks are 0 or 0xff, so
+// the select is a plain bitwise blend.
+static void blend_row(uint8_t* dst, const uint8_t* src, const uint8_t* mask, int width) {
+    int x = 0;
+    for (; x + (int)sizeof(ByteVector) <= width; x += sizeof(ByteVector)) {
+        ByteVector d, v, m;
+        memcpy(&d, dst + x, sizeof(ByteVector));
+        memcpy(&v, src + x, sizeof(ByteVector));
+        memcpy(&m, mask + x, sizeof(ByteVector));
+        d = (v & m) | (d & ~m);
+        memcpy(dst + x, &d, sizeof(ByteVector));
+    }
+    for (; x < width; x++) {
+        dst[x] = (src[x] & mask[x]) | (dst[x] & ~mask[x]);
+    }
+}
+
+// Composites `length` bytes at `offset` of a tiled canvas, whose layers
+// are laid out exactly like it
+static void composite_span(Canvas* canvas, int offset, int length) {
+    const Canvas* base = &canvas->layers[0];
+    if (base->buffer) {
+        memcpy(canvas->buffer + offset, base->buffer + offset, length);
+    } else {
+        memset(canvas->buffer + offset, 0, length);
+    }
+    
+    for (int i = 1; i < canvas->layer_count; i++) {
+        const Canvas* layer = &canvas->layers[i];
+        if (layer->buffer) {
+            blend_row(canvas->buffer + offset, layer->buffer + offset, layer->mask + offset, length);
+        }
+    }
+}
+
+static void composite_rows(Canvas* canvas, int y0, int y1) {
+    if (!canvas->layers) return;
+    
+    if (canvas->layout != CANVAS_ROW_MAJOR) {
+        // Whole rows of blocks are one contiguous span
+        if ((y0 & (CANVAS_TILE - 1)) == 0 && ((y1 & (CANVAS_TILE - 1)) == 0 || y1 == canvas->height)) {
+            int rows = ((y1 + CANVAS_TILE - 1) & ~(CANVAS_TILE - 1)) - y0;
+            composite_span(canvas, y0 * canvas->stride, rows * canvas->stride);
+            return;
+        }
+        for (int y = y0; y < y1; y++) {
+            for (int x = 0, run; x < canvas->width; x += run) {
+                run = canvas_run(canvas, x, canvas->width - x);
+                composite_span(canvas, canvas_index(canvas, x, y), run);
+            }
+        }
+        return;
+    }
+    
+    const Canvas* base = &canvas->layers[0];
+    if (canvas->format == CANVAS_PACKED4) {
+        // Layers have a byte per pixel: blend a row at a time, then pack it
+        uint8_t* row = (uint8_t*)malloc(canvas->width + 1);
+        for (int y = y0; y < y1; y++) {
+            if (base->buffer) {
+                memcpy(row, base->buffer + y * base->stride, canvas->width);
+            } else {
+                memset(row, 0, canvas->width);
+            }
+            for (int i = 1; i < canvas->layer_count; i++) {
+                const Canvas* layer = &canvas->layers[i];
+                if (layer->buffer) {
+                    blend_row(row, layer->buffer + y * layer->stride, layer->mask + y * layer->stride,
+                              canvas->width);
+                }
+            }
+            pack_row(packed_row(canvas, y), 0, canvas->width, row);
+        }
+        free(row);
+        return;
+    }
+    
+    for (int y = y0; y < y1; y++) {
+        uint8_t* row = canvas->buffer + y * canvas->stride;
+        if (base->buffer) {
+            memcpy(row, base->buffer + y * base->stride, canvas->width);
+        } else {
+            memset(row, 0, canvas->width);
+        }
+    }
+    
+    for (int i = 1; i < canvas->layer_count; i++) {
+        const Canvas* layer = &canvas->layers[i];
+        if (!layer->buffer) continue;
+        
+        for (int y = y0; y < y1; y++) {
+            blend_row(canvas->buffer + y * canvas->stride,
+                      layer->buffer + y * layer->stride,
+                      layer->mask + y * layer->stride,
+                      canvas->width);
+        }
+    }
+}
+
+void composite_layers(Canvas* canvas) {
+    composite_rows(canvas, 0, canvas->height);
+}
+
+#define TILE_SIZE 64
+
+static void copy_rect(uint8_t* dst, int dst_stride, const uint8_t* src, int src_stride,
+                      int width, int height) {
+    for (int y = 0; y < height; y++) {
+        memcpy(dst + y * dst_stride, src + y * src_stride, width);
+    }
+}
+
+// Coverage of pixels nothing has painted yet, in the masks of sprites
+// and of the scratch canvases of iterated applies on layers
+#define SPRITE_UNTOUCHED TILE_UNTOUCHED
+
+// Scratch canvas covering [x0, x1) x [y0, y1) of a width x height canvas;
+// `mask` is NULL unless the target is a layer
+static void init_region(Canvas* region, uint8_t* buffer, uint8_t* mask, int width, int height,
+                        int x0, int y0, int x1, int y1) {
+    memset(region, 0, sizeof(Canvas));
+    region->buffer = buffer;
+    region->mask = mask;
+    region->width = width;
+    region->height = height;
+    region->stride = x1 - x0;
+    region->origin_x = x0;
+    region->origin_y = y0;
+}
+
+// Address of canvas pixel (x, y) inside a region
+static uint8_t* region_pixel(const Canvas* region, int x, int y) {
+    return region->buffer + (y - region->origin_y) * region->stride + (x - region->origin_x);
 }
 
-void render_canvas() {
-    for (int y = 0; y < canvas.height; y++) {
-        for (int x = 0; x < canvas.width; x++) {
-            int index = y * canvas.width + x;
-            render_pixel(canvas.buffer[index]);
+// One step of an iterated apply over [x0, x1) x [y0, y1): `next` starts
+// as a copy of `current` (pixels the stencil doesn't paint keep their
+// value and coverage) and peek reads `current`.
+static void run_step(const ApplyDesc* apply, Canvas* current, Canvas* next,
+                     int x0, int y0, int x1, int y1) {
+    copy_rect(region_pixel(next, x0, y0), next->stride,
+              region_pixel(current, x0, y0), current->stride, x1 - x0, y1 - y0);
+    if (next->mask) {
+        copy_rect(next->mask + (region_pixel(next, x0, y0) - next->buffer), next->stride,
+                  current->mask + (region_pixel(current, x0, y0) - current->buffer), current->stride,
+                  x1 - x0, y1 - y0);
+    }
+    next->source = current;
+    apply->fn(next, x0 - apply->x, y0 - apply->y, x1 - apply->x, y1 - apply->y, 1);
+}
+
+// Advances one tile `depth` steps from `current` into `next`. The tile is
+// loaded with a halo of depth * radius pixels into two scratch buffers
+// (and two masks, on layers) that stay in cache; each step computes a
+// region one radius smaller, so the tile itself is exact after the last
+// one.
+static void run_tile(const ApplyDesc* apply, const Canvas* current, Canvas* next,
+                     int x0, int y0, int x1, int y1,
+                     int tx0, int ty0, int tx1, int ty1, int depth, uint8_t* scratch[4]) {
+    int width = current->width;
+    int height = current->height;
+    int halo = depth * apply->radius;
+    
+    int lx0 = tx0 - halo < 0 ? 0 : tx0 - halo;
+    int ly0 = ty0 - halo < 0 ? 0 : ty0 - halo;
+    int lx1 = tx1 + halo > width ? width : tx1 + halo;
+    int ly1 = ty1 + halo > height ? height : ty1 + halo;
+    
+    Canvas buffers[2];
+    for (int i = 0; i < 2; i++) {
+        init_region(&buffers[i], scratch[i], scratch[2 + i], width, height, lx0, ly0, lx1, ly1);
+        copy_rect(scratch[i], buffers[i].stride, region_pixel(current, lx0, ly0), current->stride,
+                  lx1 - lx0, ly1 - ly0);
+        if (current->mask) {
+            copy_rect(scratch[2 + i], buffers[i].stride,
+                      current->mask + (region_pixel(current, lx0, ly0) - current->buffer), current->stride,
+                      lx1 - lx0, ly1 - ly0);
+        }
+    }
+    
+    int from = 0;
+    for (int step = 1; step <= depth; step++) {
+        int margin = (depth - step) * apply->radius;
+        int cx0 = tx0 - margin < x0 ? x0 : tx0 - margin;
+        int cy0 = ty0 - margin < y0 ? y0 : ty0 - margin;
+        int cx1 = tx1 + margin > x1 ? x1 : tx1 + margin;
+        int cy1 = ty1 + margin > y1 ? y1 : ty1 + margin;
+        
+        run_step(apply, &buffers[from], &buffers[1 - from], cx0, cy0, cx1, cy1);
+        from = 1 - from;
+    }
+    
+    copy_rect(region_pixel(next, tx0, ty0), next->stride,
+              region_pixel(&buffers[from], tx0, ty0), buffers[from].stride, tx1 - tx0, ty1 - ty0);
+    if (next->mask) {
+        copy_rect(next->mask + (region_pixel(next, tx0, ty0) - next->buffer), next->stride,
+                  buffers[from].mask + (region_pixel(&buffers[from], tx0, ty0) - buffers[from].buffer),
+                  buffers[from].stride, tx1 - tx0, ty1 - ty0);
+    }
+}
+
+// Iterated applies: every step reads the result of the previous one, so
+// steps ping-pong between two copies of the canvas. With a known peek
+// radius the rectangle is processed in tiles several steps at a time
+// (temporal blocking), otherwise one whole step at a time. Tiles compute
+// their halos more than once and out of step order, so applies that
+// write globals always go one whole step at a time. On a layer the
+// copies carry a coverage mask, so only the pixels some step painted or
+// cleared are written back.
+static void run_iterated(Canvas* target, const ApplyDesc* apply) {
+    int width = target->width;
+    int height = target->height;
+    int x0 = apply->x < 0 ? 0 : apply->x;
+    int y0 = apply->y < 0 ? 0 : apply->y;
+    int x1 = apply->x + apply->size > width ? width : apply->x + apply->size;
+    int y1 = apply->y + apply->size > height ? height : apply->y + apply->size;
+    if (x0 >= x1 || y0 >= y1) return;
+    
+    int steps = apply->steps < 1 ? 1 : apply->steps;
+    
+    Canvas buffers[2];
+    for (int i = 0; i < 2; i++) {
+        uint8_t* buffer = (uint8_t*)malloc(width * height);
+        uint8_t* mask = target->mask ? (uint8_t*)malloc(width * height) : NULL;
+        if (!buffer || (target->mask && !mask)) {
+            fprintf(stderr, "Failed to allocate step buffer\n");
+            exit(1);
+        }
+        init_region(&buffers[i], buffer, mask, width, height, 0, 0, width, height);
+        read_rect(target, 0, 0, width, height, buffer, width);
+        if (mask) {
+            memset(mask, SPRITE_UNTOUCHED, width * height);
+        }
+    }
+    
+    int current = 0;
+    if (apply->radius < 0 || (apply->effects & APPLY_WRITES_GLOBALS)) {
+        for (int step = 0; step < steps; step++) {
+            run_step(apply, &buffers[current], &buffers[1 - current], x0, y0, x1, y1);
+            current = 1 - current;
+        }
+    } else {
+        // Halos of a quarter tile per side keep the redundant work bounded
+        int depth = apply->radius == 0 ? steps : TILE_SIZE / (4 * apply->radius);
+        if (depth < 1) depth = 1;
+        if (depth > steps) depth = steps;
+        
+        int span = TILE_SIZE + 2 * depth * apply->radius;
+        int scratch_width = span < width ? span : width;
+        int scratch_height = span < height ? span : height;
+        uint8_t* scratch[4] = { NULL, NULL, NULL, NULL };
+        for (int i = 0; i < (target->mask ? 4 : 2); i++) {
+            scratch[i] = (uint8_t*)malloc(scratch_width * scratch_height);
+        }
+        
+        for (int done = 0; done < steps; done += depth) {
+            int block = steps - done < depth ? steps - done : depth;
+            for (int ty = y0; ty < y1; ty += TILE_SIZE) {
+                for (int tx = x0; tx < x1; tx += TILE_SIZE) {
+                    int tx1 = tx + TILE_SIZE > x1 ? x1 : tx + TILE_SIZE;
+                    int ty1 = ty + TILE_SIZE > y1 ? y1 : ty + TILE_SIZE;
+                    run_tile(apply, &buffers[current], &buffers[1 - current],
+                             x0, y0, x1, y1, tx, ty, tx1, ty1, block, scratch);
+                }
+            }
+            current = 1 - current;
+        }
+        
+        for (int i = 0; i < 4; i++) {
+            free(scratch[i]);
+        }
+    }
+    
+    const Canvas* result = &buffers[current];
+    if (!target->mask) {
+        write_rect(target, x0, y0, x1, y1, region_pixel(result, x0, y0), width);
+    } else {
+        for (int y = y0; y < y1; y++) {
+            for (int x = x0; x < x1; x++) {
+                int offset = y * width + x;
+                if (result->mask[offset] == SPRITE_UNTOUCHED) continue;
+                int index = canvas_index(target, x, y);
+                store_pixel(target, index, result->buffer[offset]);
+                target->mask[index] = result->mask[offset];
+            }
+        }
+    }
+    
+    for (int i = 0; i < 2; i++) {
+        free(buffers[i].buffer);
+        free(buffers[i].mask);
+    }
+}
+
+// A stencil rendered once for all its instanced applies (see the
+// `sprite` of ApplyDesc), into a size x size canvas whose mask tells
+// painted (0xff), cleared (0) and untouched (SPRITE_UNTOUCHED) pixels
+// apart. When every pixel was touched the sprite is `opaque` and its rows
+// are copied as they are. Tiles from the tile cache are blitted as
+// sprites too; their mask is NULL when every pixel was painted.
+
+typedef struct {
+    Canvas canvas;
+    ApplyFn fn;
+    int size;
+    int opaque;
+} Sprite;
+
+typedef struct {
+    Sprite* sprites;
+    int count;
+    Sprite** by_apply; // NULL for applies that are run directly
+} SpriteSet;
+
+// Renders every distinct sprite of the program up front, so workers only
+// blit. Sprites larger than the biggest canvas aren't worth keeping and
+// their applies are run directly.
+static void render_sprites(SpriteSet* set, const ApplyDesc* applies, int count) {
+    set->sprites = (Sprite*)malloc(sizeof(Sprite) * (count + 1));
+    set->by_apply = (Sprite**)calloc(count + 1, sizeof(Sprite*));
+    set->count = 0;
+    
+    for (int i = 0; i < count; i++) {
+        const ApplyDesc* apply = &applies[i];
+        if (!apply->sprite || apply->size <= 0 || apply->size > MAX_CANVAS_WIDTH ||
+            apply->size > MAX_CANVAS_HEIGHT) {
+            continue;
+        }
+        
+        Sprite* sprite = NULL;
+        for (int k = 0; k < set->count; k++) {
+            if (set->sprites[k].fn == apply->sprite && set->sprites[k].size == apply->size) {
+                sprite = &set->sprites[k];
+                break;
+            }
+        }
+        
+        if (!sprite) {
+            int size = apply->size;
+            uint8_t* buffer = (uint8_t*)calloc(size, size);
+            uint8_t* mask = (uint8_t*)malloc(size * size);
+            if (!buffer || !mask) {
+                free(buffer);
+                free(mask);
+                continue;
+            }
+            memset(mask, SPRITE_UNTOUCHED, size * size);
+            
+            sprite = &set->sprites[set->count++];
+            init_canvas_view(&sprite->canvas, buffer, size, size, size);
+            sprite->canvas.mask = mask;
+            sprite->fn = apply->sprite;
+            sprite->size = size;
+            apply->sprite(&sprite->canvas, 0, 0, size, size, 1);
+            sprite->opaque = memchr(mask, SPRITE_UNTOUCHED, size * size) == NULL;
+        }
+        set->by_apply[i] = sprite;
+    }
+}
+
+static void free_sprites(SpriteSet* set) {
+    for (int i = 0; i < set->count; i++) {
+        free(set->sprites[i].canvas.buffer);
+        free(set->sprites[i].canvas.mask);
+    }
+    free(set->sprites);
+    free(set->by_apply);
+}
+
+// Copies the sprite's [x0, x1) x [y0, y1) to the canvas with its top
+// left corner at (x, y): whole rows with memcpy when it is opaque,
+// otherwise only the pixels the stencil touched.
+static void blit_sprite(Canvas* target, const Sprite* sprite, int x, int y,
+                        int x0, int y0, int x1, int y1) {
+    int stride = sprite->canvas.stride;
+    const uint8_t* pixels = sprite->canvas.buffer + y0 * stride + x0;
+    const uint8_t* mask = sprite->canvas.mask ? sprite->canvas.mask + y0 * stride + x0 : NULL;
+    
+    if (sprite->opaque) {
+        write_rect(target, x + x0, y + y0, x + x1, y + y1, pixels, stride);
+        if (target->mask && mask) {
+            write_plane(target, target->mask, x + x0, y + y0, x + x1, y + y1, mask, stride);
+        } else if (target->mask) {
+            fill_plane(target, target->mask, x + x0, y + y0, x + x1, y + y1, 0xff);
+        }
+        return;
+    }
+    
+    for (int row = 0; row < y1 - y0; row++) {
+        const uint8_t* src = pixels + row * stride;
+        const uint8_t* coverage = mask + row * stride;
+        for (int col = 0; col < x1 - x0; col++) {
+            if (coverage[col] == SPRITE_UNTOUCHED) continue;
+            int index = canvas_index(target, x + x0 + col, y + y0 + row);
+            store_pixel(target, index, src[col]);
+            if (target->mask) {
+                target->mask[index] = coverage[col];
+            }
+        }
+    }
+}
+
+// Calls the apply for the local rectangle [x0, x1) x [y0, y1)
+static void run_direct(Canvas* target, const ApplyDesc* apply, int x0, int y0, int x1, int y1) {
+    if (target->layout == CANVAS_ROW_MAJOR) {
+        apply->fn(target, x0, y0, x1, y1, 1);
+        return;
+    }
+    
+    // Tiled canvases are painted a block at a time, in storage order
+    int tile_mask = CANVAS_TILE - 1;
+    for (int by = (apply->y + y0) & ~tile_mask; by < apply->y + y1; by += CANVAS_TILE) {
+        int sy0 = by - apply->y > y0 ? by - apply->y : y0;
+        int sy1 = by + CANVAS_TILE - apply->y < y1 ? by + CANVAS_TILE - apply->y : y1;
+        for (int bx = (apply->x + x0) & ~tile_mask; bx < apply->x + x1; bx += CANVAS_TILE) {
+            int sx0 = bx - apply->x > x0 ? bx - apply->x : x0;
+            int sx1 = bx + CANVAS_TILE - apply->x < x1 ? bx + CANVAS_TILE - apply->x : x1;
+            apply->fn(target, sx0, sy0, sx1, sy1, 1);
         }
-        printf("\n");
     }
 }
 
-void clear_canvas() {
-    if (canvas.buffer) {
-        memset(canvas.buffer, 0, canvas.width * canvas.height * sizeof(Color));
+// Applies with a `cache_key` are looked up in the tile cache by their
+// whole visible rectangle, [x0, x1) x [visible_y0, visible_y1), even when
+// only rows [y0, y1) are asked for. A hit is blitted like a sprite; a
+// miss is rendered whole into a scratch tile and stored, so the next band
+// of rows finds it.
+static void run_cached(Canvas* target, const ApplyDesc* apply, int x0, int y0, int x1, int y1,
+                       int visible_y0, int visible_y1) {
+    int width = x1 - x0;
+    int height = visible_y1 - visible_y0;
+    int placement[] = { apply->x, apply->y, apply->size, x0, visible_y0, x1, visible_y1 };
+    uint64_t key = tile_cache_key(apply->cache_key(), placement, 7);
+    
+    Sprite tile;
+    CachedTile cached;
+    if (tile_cache_get(key, width, height, &cached)) {
+        init_canvas_view(&tile.canvas, (uint8_t*)cached.pixels, width, height, width);
+        tile.canvas.mask = (uint8_t*)cached.mask;
+        tile.opaque = !cached.mask || !memchr(cached.mask, SPRITE_UNTOUCHED, (size_t)width * height);
+        blit_sprite(target, &tile, apply->x + x0, apply->y + visible_y0,
+                    0, y0 - visible_y0, width, y1 - visible_y0);
+        tile_cache_release(&cached);
+        return;
+    }
+    
+    uint8_t* buffer = (uint8_t*)calloc(width, height);
+    uint8_t* mask = (uint8_t*)malloc((size_t)width * height);
+    if (!buffer || !mask) {
+        free(buffer);
+        free(mask);
+        run_direct(target, apply, x0, y0, x1, y1);
+        return;
+    }
+    memset(mask, SPRITE_UNTOUCHED, (size_t)width * height);
+    
+    init_region(&tile.canvas, buffer, mask, target->width, target->height,
+                apply->x + x0, apply->y + visible_y0, apply->x + x1, apply->y + visible_y1);
+    apply->fn(&tile.canvas, x0, visible_y0, x1, visible_y1, 1);
+    tile_cache_put(key, buffer, mask, width, height);
+    
+    tile.opaque = !memchr(mask, SPRITE_UNTOUCHED, (size_t)width * height);
+    blit_sprite(target, &tile, apply->x + x0, apply->y + visible_y0,
+                0, y0 - visible_y0, width, y1 - visible_y0);
+    free(buffer);
+    free(mask);
+}
+
+// Progressive rendering (run_applies_progressive) goes from a coarse
+// grid to every pixel in passes. The pass at `stride` evaluates the
+// pixels whose canvas coordinates are multiples of stride, except those
+// earlier passes did (multiples of 2 * stride), and paints each one over
+// the stride x stride block to its right and below it. Those blocks never
+// contain samples of earlier passes, so every sample stays exact and the
+// last pass, at stride 1, leaves the same canvas as a full render.
+#define PROGRESSIVE_STRIDE 8
+
+// Grids of the pixels new at `stride`: up to 3 of them, each every
+// `*step` pixels from (offsets[2k], offsets[2k + 1]). Returns how many.
+static int progressive_grids(int stride, int* offsets, int* step) {
+    if (stride >= PROGRESSIVE_STRIDE) {
+        offsets[0] = offsets[1] = 0;
+        *step = stride;
+        return 1;
+    }
+    int grids[] = { stride, 0, 0, stride, stride, stride };
+    memcpy(offsets, grids, sizeof(grids));
+    *step = 2 * stride;
+    return 3;
+}
+
+// First coordinate from `from` on that is `offset` modulo `step`
+static int grid_start(int from, int offset, int step) {
+    int phase = (offset - from) % step;
+    return from + (phase < 0 ? phase + step : phase);
+}
+
+// A pass of progressive rendering over the local rectangle [x0, x1) x
+// [y0, y1). The samples are painted into a scratch region whose mask
+// tells the ones the stencil painted, cleared or left alone, or read from
+// the apply's sprite, and then spread over their blocks.
+static void run_sampled(Canvas* target, const ApplyDesc* apply, const Sprite* sprite,
+                        int x0, int y0, int x1, int y1, int stride) {
+    int width = x1 - x0;
+    int height = y1 - y0;
+    Canvas scratch;
+    uint8_t* buffer = NULL;
+    uint8_t* mask = NULL;
+    if (!sprite) {
+        buffer = (uint8_t*)malloc((size_t)width * height);
+        mask = (uint8_t*)malloc((size_t)width * height);
+        if (!buffer || !mask) {
+            fprintf(stderr, "Failed to allocate sample buffer\n");
+            exit(1);
+        }
+        init_region(&scratch, buffer, mask, target->width, target->height,
+                    apply->x + x0, apply->y + y0, apply->x + x1, apply->y + y1);
+    }
+    
+    // Local (x, y) is at y * pitch + x - base of pixels and coverage
+    const Canvas* samples = sprite ? &sprite->canvas : &scratch;
+    const uint8_t* pixels = samples->buffer;
+    const uint8_t* coverage = samples->mask;
+    int pitch = samples->stride;
+    int base = sprite ? 0 : y0 * pitch + x0;
+    
+    int offsets[6];
+    int step;
+    int grids = progressive_grids(stride, offsets, &step);
+    for (int k = 0; k < grids; k++) {
+        int sx0 = grid_start(apply->x + x0, offsets[2 * k], step) - apply->x;
+        int sy0 = grid_start(apply->y + y0, offsets[2 * k + 1], step) - apply->y;
+        if (sx0 >= x1 || sy0 >= y1) continue;
+        
+        if (!sprite) {
+            for (int y = sy0; y < y1; y += step) {
+                for (int x = sx0; x < x1; x += step) {
+                    mask[y * pitch + x - base] = SPRITE_UNTOUCHED;
+                }
+            }
+            apply->fn(&scratch, sx0, sy0, x1, y1, step);
+        }
+        
+        // The first pass has no samples to keep yet, so its first blocks
+        // also cover the edges of the rectangle before the grid starts
+        int first = stride >= PROGRESSIVE_STRIDE;
+        for (int y = sy0; y < y1; y += step) {
+            int block_y0 = first && y == sy0 ? y0 : y;
+            int block_y1 = y + stride < y1 ? y + stride : y1;
+            for (int x = sx0; x < x1; x += step) {
+                uint8_t covered = coverage[y * pitch + x - base];
+                if (covered == SPRITE_UNTOUCHED) continue;
+                
+                int block_x0 = first && x == sx0 ? x0 : x;
+                int block_x1 = x + stride < x1 ? x + stride : x1;
+                fill_pixels(target, apply->x + block_x0, apply->y + block_y0,
+                            apply->x + block_x1, apply->y + block_y1, pixels[y * pitch + x - base]);
+                if (target->mask) {
+                    fill_plane(target, target->mask, apply->x + block_x0, apply->y + block_y0,
+                               apply->x + block_x1, apply->y + block_y1, covered);
+                }
+            }
+        }
+    }
+    
+    free(buffer);
+    free(mask);
+}
+
+// Runs the local rectangle [x0, x1) x [y0, y1), which is on the canvas,
+// limited to canvas rows [rows_y0, rows_y1); a progressive pass when
+// `stride` isn't 0
+static void run_visible(Canvas* target, const ApplyDesc* apply, const Sprite* sprite,
+                        int x0, int y0, int x1, int y1, int rows_y0, int rows_y1, int stride) {
+    int band_y0 = rows_y0 - apply->y > y0 ? rows_y0 - apply->y : y0;
+    int band_y1 = rows_y1 - apply->y < y1 ? rows_y1 - apply->y : y1;
+    if (x0 >= x1 || band_y0 >= band_y1) return;
+    
+    if (stride > 0) {
+        run_sampled(target, apply, sprite, x0, band_y0, x1, band_y1, stride);
+    } else if (sprite) {
+        blit_sprite(target, sprite, apply->x, apply->y, x0, band_y0, x1, band_y1);
+    } else if (apply->cache_key && tile_cache_enabled()) {
+        run_cached(target, apply, x0, band_y0, x1, band_y1, y0, y1);
+    } else {
+        run_direct(target, apply, x0, band_y0, x1, band_y1);
+    }
+}
+
+// Pixels outside the canvas would be discarded by paint_pixel anyway, so
+// only the visible part of the apply is run, further limited to canvas
+// rows [rows_y0, rows_y1) and to the `visible` rectangles later applies
+// don't paint over. Applies that write globals are the exception: every
+// pixel they skip would change the values the later ones see, so they
+// always run whole and in order (they are never split into rows or
+// passes). Instanced applies blit their `sprite` instead, and
+// cacheable ones go through the tile cache when it is enabled. A nonzero
+// `stride` runs a pass of progressive rendering instead.
+static void run_apply(Canvas* target, const ApplyDesc* apply, const Sprite* sprite,
+                      int rows_y0, int rows_y1, int stride) {
+    if (apply->steps > 1 || apply->radius != 0) {
+        run_iterated(target, apply);
+        return;
+    }
+    if (apply->effects & APPLY_WRITES_GLOBALS) {
+        apply->fn(target, 0, 0, apply->size, apply->size, 1);
+        return;
+    }
+    
+    int x0 = apply->x < 0 ? -apply->x : 0;
+    int y0 = apply->y < 0 ? -apply->y : 0;
+    int x1 = apply->size;
+    int y1 = apply->size;
+    if (x1 > target->width - apply->x) x1 = target->width - apply->x;
+    if (y1 > target->height - apply->y) y1 = target->height - apply->y;
+    
+    if (!apply->visible) {
+        run_visible(target, apply, sprite, x0, y0, x1, y1, rows_y0, rows_y1, stride);
+        return;
+    }
+    for (int i = 0; i < apply->visible_count; i++) {
+        const int* rect = apply->visible + 4 * i;
+        run_visible(target, apply, sprite, rect[0] > x0 ? rect[0] : x0, rect[1] > y0 ? rect[1] : y0,
+                    rect[2] < x1 ? rect[2] : x1, rect[3] < y1 ? rect[3] : y1, rows_y0, rows_y1, stride);
+    }
+}
+
+// Set by threads that render on their own, see runtime_set_thread_count
+static __thread int thread_count_override = 0;
+
+// Limits the runs started from the calling thread to `threads` threads
+// (0 restores the default). With 1 everything runs on the calling
+// thread, which programs compiled with --batch need: their globals are
+// thread-local.
+void runtime_set_thread_count(int threads) {
+    thread_count_override = threads;
+}
+
+// Worker threads for run_applies: STENCIL_THREADS, or one per processor
+int runtime_thread_count(void) {
+    if (thread_count_override > 0) return thread_count_override;
+    const char* env = getenv("STENCIL_THREADS");
+    int threads = env ? atoi(env) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    return threads < 1 ? 1 : threads;
+}
+
+// Dispatch state of one run_applies call. An apply becomes ready once
+// every apply it depends on has finished, and ready applies are taken by
+// whichever worker is free.
+typedef struct {
+    const ApplyDesc* applies;
+    Canvas** targets;
+    Sprite** sprites;
+    int count;
+    int* waiting;    // unfinished dependencies of each apply
+    int* first;      // successors of i are successors[first[i]..first[i + 1])
+    int* successors;
+    int* ready;      // every apply is queued exactly once
+    int ready_head;
+    int ready_tail;
+    int finished;
+    int rows_y0;
+    int rows_y1;
+    int stride;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} Schedule;
+
+static void* schedule_worker(void* arg) {
+    Schedule* schedule = (Schedule*)arg;
+    
+    pthread_mutex_lock(&schedule->lock);
+    for (;;) {
+        while (schedule->ready_head == schedule->ready_tail && schedule->finished < schedule->count) {
+            pthread_cond_wait(&schedule->changed, &schedule->lock);
+        }
+        if (schedule->ready_head == schedule->ready_tail) break;
+        
+        int apply = schedule->ready[schedule->ready_head++];
+        pthread_mutex_unlock(&schedule->lock);
+        run_apply(schedule->targets[apply], &schedule->applies[apply], schedule->sprites[apply],
+                  schedule->rows_y0, schedule->rows_y1, schedule->stride);
+        pthread_mutex_lock(&schedule->lock);
+        
+        schedule->finished++;
+        for (int k = schedule->first[apply]; k < schedule->first[apply + 1]; k++) {
+            int next = schedule->successors[k];
+            if (--schedule->waiting[next] == 0) {
+                schedule->ready[schedule->ready_tail++] = next;
+            }
+        }
+        pthread_cond_broadcast(&schedule->changed);
+    }
+    pthread_mutex_unlock(&schedule->lock);
+    return NULL;
+}
+
+static void run_scheduled(const ApplyDesc* applies, Canvas** targets, Sprite** sprites, int count,
+                          int threads, int rows_y0, int rows_y1, int stride) {
+    Schedule schedule;
+    schedule.applies = applies;
+    schedule.targets = targets;
+    schedule.sprites = sprites;
+    schedule.count = count;
+    schedule.rows_y0 = rows_y0;
+    schedule.rows_y1 = rows_y1;
+    schedule.stride = stride;
+    schedule.waiting = (int*)calloc(count, sizeof(int));
+    schedule.first = (int*)calloc(count + 1, sizeof(int));
+    schedule.ready = (int*)malloc(sizeof(int) * count);
+    schedule.ready_head = 0;
+    schedule.ready_tail = 0;
+    schedule.finished = 0;
+    
+    // Invert the dependency lists into successor lists. Anything but an
+    // earlier apply is ignored, so a bad table can't deadlock.
+    int edges = 0;
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < applies[i].dep_count; k++) {
+            int dep = applies[i].deps[k];
+            if (dep < 0 || dep >= i) continue;
+            schedule.first[dep + 1]++;
+            schedule.waiting[i]++;
+            edges++;
+        }
     }
-}
\ No newline at end of file
+    for (int i = 0; i < count; i++) {
+        schedule.first[i + 1] += schedule.first[i];
+    }
+    
+    schedule.successors = (int*)malloc(sizeof(int) * (edges + 1));
+    int* fill = (int*)malloc(sizeof(int) * count);
+    memcpy(fill, schedule.first, sizeof(int) * count);
+    for (int i = 0; i < count; i++) {
+        for (int k = 0; k < applies[i].dep_count; k++) {
+            int dep = applies[i].deps[k];
+            if (dep < 0 || dep >= i) continue;
+            schedule.successors[fill[dep]++] = i;
+        }
+        if (schedule.waiting[i] == 0) {
+            schedule.ready[schedule.ready_tail++] = i;
+        }
+    }
+    free(fill);
+    
+    pthread_mutex_init(&schedule.lock, NULL);
+    pthread_cond_init(&schedule.changed, NULL);
+    
+    // The calling thread works too, so failing to start helpers only
+    // costs parallelism
+    pthread_t* workers = (pthread_t*)malloc(sizeof(pthread_t) * threads);
+    int started = 0;
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[started], NULL, schedule_worker, &schedule) == 0) {
+            started++;
+        }
+    }
+    schedule_worker(&schedule);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+    
+    pthread_mutex_destroy(&schedule.lock);
+    pthread_cond_destroy(&schedule.changed);
+    free(schedule.waiting);
+    free(schedule.first);
+    free(schedule.successors);
+    free(schedule.ready);
+}
+
+// Whether two applies paint different pixels of one byte of a packed
+// canvas: side by side, meeting at an odd column. Applies whose pixels
+// overlap are already ordered by their dependencies.
+static int share_packed_byte(const ApplyDesc* a, const ApplyDesc* b) {
+    if (a->y >= b->y + b->size || b->y >= a->y + a->size) return 0;
+    
+    int edge = a->x + a->size == b->x ? b->x : b->x + b->size == a->x ? a->x : 0;
+    return edge > 0 && (edge & 1);
+}
+
+// Applies that share a byte of a packed target update it with separate
+// read-modify-writes, so they mustn't run at the same time. Returns a
+// copy of the table in which they depend on each other too, with the
+// dependency lists in `*deps`, or NULL when no such pair exists.
+static ApplyDesc* order_packed_pairs(const ApplyDesc* applies, Canvas** targets, int count, int** deps) {
+    int extra = 0;
+    int total = 0;
+    for (int i = 0; i < count; i++) {
+        total += applies[i].dep_count;
+        if (targets[i]->format != CANVAS_PACKED4) continue;
+        for (int j = 0; j < i; j++) {
+            if (targets[j] == targets[i] && share_packed_byte(&applies[j], &applies[i])) extra++;
+        }
+    }
+    if (extra == 0) return NULL;
+    
+    ApplyDesc* ordered = (ApplyDesc*)malloc(sizeof(ApplyDesc) * count);
+    int* lists = (int*)malloc(sizeof(int) * (total + extra));
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        ordered[i] = applies[i];
+        ordered[i].deps = lists + used;
+        for (int k = 0; k < applies[i].dep_count; k++) {
+            lists[used++] = applies[i].deps[k];
+        }
+        if (targets[i]->format == CANVAS_PACKED4) {
+            for (int j = 0; j < i; j++) {
+                if (targets[j] == targets[i] && share_packed_byte(&applies[j], &applies[i])) {
+                    lists[used++] = j;
+                    ordered[i].dep_count++;
+                }
+            }
+        }
+    }
+    *deps = lists;
+    return ordered;
+}
+
+// Runs a whole program, with the same result as running it in order.
+// Without layer directives everything is painted straight into the
+// canvas; otherwise each layer is rendered into its own buffer and the
+// result is composited.
+int run_applies(Canvas* canvas, const ApplyDesc* applies, int count) {
+    return run_applies_rows(canvas, applies, count, 0, canvas->height);
+}
+
+// Whether a program can be rendered as independent bands of rows: no
+// pixel may depend on pixels of other rows, or on the order in which
+// rows are painted.
+int applies_split_by_rows(const ApplyDesc* applies, int count) {
+    for (int i = 0; i < count; i++) {
+        if (applies[i].steps > 1 || applies[i].radius != 0 ||
+            applies[i].effects & APPLY_WRITES_GLOBALS) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Whether the canvas can be packed (CANVAS_PACKED4) without changing
+// what is written out. Only ANSI output maps values to 8 colors, so the
+// other formats need every bit, and stencils that peek, even at their
+// own pixel, would read the truncated values.
+int packing_preserves_output(const ApplyDesc* applies, int count, OutputFormat format) {
+    if (format != OUTPUT_ANSI) return 0;
+    for (int i = 0; i < count; i++) {
+        if (applies[i].effects & APPLY_READS_CANVAS) return 0;
+    }
+    return 1;
+}
+
+static int has_layers(const ApplyDesc* applies, int count) {
+    for (int i = 0; i < count; i++) {
+        if (applies[i].layer != 0) return 1;
+    }
+    return 0;
+}
+
+// Layers left over from a previous run start out empty
+static void reset_layers(Canvas* canvas) {
+    for (int i = 0; i < canvas->layer_count; i++) {
+        if (canvas->layers[i].buffer) {
+            reset_layer(canvas_layer(canvas, i));
+        }
+    }
+}
+
+// Paints rows [y0, y1) and composites them, once the layers are reset;
+// with a nonzero `stride` only that pass of progressive rendering
+static void run_rows(Canvas* canvas, const ApplyDesc* applies, int count, Sprite** sprites,
+                     int layered, int y0, int y1, int stride) {
+    // Layers are allocated up front, workers only paint
+    Canvas** targets = (Canvas**)malloc(sizeof(Canvas*) * (count + 1));
+    for (int i = 0; i < count; i++) {
+        targets[i] = layered ? canvas_layer(canvas, applies[i].layer) : canvas;
+    }
+    
+    int threads = runtime_thread_count();
+    if (threads > count) threads = count;
+    
+    if (threads > 1) {
+        int* deps = NULL;
+        ApplyDesc* ordered = order_packed_pairs(applies, targets, count, &deps);
+        run_scheduled(ordered ? ordered : applies, targets, sprites, count, threads, y0, y1, stride);
+        free(ordered);
+        free(deps);
+    } else {
+        for (int i = 0; i < count; i++) {
+            run_apply(targets[i], &applies[i], sprites[i], y0, y1, stride);
+        }
+    }
+    free(targets);
+    
+    if (layered) {
+        composite_rows(canvas, y0, y1);
+    }
+}
+
+// run_applies limited to canvas rows [y0, y1), leaving the other rows of
+// the canvas untouched. Only meaningful if applies_split_by_rows.
+int run_applies_rows(Canvas* canvas, const ApplyDesc* applies, int count, int y0, int y1) {
+    int layered = has_layers(applies, count);
+    if (layered) {
+        reset_layers(canvas);
+    }
+    SpriteSet sprites;
+    render_sprites(&sprites, applies, count);
+    run_rows(canvas, applies, count, sprites.by_apply, layered, y0, y1, 0);
+    free_sprites(&sprites);
+    return 0;
+}
+
+// Resets the pixels the pass at `stride` is about to sample, on every
+// layer, so that they only get what this pass paints
+static void reset_samples(Canvas* canvas, int stride) {
+    int offsets[6];
+    int step;
+    int grids = progressive_grids(stride, offsets, &step);
+    int layer_count = canvas->layers ? canvas->layer_count : 0;
+    for (int i = -1; i < layer_count; i++) {
+        Canvas* target = i < 0 ? canvas : &canvas->layers[i];
+        if (!target->buffer) continue;
+        for (int k = 0; k < grids; k++) {
+            for (int y = offsets[2 * k + 1]; y < target->height; y += step) {
+                for (int x = offsets[2 * k]; x < target->width; x += step) {
+                    int index = canvas_index(target, x, y);
+                    store_pixel(target, index, 0);
+                    if (target->mask) {
+                        target->mask[index] = 0;
+                    }
+                }
+            }
+        }
+    }
+}
+
+// Renders a program in passes from coarse to fine (see
+// PROGRESSIVE_STRIDE), calling `done` with the canvas after each one and
+// the stride it is sampled at, 1 for the final image. Samples of earlier
+// passes are kept, so the passes together cost about one full render. The
+// canvas is cleared first. Programs that step, peek or write globals need
+// their pixels in order and are rendered in one pass: unlike splitting by
+// rows, sampling runs stencils on scratch regions, so even peek(0, 0)
+// (APPLY_READS_CANVAS with radius 0) rules it out.
+int run_applies_progressive(Canvas* canvas, const ApplyDesc* applies, int count,
+                            ProgressFn done, void* data) {
+    clear_canvas(canvas);
+    int sampled = applies_split_by_rows(applies, count);
+    for (int i = 0; i < count; i++) {
+        if (applies[i].effects & APPLY_READS_CANVAS) sampled = 0;
+    }
+    if (!sampled) {
+        int result = run_applies(canvas, applies, count);
+        done(canvas, 1, data);
+        return result;
+    }
+    
+    int layered = has_layers(applies, count);
+    if (layered) {
+        reset_layers(canvas);
+    }
+    SpriteSet sprites;
+    render_sprites(&sprites, applies, count);
+    for (int stride = PROGRESSIVE_STRIDE; stride >= 1; stride /= 2) {
+        if (stride < PROGRESSIVE_STRIDE) {
+            reset_samples(canvas, stride);
+        }
+        run_rows(canvas, applies, count, sprites.by_apply, layered, 0, canvas->height, stride);
+        done(canvas, stride, data);
+    }
+    free_sprites(&sprites);
+    return 0;
+}
+
+// Bands of rows finished by the compute thread, on their way to the
+// output thread. Single producer, single consumer: each index is only
+// written by one side, and the release/acquire pairs order the band
+// contents before the index that publishes them.
+typedef struct {
+    int bands[PIPELINE_QUEUE]; // first row of each band, -1 ends the stream
+    unsigned head; // next slot to fill, written by the producer
+    unsigned tail; // next slot to drain, written by the consumer
+} BandQueue;
+
+static void band_queue_push(BandQueue* queue, int y0) {
+    unsigned head = __atomic_load_n(&queue->head, __ATOMIC_RELAXED);
+    while (head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == PIPELINE_QUEUE) {
+        sched_yield(); // output is behind
+    }
+    queue->bands[head % PIPELINE_QUEUE] = y0;
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int band_queue_pop(BandQueue* queue) {
+    unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_RELAXED);
+    while (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) {
+        sched_yield(); // computation is behind
+    }
+    int y0 = queue->bands[tail % PIPELINE_QUEUE];
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+    return y0;
+}
+
+typedef struct {
+    BandQueue queue;
+    const Canvas* canvas;
+    OutputFormat format;
+    const Palette* palette;
+    FILE* out;
+} Pipeline;
+
+static void* output_worker(void* arg) {
+    Pipeline* pipeline = (Pipeline*)arg;
+    const Canvas* canvas = pipeline->canvas;
+    
+    for (int y0; (y0 = band_queue_pop(&pipeline->queue)) >= 0;) {
+        int y1 = y0 + PIPELINE_BAND < canvas->height ? y0 + PIPELINE_BAND : canvas->height;
+        write_canvas_rows(canvas, pipeline->format, pipeline->palette, y0, y1, pipeline->out);
+        fflush(pipeline->out);
+    }
+    return NULL;
+}
+
+// Runs the applies a band of PIPELINE_BAND rows at a time and writes
+// each finished band from an output thread, so that encoding and I/O
+// overlap with computing the next bands. Programs that don't
+// applies_split_by_rows are run whole and then written.
+int run_applies_pipelined(Canvas* canvas, const ApplyDesc* applies, int count,
+                          OutputFormat format, const Palette* palette, FILE* out) {
+    if (!applies_split_by_rows(applies, count)) {
+        int result = run_applies(canvas, applies, count);
+        write_canvas(canvas, format, palette, out);
+        return result;
+    }
+    
+    Pipeline* pipeline = (Pipeline*)calloc(1, sizeof(Pipeline));
+    pipeline->canvas = canvas;
+    pipeline->format = format;
+    pipeline->palette = palette;
+    pipeline->out = out;
+    
+    pthread_t output;
+    if (pthread_create(&output, NULL, output_worker, pipeline) != 0) {
+        free(pipeline);
+        int result = run_applies(canvas, applies, count);
+        write_canvas(canvas, format, palette, out);
+        return result;
+    }
+    
+    int layered = has_layers(applies, count);
+    if (layered) {
+        reset_layers(canvas);
+    }
+    SpriteSet sprites;
+    render_sprites(&sprites, applies, count);
+    for (int y0 = 0; y0 < canvas->height; y0 += PIPELINE_BAND) {
+        int y1 = y0 + PIPELINE_BAND < canvas->height ? y0 + PIPELINE_BAND : canvas->height;
+        run_rows(canvas, applies, count, sprites.by_apply, layered, y0, y1, 0);
+        band_queue_push(&pipeline->queue, y0);
+    }
+    band_queue_push(&pipeline->queue, -1);
+    free_sprites(&sprites);
+    
+    pthread_join(output, NULL);
+    free(pipeline);
+    return 0;
+}
+
+// Re-renders a single layer of a program previously run with run_applies
+// and composites again; the other layers are reused as they are.
+int run_layer(Canvas* canvas, const ApplyDesc* applies, int count, int layer) {
+    if (!canvas->layers) {
+        return run_applies(canvas, applies, count);
+    }
+    
+    Canvas* target = canvas_layer(canvas, layer);
+    reset_layer(target);
+    SpriteSet sprites;
+    render_sprites(&sprites, applies, count);
+    for (int i = 0; i < count; i++) {
+        if (applies[i].layer == layer) {
+            run_apply(target, &applies[i], sprites.by_apply[i], 0, canvas->height, 0);
+        }
+    }
+    free_sprites(&sprites);
+    composite_layers(canvas);
+    return 0;
+}
+
+// Counters of a program compiled with `parser --instrument`, which
+// registers them from a module constructor. They are added to the
+// profile file (STENCIL_PROFILE, stencil.profile by default) at exit, so
+// several runs accumulate into one profile for `parser --profile-use`.
+static uint64_t* profile_counters = NULL;
+static int profile_counter_count = 0;
+
+// Registering another program's counters (or NULL, before unloading a
+// module) writes out the current ones first.
+void profile_register(uint64_t* counters, int count) {
+    static int at_exit = 0;
+    if (profile_counters == counters) return;
+    
+    profile_flush();
+    if (!at_exit) {
+        atexit(profile_flush);
+        at_exit = 1;
+    }
+    profile_counters = counters;
+    profile_counter_count = count;
+}
+
+// Adds the counters to the profile file and resets them. Forked workers
+// call this before _exit; the file is locked while it's rewritten.
+void profile_flush(void) {
+    if (!profile_counters) return;
+    
+    const char* path = getenv("STENCIL_PROFILE");
+    if (!path || !*path) path = "stencil.profile";
+    
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror(path);
+        return;
+    }
+    flock(fd, LOCK_EX);
+    FILE* file = fdopen(fd, "r+");
+    
+    // Counts of an earlier run of the same program are kept
+    int count = profile_counter_count;
+    uint64_t* totals = (uint64_t*)calloc(count + 1, sizeof(uint64_t));
+    int existing;
+    if (fscanf(file, "stencil-profile %d", &existing) == 1 && existing == count) {
+        for (int i = 0; i < count; i++) {
+            unsigned long long value;
+            if (fscanf(file, "%llu", &value) != 1) break;
+            totals[i] = value;
+        }
+    }
+    
+    // The counters are left alone if the old contents can't be dropped,
+    // so that they aren't lost
+    rewind(file);
+    if (ftruncate(fd, 0) < 0) {
+        perror(path);
+        flock(fd, LOCK_UN);
+        fclose(file);
+        free(totals);
+        return;
+    }
+    fprintf(file, "stencil-profile %d\n", count);
+    for (int i = 0; i < count; i++) {
+        totals[i] += __atomic_exchange_n(&profile_counters[i], 0, __ATOMIC_RELAXED);
+        fprintf(file, "%llu\n", (unsigned long long)totals[i]);
+    }
+    
+    fflush(file);
+    flock(fd, LOCK_UN);
+    fclose(file);
+    free(totals);
+}
@@ -2,29 +2,219 @@
 #define RUNTIME_H
 
 #include <stdint.h>
+#include <stdio.h>
 
 #define DEFAULT_CANVAS_WIDTH 100
 #define DEFAULT_CANVAS_HEIGHT 100
-#define MAX_CANVAS_WIDTH 200
-#define MAX_CANVAS_HEIGHT 200
+#define MAX_CANVAS_WIDTH 4096
+#define MAX_CANVAS_HEIGHT 4096
 
 typedef struct {
     uint8_t code;
 } Color;
 
+#define PALETTE_SIZE 256
+
+// Packed 32-bit pixel, bytes R, G, B, A in memory order.
+#define RGBA(r, g, b, a) ((uint32_t)(r) | ((uint32_t)(g) << 8) | ((uint32_t)(b) << 16) | ((uint32_t)(a) << 24))
+
+// Maps every raw pixel value to a packed RGBA color.
 typedef struct {
-    Color* buffer;
+    uint32_t colors[PALETTE_SIZE];
+} Palette;
+
+typedef enum {
+    OUTPUT_ANSI,
+    OUTPUT_TRUECOLOR,
+    OUTPUT_PPM,
+    OUTPUT_RAW
+} OutputFormat;
+
+#define MAX_LAYERS 16
+
+// How pixels are arranged in a canvas buffer. Row-major is y * stride + x.
+// The tiled layouts store blocks of CANVAS_TILE x CANVAS_TILE pixels
+// contiguously, blocks in row-major order, and the pixels inside a block
+// row-major (CANVAS_TILED) or in Z-order (CANVAS_MORTON). Tiled canvases
+// are padded to whole blocks and `stride` is the padded width.
+typedef enum {
+    CANVAS_ROW_MAJOR,
+    CANVAS_TILED,
+    CANVAS_MORTON
+} CanvasLayout;
+
+#define CANVAS_TILE_SHIFT 5
+#define CANVAS_TILE (1 << CANVAS_TILE_SHIFT)
+
+// How pixel values are stored. CANVAS_PACKED4 keeps two pixels per byte,
+// the one with the even index in the low nibble, and only the low 4 bits
+// of each value: enough for the 8 ANSI colors, at half the memory. Peek
+// would read the truncated values, so packing is only used where it
+// can't change the output (see packing_preserves_output). Packed
+// canvases are row-major with an even stride, so rows start on a byte.
+typedef enum {
+    CANVAS_BYTES,
+    CANVAS_PACKED4
+} CanvasFormat;
+
+// run_applies_pipelined: rows per band, and bands the output thread may
+// fall behind by (a power of two)
+#define PIPELINE_BAND 16
+#define PIPELINE_QUEUE 64
+
+// Pixels are stored raw: the low byte of the painted value, arranged as
+// `layout` says (see canvas_index). Colors are only resolved when the canvas is written out.
+// The buffer is either owned by the canvas (capacity > 0) or borrowed from
+// the caller (capacity == 0), see init_canvas_view.
+//
+// Programs that use `apply ... layer N` paint into separate layers, each a
+// canvas of the same size with a coverage mask (0xff painted, 0 transparent;
+// layer 0 is opaque). The layers are kept between runs and composited into
+// `buffer`, lowest layer first.
+typedef struct Canvas {
+    uint8_t* buffer;
+    uint8_t* mask;
     int width;
     int height;
+    int stride;
+    int capacity;
+    struct Canvas* layers;
+    int layer_count;
+    // Canvas coordinates of buffer[0]; nonzero only for the scratch tiles
+    // of iterated applies, whose buffers cover part of the canvas
+    int origin_x;
+    int origin_y;
+    // What peek_pixel reads, when it isn't the canvas being painted
+    const struct Canvas* source;
+    // Only canvases that own their buffer can be tiled or packed
+    CanvasLayout layout;
+    CanvasFormat format;
 } Canvas;
 
-void init_canvas(int width, int height);
-void cleanup_canvas();
-void paint_pixel(int x, int y, int color);
-int get_canvas_width();
-int get_canvas_height();
-void render_canvas();
-void clear_canvas();
+// Spreads the low CANVAS_TILE_SHIFT bits of v to the even bit positions
+static inline int morton_spread(int v) {
+    v &= CANVAS_TILE - 1;
+    v = (v | (v << 4)) & 0x0f0f;
+    v = (v | (v << 2)) & 0x3333;
+    v = (v | (v << 1)) & 0x5555;
+    return v;
+}
+
+// Offset of pixel (x, y) in the buffer; x and y are relative to the
+// buffer's origin and not negative
+static inline int canvas_index(const Canvas* canvas, int x, int y) {
+    if (canvas->layout == CANVAS_ROW_MAJOR) {
+        return y * canvas->stride + x;
+    }
+    
+    int block = (y >> CANVAS_TILE_SHIFT) * (canvas->stride << CANVAS_TILE_SHIFT) +
+                ((x >> CANVAS_TILE_SHIFT) << (2 * CANVAS_TILE_SHIFT));
+    if (canvas->layout == CANVAS_TILED) {
+        return block + ((y & (CANVAS_TILE - 1)) << CANVAS_TILE_SHIFT) + (x & (CANVAS_TILE - 1));
+    }
+    return block + morton_spread(x) + (morton_spread(y) << 1);
+}
+
+// How many pixels from (x, y) rightwards, at most `width`, are stored
+// one after the other
+static inline int canvas_run(const Canvas* canvas, int x, int width) {
+    int run;
+    switch (canvas->layout) {
+        case CANVAS_TILED: run = CANVAS_TILE - (x & (CANVAS_TILE - 1)); break;
+        case CANVAS_MORTON: run = x & 1 ? 1 : 2; break;
+        default: run = width; break;
+    }
+    return run < width ? run : width;
+}
+
+// Runs an apply over the sub-rectangle [x0, x1) x [y0, y1) of the
+// stencil's local coordinates, painting into `target`. With a `step`
+// above 1 only every step-th pixel from (x0, y0) in both directions has
+// to be painted (see run_applies_progressive), though others may be too.
+typedef void (*ApplyFn)(Canvas* target, int x0, int y0, int x1, int y1, int step);
+
+// One `apply` statement, as emitted by the code generator. `deps` lists
+// the earlier applies (by index) this one has to wait for; applies that
+// don't depend on each other may run concurrently. An apply with `steps`
+// or whose stencil peeks at neighbours is iterated over double buffers;
+// `radius` bounds how far peek reaches, negative when it isn't known.
+// `effects` says whether the stencil reads or writes global variables,
+// and whether it reads the canvas at all (any peek, even at its own pixel).
+// Applies of a stencil that paints the same wherever it is placed, used
+// more than once with the same size, have a `sprite` function: the apply
+// with its corner at (0, 0). It is rendered once and blitted.
+// `cache_key`, when set, hashes the stencil's code and the globals it
+// reads, for the tile cache (see tilecache.h). `visible`, when set, holds
+// `visible_count` rectangles x0, y0, x1, y1 of local coordinates: later
+// applies paint over everything else, so only these are run.
+typedef struct {
+    ApplyFn fn;
+    int x;
+    int y;
+    int size;
+    int layer;
+    const int* deps;
+    int dep_count;
+    int steps;
+    int radius;
+    int effects;
+    ApplyFn sprite;
+    uint64_t (*cache_key)(void);
+    const int* visible;
+    int visible_count;
+} ApplyDesc;
+
+#define APPLY_READS_GLOBALS 1
+#define APPLY_WRITES_GLOBALS 2
+#define APPLY_READS_CANVAS 4
+
+void init_canvas(Canvas* canvas, int width, int height);
+void init_canvas_view(Canvas* canvas, uint8_t* buffer, int width, int height, int stride);
+void set_canvas_buffer(Canvas* canvas, uint8_t* buffer, int width, int height, int stride);
+void resize_canvas(Canvas* canvas, int width, int height);
+void set_canvas_layout(Canvas* canvas, CanvasLayout layout);
+void set_canvas_format(Canvas* canvas, CanvasFormat format);
+int parse_canvas_layout(const char* name, CanvasLayout* layout);
+const uint8_t* canvas_row(const Canvas* canvas, int y, uint8_t* scratch);
+void cleanup_canvas(Canvas* canvas);
+void paint_pixel(Canvas* canvas, int x, int y, int color);
+void clear_pixel(Canvas* canvas, int x, int y);
+int peek_pixel(Canvas* canvas, int x, int y);
+void fill_rect(Canvas* canvas, int x, int y, int width, int height, int value);
+int get_canvas_width(Canvas* canvas);
+int get_canvas_height(Canvas* canvas);
+void render_canvas(const Canvas* canvas);
+void render_canvas_to(const Canvas* canvas, FILE* out);
+void write_canvas_raw(const Canvas* canvas, FILE* out);
+void write_canvas(const Canvas* canvas, OutputFormat format, const Palette* palette, FILE* out);
+void write_canvas_rows(const Canvas* canvas, OutputFormat format, const Palette* palette,
+                       int y0, int y1, FILE* out);
+int parse_output_format(const char* name, OutputFormat* format);
+
+void default_palette(Palette* palette);
+int load_palette(Palette* palette, FILE* in);
+void convert_to_rgba(const Canvas* canvas, const Palette* palette, uint32_t* out, int out_stride);
+void render_rgba_truecolor(const uint32_t* pixels, int width, int height, int stride, FILE* out);
+void write_rgba_ppm(const uint32_t* pixels, int width, int height, int stride, FILE* out);
+void clear_canvas(Canvas* canvas);
 Color value_to_color(int value);
 
-#endif
\ No newline at end of file
+Canvas* canvas_layer(Canvas* canvas, int layer);
+void composite_layers(Canvas* canvas);
+int run_applies(Canvas* canvas, const ApplyDesc* applies, int count);
+int run_applies_rows(Canvas* canvas, const ApplyDesc* applies, int count, int y0, int y1);
+int run_applies_pipelined(Canvas* canvas, const ApplyDesc* applies, int count,
+                          OutputFormat format, const Palette* palette, FILE* out);
+typedef void (*ProgressFn)(const Canvas* canvas, int stride, void* data);
+int run_applies_progressive(Canvas* canvas, const ApplyDesc* applies, int count,
+                            ProgressFn done, void* data);
+int applies_split_by_rows(const ApplyDesc* applies, int count);
+int packing_preserves_output(const ApplyDesc* applies, int count, OutputFormat format);
+int run_layer(Canvas* canvas, const ApplyDesc* applies, int count, int layer);
+int runtime_thread_count(void);
+void runtime_set_thread_count(int threads);
+
+void profile_register(uint64_t* counters, int count);
+void profile_flush(void);
+
+#endif
@@ -0,0 +1,99 @@
+#include "stencil.h"
+#include "runtime.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct stencil_ctx {
+    Canvas canvas;
+    Palette palette;
+    // Index buffer reused by stencil_render_rgba
+    uint8_t* scratch;
+    int scratch_size;
+};
+
+stencil_ctx* stencil_ctx_create(void) {
+    stencil_ctx* ctx = (stencil_ctx*)calloc(1, sizeof(stencil_ctx));
+    if (ctx) {
+        default_palette(&ctx->palette);
+    }
+    return ctx;
+}
+
+void stencil_ctx_destroy(stencil_ctx* ctx) {
+    if (!ctx) return;
+    cleanup_canvas(&ctx->canvas);
+    free(ctx->scratch);
+    free(ctx);
+}
+
+int stencil_render(stencil_ctx* ctx, stencil_program program,
+                   uint8_t* buf, int width, int height, int stride) {
+    if (!ctx || !program || !buf || width <= 0 || height <= 0 || stride < width) {
+        return -1;
+    }
+
+    set_canvas_buffer(&ctx->canvas, buf, width, height, stride);
+    clear_canvas(&ctx->canvas);
+
+    return program(&ctx->canvas);
+}
+
+int stencil_render_layer(stencil_ctx* ctx, const void* applies, int apply_count, int layer,
+                         uint8_t* buf, int width, int height, int stride) {
+    if (!ctx || !applies || !buf || width <= 0 || height <= 0 || stride < width) {
+        return -1;
+    }
+
+    set_canvas_buffer(&ctx->canvas, buf, width, height, stride);
+
+    return run_layer(&ctx->canvas, (const ApplyDesc*)applies, apply_count, layer);
+}
+
+typedef struct {
+    stencil_pass_fn pass;
+    void* user;
+} PassForward;
+
+static void forward_pass(const Canvas* canvas, int stride, void* data) {
+    PassForward* forward = (PassForward*)data;
+    forward->pass(canvas->buffer, stride, forward->user);
+}
+
+int stencil_render_progressive(stencil_ctx* ctx, const void* applies, int apply_count,
+                               uint8_t* buf, int width, int height, int stride,
+                               stencil_pass_fn pass, void* user) {
+    if (!ctx || !applies || !buf || !pass || width <= 0 || height <= 0 || stride < width) {
+        return -1;
+    }
+
+    set_canvas_buffer(&ctx->canvas, buf, width, height, stride);
+
+    PassForward forward = { pass, user };
+    return run_applies_progressive(&ctx->canvas, (const ApplyDesc*)applies, apply_count,
+                                   forward_pass, &forward);
+}
+
+void stencil_ctx_set_palette(stencil_ctx* ctx, const uint32_t* colors) {
+    memcpy(ctx->palette.colors, colors, sizeof(ctx->palette.colors));
+}
+
+int stencil_render_rgba(stencil_ctx* ctx, stencil_program program,
+                        uint32_t* buf, int width, int height, int stride) {
+    if (!ctx || !buf || width <= 0 || height <= 0 || stride < width) {
+        return -1;
+    }
+
+    if (width * height > ctx->scratch_size) {
+        free(ctx->scratch);
+        ctx->scratch = (uint8_t*)malloc(width * height);
+        if (!ctx->scratch) {
+            ctx->scratch_size = 0;
+            return -1;
+        }
+        ctx->scratch_size = width * height;
+    }
+
+    int result = stencil_render(ctx, program, ctx->scratch, width, height, width);
+    convert_to_rgba(&ctx->canvas, &ctx->palette, buf, stride);
+    return result;
+}
@@ -0,0 +1,62 @@
+#ifndef STENCIL_H
+#define STENCIL_H
+
+#include <stdint.h>
+
+// Embedding API. A compiled stencil program is its `llvm_main` entry point;
+// it renders into a buffer owned by the caller, writing one palette index
+// (the low byte of the painted value) per pixel.
+//
+// A context holds the canvas and palette; the program's globals belong to
+// the whole process. llvm_main resets them before every render, so each
+// render starts from the same state, but renders of a program that writes
+// globals must not run at the same time, even in separate contexts.
+// Programs that don't write globals may render concurrently from
+// different threads, one context per thread.
+
+typedef struct stencil_ctx stencil_ctx;
+typedef int (*stencil_program)(void* canvas);
+
+stencil_ctx* stencil_ctx_create(void);
+void stencil_ctx_destroy(stencil_ctx* ctx);
+
+// Clears the width x height region of `buf` (rows `stride` bytes apart)
+// and runs `program` into it. Returns the program's exit value.
+int stencil_render(stencil_ctx* ctx, stencil_program program,
+                   uint8_t* buf, int width, int height, int stride);
+
+// Re-renders only the applies on `layer` and composites the result into
+// `buf` again, reusing the other layers kept by `ctx` from the previous
+// render of the same program. `applies` and `apply_count` are the program's
+// exported `stencil_applies` and `stencil_apply_count`. This doesn't go
+// through llvm_main: call the program's `stencil_reset_globals` first to
+// start from the globals' initial values.
+int stencil_render_layer(stencil_ctx* ctx, const void* applies, int apply_count, int layer,
+                         uint8_t* buf, int width, int height, int stride);
+
+// Called after each pass of stencil_render_progressive, with the buffer
+// as it stands and the spacing of the pixels computed so far: 8, 4, 2,
+// then 1 for the final image.
+typedef void (*stencil_pass_fn)(const uint8_t* buf, int spacing, void* user);
+
+// Clears `buf` and renders the program (its `stencil_applies` and
+// `stencil_apply_count`, as for stencil_render_layer) in passes from a
+// coarse grid to every pixel, calling `pass` after each one so the caller
+// can redraw. Each pass only computes the pixels the earlier ones didn't.
+// Programs that use `steps`, peek or write globals are rendered in a
+// single pass. As with stencil_render_layer, the globals are only reset
+// by calling `stencil_reset_globals`.
+int stencil_render_progressive(stencil_ctx* ctx, const void* applies, int apply_count,
+                               uint8_t* buf, int width, int height, int stride,
+                               stencil_pass_fn pass, void* user);
+
+// Replaces the palette used by stencil_render_rgba. `colors` holds 256
+// packed RGBA entries (bytes R, G, B, A in memory order).
+void stencil_ctx_set_palette(stencil_ctx* ctx, const uint32_t* colors);
+
+// Like stencil_render, but resolves the palette and writes one packed RGBA
+// pixel per element (`stride` is in pixels).
+int stencil_render_rgba(stencil_ctx* ctx, stencil_program program,
+                        uint32_t* buf, int width, int height, int stride);
+
+#endif
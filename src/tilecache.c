@@ -0,0 +1,149 @@
+#include "tilecache.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* cache_dir = NULL;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+// Updated by every render thread
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static unsigned long cache_stores = 0;
+static unsigned long cache_bytes = 0;
+
+static void open_cache(void) {
+    const char* dir = getenv("STENCIL_CACHE");
+    if (!dir || !*dir) return;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        perror(dir);
+        return;
+    }
+    cache_dir = dir;
+}
+
+int tile_cache_enabled(void) {
+    pthread_once(&cache_once, open_cache);
+    return cache_dir != NULL;
+}
+
+// Mixes the apply's size, position and visible rectangle into the key
+// of its stencil's code and globals
+uint64_t tile_cache_key(uint64_t code_key, const int* values, int count) {
+    uint64_t hash = code_key;
+    const uint8_t* bytes = (const uint8_t*)values;
+    for (size_t i = 0; i < sizeof(int) * count; i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void tile_path(char* path, size_t size, uint64_t key, int make_dir) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+
+    snprintf(path, size, "%s/%.2s", cache_dir, hex);
+    if (make_dir) {
+        mkdir(path, 0755);
+    }
+    snprintf(path, size, "%s/%.2s/%s.tile", cache_dir, hex, hex + 2);
+}
+
+// Maps the tile stored under `key`, if there is one of the expected size
+int tile_cache_get(uint64_t key, int width, int height, CachedTile* tile) {
+    if (!tile_cache_enabled()) return 0;
+
+    char path[4096];
+    tile_path(path, sizeof(path), key, 0);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    struct stat info;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof(TileHeader)) {
+        map = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    // Collisions and damaged files are misses
+    size_t pixels = (size_t)width * height;
+    const TileHeader* header = (const TileHeader*)map;
+    if (map == MAP_FAILED || header->magic != TILE_MAGIC || header->key != key ||
+        header->width != (uint32_t)width || header->height != (uint32_t)height ||
+        (size_t)info.st_size != sizeof(TileHeader) + pixels * (header->flags & TILE_HAS_MASK ? 2 : 1)) {
+        if (map != MAP_FAILED) munmap(map, info.st_size);
+        __atomic_add_fetch(&cache_misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    tile->pixels = (const uint8_t*)(header + 1);
+    tile->mask = header->flags & TILE_HAS_MASK ? tile->pixels + pixels : NULL;
+    tile->width = width;
+    tile->height = height;
+    tile->map = map;
+    tile->map_size = info.st_size;
+    __atomic_add_fetch(&cache_hits, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&cache_bytes, info.st_size, __ATOMIC_RELAXED);
+    return 1;
+}
+
+void tile_cache_release(CachedTile* tile) {
+    munmap(tile->map, tile->map_size);
+}
+
+// Stores a rendered tile; the mask is dropped when every pixel was painted.
+// Failing to write only means the tile is rendered again next time.
+void tile_cache_put(uint64_t key, const uint8_t* pixels, const uint8_t* mask, int width, int height) {
+    if (!tile_cache_enabled()) return;
+
+    size_t count = (size_t)width * height;
+    int has_mask = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (mask[i] != 0xff) {
+            has_mask = 1;
+            break;
+        }
+    }
+
+    char path[4096];
+    char temp[4200];
+    tile_path(path, sizeof(path), key, 1);
+    snprintf(temp, sizeof(temp), "%s.%d.%lx", path, (int)getpid(), (unsigned long)pthread_self());
+
+    FILE* file = fopen(temp, "wb");
+    if (!file) return;
+
+    TileHeader header = { TILE_MAGIC, (uint32_t)width, (uint32_t)height, has_mask ? TILE_HAS_MASK : 0, key };
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(pixels, 1, count, file) == count &&
+             (!has_mask || fwrite(mask, 1, count, file) == count);
+    ok = fclose(file) == 0 && ok;
+
+    if (ok && rename(temp, path) == 0) {
+        __atomic_add_fetch(&cache_stores, 1, __ATOMIC_RELAXED);
+    } else {
+        unlink(temp);
+    }
+}
+
+void tile_cache_report(FILE* out) {
+    if (!tile_cache_enabled()) return;
+
+    unsigned long hits = __atomic_load_n(&cache_hits, __ATOMIC_RELAXED);
+    unsigned long misses = __atomic_load_n(&cache_misses, __ATOMIC_RELAXED);
+    unsigned long lookups = hits + misses;
+    fprintf(out, "tile cache: %lu hits, %lu misses (%.1f%% hit rate), %lu stored, %lu bytes read\n",
+            hits, misses, lookups ? 100.0 * hits / lookups : 0.0,
+            __atomic_load_n(&cache_stores, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache_bytes, __ATOMIC_RELAXED));
+}
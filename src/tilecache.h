@@ -0,0 +1,51 @@
+#ifndef TILECACHE_H
+#define TILECACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Content-addressed cache of rendered apply rectangles, kept on disk
+// between runs in the directory named by STENCIL_CACHE (disabled when it
+// isn't set). A tile is keyed by a hash of the stencil's code, the values
+// of the globals it reads, and the apply's size, position and visible
+// rectangle; its file is <dir>/<first 2 hex digits>/<rest>.tile:
+//
+//   TileHeader, then width * height pixel values, then (when
+//   TILE_HAS_MASK) width * height coverage bytes as in a sprite:
+//   0xff painted, 0 cleared, TILE_UNTOUCHED left alone.
+//
+// Tiles without a mask were painted everywhere. Files are written under
+// a temporary name and renamed, so concurrent runs never see a partial
+// tile, and are read back with mmap.
+
+#define TILE_MAGIC 0x31435453 // "STC1"
+#define TILE_HAS_MASK 1
+#define TILE_UNTOUCHED 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t width;
+    uint32_t height;
+    uint32_t flags;
+    uint64_t key;
+} TileHeader;
+
+// A tile mapped from the cache, valid until tile_cache_release
+typedef struct {
+    const uint8_t* pixels;
+    const uint8_t* mask; // NULL when every pixel was painted
+    int width;
+    int height;
+    void* map;
+    size_t map_size;
+} CachedTile;
+
+int tile_cache_enabled(void);
+uint64_t tile_cache_key(uint64_t code_key, const int* values, int count);
+int tile_cache_get(uint64_t key, int width, int height, CachedTile* tile);
+void tile_cache_release(CachedTile* tile);
+void tile_cache_put(uint64_t key, const uint8_t* pixels, const uint8_t* mask, int width, int height);
+void tile_cache_report(FILE* out);
+
+#endif